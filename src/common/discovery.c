@@ -249,6 +249,9 @@ int resource_discover(cl_platform_id **ids, mcl_platform_t **plt,
             }
             Dprintf("Required alignment size in bytes: %d", mem_alignment);
 #endif
+            dev->launch_ns = 0;
+            dev->bw_h2d = 0.0;
+            dev->bw_d2h = 0.0;
             dev->cl_ctxt = NULL;
             memset(dev->cl_queue, 0, sizeof(cl_command_queue) * MCL_MAX_QUEUES_PER_DEVICE);
 
@@ -257,24 +260,29 @@ int resource_discover(cl_platform_id **ids, mcl_platform_t **plt,
             case CL_DEVICE_TYPE_CPU:
                 dev->type = MCL_TASK_CPU;
                 dev->pes = __get_pes(dev);
+                dev->pes_mul = MCL_DEV_MUL_CPU;
                 dev->max_kernels = MCL_DEV_MKERNELS_CPU;
                 break;
             case CL_DEVICE_TYPE_GPU:
                 dev->type = MCL_TASK_GPU;
                 dev->pes = __get_pes(dev);
+                dev->pes_mul = MCL_DEV_MUL_GPU;
                 dev->max_kernels = MCL_DEV_MKERNELS_GPU;
                 break;
             case CL_DEVICE_TYPE_ACCELERATOR:
                 dev->type = MCL_TASK_FPGA;
                 dev->pes = __get_pes(dev);
+                dev->pes_mul = MCL_DEV_MUL_FPGA;
                 dev->max_kernels = MCL_DEV_MKERNELS_FPGA;
                 break;
             case CL_DEVICE_TYPE_CUSTOM:
 		if (strstr(dev->name, "PROTEUS") != NULL) {
 			dev->type = MCL_TASK_PROTEUS;
+			dev->pes_mul = 1;
 			dev->max_kernels = MCL_DEV_MKERNELS_PROTEUS;	
 		} else {
 			dev->type = MCL_TASK_DF;
+			dev->pes_mul = MCL_DEV_MUL_DF;
 			dev->max_kernels = MCL_DEV_MKERNELS_DF;
 		}
 		dev->pes = __get_pes(dev);
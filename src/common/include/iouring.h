@@ -0,0 +1,54 @@
+/**
+ * \file
+ * IOURING - Datagram socket I/O through io_uring
+ */
+
+#ifndef _IOURING_H
+#define _IOURING_H
+
+#include <stddef.h>
+#include <sys/socket.h>
+
+/*
+ * Drop-in replacements for sendmmsg()/recvmmsg() on non-blocking datagram
+ * sockets. Every sending thread gets its own io_uring, created the first time
+ * it sends.
+ *
+ * Receives use a multishot recvmsg armed on the socket by a single thread of
+ * the process, the first one to call iou_pollfd(). The kernel places each
+ * datagram in a buffer of a ring of provided buffers registered with
+ * io_uring, so receiving a message takes no system call. Other threads
+ * receive with recvmmsg().
+ * Sends are linked, so a message that would block cancels the ones after it
+ * and the datagrams stay in order.
+ */
+
+/**
+ * Set the largest datagram to receive and check that the kernel supports
+ * everything the backend needs, multishot recvmsg included (Linux 6.0).
+ * Creates no io_uring that outlives the call.
+ * @return 0 on success, -1 if io_uring cannot be used.
+ */
+int iou_setup(size_t payload);
+
+/**
+ * Same semantics as sendmmsg(fd, hdr, n, MSG_DONTWAIT).
+ */
+int iou_sendmmsg(int fd, struct mmsghdr *hdr, unsigned int n);
+
+/**
+ * Same semantics as recvmmsg(fd, hdr, n, MSG_DONTWAIT, NULL). Only the
+ * first iovec of each message is used. Falls back to recvmmsg() when the
+ * calling thread does not own the receive ring or cannot arm it.
+ */
+int iou_recvmmsg(int fd, struct mmsghdr *hdr, unsigned int n);
+
+/**
+ * Make the calling thread the receiver of the process and arm its receive
+ * ring on fd.
+ * @return a descriptor that becomes readable when messages are ready for
+ * iou_recvmmsg() on fd, -1 on failure or if another thread is the receiver.
+ */
+int iou_pollfd(int fd);
+
+#endif
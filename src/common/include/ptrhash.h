@@ -15,6 +15,7 @@
 struct ph_table {
 	size_t mask;
 	size_t count;
+	size_t graves;
 	void *buckets[0];
 };
 
@@ -62,6 +63,18 @@ void hashlittle2(
 	out = ph_remove_generic(table, key, offsetof(typeof(*out), keyfield), sizeof((*out).keyfield)); \
 })
 
+/** 
+ * Move all the elements to a new hash table of the given size.
+ * @param table: hash table pointer.
+ * @param size: size of the new table, power of two.
+ * @param type: type of the elements.
+ * @param keyfield: name of the field containing the key.
+ * @return the new table (the old one is freed), NULL on failure (the old
+ * table is left untouched).
+ */ 
+#define ph_resize(table, size, type, keyfield) \
+	ph_resize_generic(table, size, offsetof(type, keyfield), sizeof(((type *)0)->keyfield))
+
 struct ph_table *ph_init(size_t size);
 
 /** 
@@ -94,6 +107,17 @@ void *ph_get_generic(struct ph_table *h, const void *key, size_t keyoff, size_t
  */ 
 void *ph_remove_generic(struct ph_table *h, const void *key, size_t keyoff, size_t keylen);
 
+/** 
+ * Move all the elements to a new hash table, dropping tombstones.
+ * @param h: hash table pointer.
+ * @param size: size of the new table, power of two, larger than the number
+ * of elements.
+ * @param keyoff: offset in bytes of the key in the value structure.
+ * @param keylen: length in bytes of the key.
+ * @return the new table (h is freed), NULL on failure (h is left untouched).
+ */ 
+struct ph_table *ph_resize_generic(struct ph_table *h, size_t size, size_t keyoff, size_t keylen);
+
 /** 
  * Returns the number of elements of the hash table.
  * @param h: hash table pointer.
@@ -104,4 +128,14 @@ static inline size_t ph_count(const struct ph_table *h)
 	return h->count;
 }
 
+/** 
+ * Returns the number of buckets in use, elements and tombstones.
+ * @param h: hash table pointer.
+ * @return number of non-empty buckets
+ */ 
+static inline size_t ph_used(const struct ph_table *h)
+{
+	return h->count + h->graves;
+}
+
 #endif
@@ -0,0 +1,98 @@
+/**
+ * \file
+ * RING - Bounded lock-free queue of fixed-size slots
+ */
+
+#ifndef _RING_H
+#define _RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define RING_CACHELINE 64
+
+/*
+ * The ring does not contain pointers, so it can be placed in a shared memory
+ * segment and mapped at different addresses by different processes. Any
+ * number of producers and consumers can operate on it concurrently.
+ */
+struct ring_slot {
+	uint64_t seq;
+	uint64_t len;
+	uint64_t data[];
+};
+
+struct ring {
+	uint64_t mask;
+	uint64_t slot_size;
+	uint64_t payload;
+	char     __pad0[RING_CACHELINE - 3 * sizeof(uint64_t)];
+	uint64_t head;
+	char     __pad1[RING_CACHELINE - sizeof(uint64_t)];
+	uint64_t tail;
+	uint64_t parked;
+	char     __pad2[RING_CACHELINE - 2 * sizeof(uint64_t)];
+	char     slots[];
+};
+
+/*
+ * Geometry of a ring, as set by ring_init() or validated by ring_check().
+ * Each side keeps its own copy in private memory and uses only that copy to
+ * locate slots and bound lengths, so a peer that rewrites the header of a
+ * shared ring cannot make the other side access memory outside the mapping.
+ */
+struct ring_geom {
+	uint64_t mask;
+	uint64_t slot_size;
+	uint64_t payload;
+};
+
+/**
+ * Size in bytes of a ring with nslots slots of payload bytes each.
+ */
+size_t ring_size(uint64_t nslots, size_t payload);
+
+/**
+ * Initialize a ring in a memory region of at least ring_size() bytes and
+ * store its geometry in g.
+ * @return 0 on success, -1 if nslots is not a power of two.
+ */
+int ring_init(struct ring *r, struct ring_geom *g, uint64_t nslots, size_t payload);
+
+/**
+ * Check that a ring created by someone else, mapped in a region of size
+ * bytes, has nslots slots of payload bytes each, and store its geometry in g.
+ * @return 0 if it does, -1 otherwise.
+ */
+int ring_check(struct ring *r, struct ring_geom *g, size_t size, uint64_t nslots, size_t payload);
+
+/**
+ * Copy len bytes into the next free slot.
+ * @return 0 on success, 1 if the ring is full, -1 if len exceeds the payload.
+ */
+int ring_push(struct ring *r, const struct ring_geom *g, const void *data, size_t len);
+
+/**
+ * Copy the oldest slot into data and free it. *len is the size of data on
+ * entry and the number of bytes copied on return.
+ * @return 0 on success, 1 if the ring is empty, -1 if the slot is larger than
+ * data or than the payload of the ring (the slot is dropped).
+ */
+int ring_pop(struct ring *r, const struct ring_geom *g, void *data, size_t *len);
+
+/**
+ * @return 1 if there is no slot ready to be popped, 0 otherwise.
+ */
+int ring_empty(struct ring *r, const struct ring_geom *g);
+
+/**
+ * Consumers about to sleep register with ring_park(), then check ring_empty()
+ * once more. Producers check ring_parked() after ring_push() and wake them up
+ * if it is non-zero. Both sides issue a full barrier, so either the consumer
+ * sees the new slot or the producer sees the parked consumer.
+ */
+void ring_park(struct ring *r);
+void ring_unpark(struct ring *r);
+uint64_t ring_parked(struct ring *r);
+
+#endif
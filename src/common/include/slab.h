@@ -0,0 +1,64 @@
+/**
+ * \file
+ * SLAB - Pools of fixed-size objects
+ */
+
+#ifndef _SLAB_H
+#define _SLAB_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+#define SLAB_MAX_POOLS 16 /* pools alive at the same time in a process */
+#define SLAB_OBJS      64 /* objects carved from each slab */
+#define SLAB_BATCH     32 /* objects moved between a thread and the pool */
+
+/*
+ * Objects are carved from slabs allocated on the heap and never returned to
+ * it until the pool is destroyed. Every thread keeps a private list of free
+ * objects for each pool, so allocating and freeing take no lock unless the
+ * list runs empty or grows beyond 2 * SLAB_BATCH objects, in which case a
+ * batch is moved from or to the list shared by all threads.
+ *
+ * An object can be freed by a different thread than the one that allocated
+ * it.
+ */
+struct slab_obj {
+	struct slab_obj *next;
+};
+
+struct slab {
+	struct slab *next;
+};
+
+struct slab_pool {
+	size_t           size;
+	unsigned int     id;
+	pthread_mutex_t  lock;
+	struct slab_obj *free;
+	struct slab     *slabs;
+};
+
+/**
+ * Initialize a pool of objects of size bytes.
+ * @return 0 on success, -1 if too many pools have been created.
+ */
+int slab_init(struct slab_pool *p, size_t size);
+
+/**
+ * Release all the memory of the pool, including objects still in use.
+ */
+void slab_fini(struct slab_pool *p);
+
+/**
+ * Allocate an object from the pool.
+ * @return the object, NULL if the heap is exhausted.
+ */
+void *slab_alloc(struct slab_pool *p);
+
+/**
+ * Return an object to the pool.
+ */
+void slab_free(struct slab_pool *p, void *obj);
+
+#endif
@@ -0,0 +1,441 @@
+/**
+ * IOURING - Datagram socket I/O through io_uring
+ *
+ * Rationale:
+ * - Each thread has its own io_uring for sends, so submissions need no
+ *   locking. The receiver has a separate one, so a send never reaps the
+ *   completion of a receive.
+ *
+ * - One receiver per process: several multishot receives armed on the same
+ *   socket would split the datagrams among threads, each holding its own set
+ *   of buffers. The thread that sleeps on the socket (the dispatcher or the
+ *   scheduler receiver) claims the ring in iou_pollfd(), the claim is dropped
+ *   when it exits.
+ *
+ * - Receives: a multishot recvmsg with buffer selection from a ring of
+ *   provided buffers. A single request keeps delivering datagrams until the
+ *   buffers run out (or the request fails), then it is armed again on the
+ *   next call. Buffers go back to the ring as soon as the message is copied
+ *   out.
+ *
+ * - Sends: one sendmsg per message, linked so that the first one that would
+ *   block cancels the rest, and submitted with a single io_uring_enter().
+ *
+ * - Needs Linux 6.0 (multishot recvmsg and provided buffer rings). Multishot
+ *   recvmsg has no opcode of its own, so iou_setup() arms one on a socket
+ *   pair to find out. When a thread cannot set up or arm its receive ring
+ *   later on, it receives with recvmmsg() instead.
+ */
+
+#define _GNU_SOURCE
+#include "include/iouring.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <liburing.h>
+
+#define IOU_ENTRIES 64 /* sends per submission */
+#define IOU_NBUFS   64 /* provided receive buffers, power of two */
+#define IOU_BGID    0
+#define IOU_RECV    1  /* user_data of the multishot receive */
+
+struct iou_rx {
+	struct io_uring           ring;
+	struct io_uring_buf_ring* br;
+	uint8_t*                  bufs;
+	struct msghdr             mh;
+	int                       fd;
+	int                       armed;
+};
+
+struct iou {
+	struct io_uring tx;
+	struct iou_rx   rx;
+	int             has_tx;
+	int             has_rx;
+};
+
+static size_t bufsize = 0;
+static int rx_claimed = 0; /* a thread owns the receive ring */
+static pthread_key_t iou_key;
+static pthread_once_t iou_once = PTHREAD_ONCE_INIT;
+static __thread struct iou* self = NULL;
+
+static void iou_destroy(void* arg)
+{
+	struct iou* u = (struct iou*) arg;
+
+	if(u->has_rx){
+		io_uring_free_buf_ring(&u->rx.ring, u->rx.br, IOU_NBUFS, IOU_BGID);
+		io_uring_queue_exit(&u->rx.ring);
+		free(u->rx.bufs);
+		__atomic_store_n(&rx_claimed, 0, __ATOMIC_RELEASE);
+	}
+	if(u->has_tx)
+		io_uring_queue_exit(&u->tx);
+	free(u);
+}
+
+static void iou_key_init(void)
+{
+	pthread_key_create(&iou_key, iou_destroy);
+}
+
+static struct iou* iou_get(void)
+{
+	if(self)
+		return self;
+
+	pthread_once(&iou_once, iou_key_init);
+	self = (struct iou*) calloc(1, sizeof(struct iou));
+	if(!self)
+		return NULL;
+
+	self->rx.fd = -1;
+	pthread_setspecific(iou_key, self);
+
+	return self;
+}
+
+static struct io_uring* iou_tx(void)
+{
+	struct iou* u = iou_get();
+	int ret;
+
+	if(!u)
+		return NULL;
+
+	if(!u->has_tx){
+		if((ret = io_uring_queue_init(IOU_ENTRIES, &u->tx, 0)) < 0){
+			errno = -ret;
+			return NULL;
+		}
+		u->has_tx = 1;
+	}
+
+	return &u->tx;
+}
+
+static struct iou_rx* iou_rx(void)
+{
+	struct iou* u = iou_get();
+	struct iou_rx* rx;
+	int ret, claimed = 0;
+
+	if(!u)
+		return NULL;
+
+	rx = &u->rx;
+	if(u->has_rx)
+		return rx;
+
+	if(!__atomic_compare_exchange_n(&rx_claimed, &claimed, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)){
+		errno = EBUSY;
+		return NULL;
+	}
+
+	/* The CQ (twice the SQ) holds a completion for every buffer */
+	if((ret = io_uring_queue_init(IOU_NBUFS, &rx->ring, 0)) < 0){
+		errno = -ret;
+		goto err_claim;
+	}
+
+	rx->bufs = (uint8_t*) malloc(IOU_NBUFS * bufsize);
+	if(!rx->bufs){
+		errno = ENOMEM;
+		goto err_ring;
+	}
+
+	rx->br = io_uring_setup_buf_ring(&rx->ring, IOU_NBUFS, IOU_BGID, 0, &ret);
+	if(!rx->br){
+		errno = -ret;
+		goto err_bufs;
+	}
+
+	for(int i = 0; i < IOU_NBUFS; i++)
+		io_uring_buf_ring_add(rx->br, rx->bufs + i * bufsize, bufsize, i,
+				      io_uring_buf_ring_mask(IOU_NBUFS), i);
+	io_uring_buf_ring_advance(rx->br, IOU_NBUFS);
+
+	memset(&rx->mh, 0, sizeof(struct msghdr));
+	rx->mh.msg_namelen = sizeof(struct sockaddr_un);
+	u->has_rx = 1;
+
+	return rx;
+
+err_bufs:
+	free(rx->bufs);
+err_ring:
+	io_uring_queue_exit(&rx->ring);
+err_claim:
+	__atomic_store_n(&rx_claimed, 0, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+static int iou_arm(struct iou_rx* rx, int fd)
+{
+	struct io_uring_sqe* sqe;
+	int ret;
+
+	if(rx->armed){
+		if(rx->fd == fd)
+			return 0;
+		errno = EBUSY;
+		return -1;
+	}
+
+	if(!(sqe = io_uring_get_sqe(&rx->ring))){
+		errno = EBUSY;
+		return -1;
+	}
+
+	io_uring_prep_recvmsg_multishot(sqe, fd, &rx->mh, 0);
+	sqe->flags    |= IOSQE_BUFFER_SELECT;
+	sqe->buf_group = IOU_BGID;
+	io_uring_sqe_set_data64(sqe, IOU_RECV);
+
+	if((ret = io_uring_submit(&rx->ring)) < 0){
+		errno = -ret;
+		return -1;
+	}
+
+	rx->fd    = fd;
+	rx->armed = 1;
+
+	return 0;
+}
+
+/* Arm a multishot recvmsg on a socket pair and check that a datagram comes through */
+static int iou_probe_recv(void)
+{
+	struct io_uring ring;
+	struct io_uring_buf_ring* br;
+	struct io_uring_sqe* sqe;
+	struct io_uring_cqe* cqe;
+	struct msghdr mh;
+	uint8_t* buf;
+	uint8_t ping = 0;
+	int sv[2], ret, ok = 0;
+
+	if(socketpair(AF_UNIX, SOCK_DGRAM, 0, sv))
+		return 0;
+
+	if(io_uring_queue_init(2, &ring, 0) < 0)
+		goto err_sock;
+
+	if(!(buf = (uint8_t*) malloc(bufsize)))
+		goto err_ring;
+
+	if(!(br = io_uring_setup_buf_ring(&ring, 1, IOU_BGID, 0, &ret)))
+		goto err_buf;
+	io_uring_buf_ring_add(br, buf, bufsize, 0, io_uring_buf_ring_mask(1), 0);
+	io_uring_buf_ring_advance(br, 1);
+
+	memset(&mh, 0, sizeof(struct msghdr));
+	mh.msg_namelen = sizeof(struct sockaddr_un);
+	sqe = io_uring_get_sqe(&ring);
+	io_uring_prep_recvmsg_multishot(sqe, sv[0], &mh, 0);
+	sqe->flags    |= IOSQE_BUFFER_SELECT;
+	sqe->buf_group = IOU_BGID;
+
+	if(io_uring_submit(&ring) < 0 || send(sv[1], &ping, 1, 0) != 1)
+		goto err_br;
+
+	/* Kernels without multishot recvmsg fail the request with EINVAL */
+	if(!io_uring_wait_cqe(&ring, &cqe)){
+		ok = cqe->res >= 0 && (cqe->flags & IORING_CQE_F_BUFFER);
+		io_uring_cqe_seen(&ring, cqe);
+	}
+
+err_br:
+	io_uring_free_buf_ring(&ring, br, 1, IOU_BGID);
+err_buf:
+	free(buf);
+err_ring:
+	/* Also cancels the receive if it is still armed */
+	io_uring_queue_exit(&ring);
+err_sock:
+	close(sv[0]);
+	close(sv[1]);
+	return ok;
+}
+
+int iou_setup(size_t payload)
+{
+	struct io_uring_probe* probe;
+	int ok;
+
+	bufsize = sizeof(struct io_uring_recvmsg_out) + sizeof(struct sockaddr_un) + payload;
+	bufsize = (bufsize + 63) & ~((size_t) 63);
+
+	if(!(probe = io_uring_get_probe()))
+		return -1;
+
+	ok = io_uring_opcode_supported(probe, IORING_OP_SENDMSG) &&
+	     io_uring_opcode_supported(probe, IORING_OP_RECVMSG);
+	io_uring_free_probe(probe);
+
+	if(!ok || !iou_probe_recv())
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Take back the SQEs that the kernel has not consumed: they would otherwise
+ * go out with the next submission, after the caller has been told they were
+ * not sent. Only the owner thread submits to a tx ring.
+ */
+static void iou_sq_drop(struct io_uring* ring)
+{
+	unsigned int head = io_uring_smp_load_acquire(ring->sq.khead);
+
+	io_uring_smp_store_release(ring->sq.ktail, head);
+	ring->sq.sqe_head = head;
+	ring->sq.sqe_tail = head;
+}
+
+int iou_sendmmsg(int fd, struct mmsghdr* hdr, unsigned int n)
+{
+	struct io_uring* ring;
+	struct io_uring_sqe* sqe;
+	struct io_uring_cqe* cqe;
+	unsigned int i, sent, submitted;
+	int ret, err = 0;
+
+	if(!(ring = iou_tx()))
+		return -1;
+
+	if(n > IOU_ENTRIES)
+		n = IOU_ENTRIES;
+
+	for(i = 0; i < n; i++){
+		sqe = io_uring_get_sqe(ring);
+		io_uring_prep_sendmsg(sqe, fd, &hdr[i].msg_hdr, MSG_DONTWAIT);
+		io_uring_sqe_set_data64(sqe, i);
+		if(i + 1 < n)
+			sqe->flags |= IOSQE_IO_LINK;
+	}
+
+	/* The kernel may stop short of the whole chain, the rest is not sent */
+	ret = io_uring_submit_and_wait(ring, n);
+	submitted = ret < 0 ? 0 : (unsigned int) ret;
+	if(submitted < n)
+		iou_sq_drop(ring);
+	if(ret <= 0){
+		errno = ret < 0 ? -ret : EAGAIN;
+		return -1;
+	}
+
+	/* Messages after the first failure are canceled, report the first one */
+	sent = submitted;
+	for(i = 0; i < submitted; i++){
+		if((ret = io_uring_wait_cqe(ring, &cqe)) < 0){
+			errno = -ret;
+			return -1;
+		}
+		if(cqe->res >= 0)
+			hdr[cqe->user_data].msg_len = cqe->res;
+		else if(cqe->user_data < sent){
+			sent = cqe->user_data;
+			err  = -cqe->res;
+		}
+		io_uring_cqe_seen(ring, cqe);
+	}
+
+	if(sent == 0){
+		errno = err;
+		return -1;
+	}
+
+	return sent;
+}
+
+int iou_recvmmsg(int fd, struct mmsghdr* hdr, unsigned int n)
+{
+	struct iou_rx* rx;
+	struct io_uring_cqe* cqe;
+	struct io_uring_recvmsg_out* out;
+	struct msghdr* h;
+	unsigned int count = 0, len, bid;
+	uint8_t* buf;
+	int err = 0;
+
+	/* Only the receiver thread, and one socket, go through the ring */
+	if(!self || !self->has_rx)
+		return recvmmsg(fd, hdr, n, MSG_DONTWAIT, NULL);
+	rx = &self->rx;
+	if((rx->armed && rx->fd != fd) || iou_arm(rx, fd))
+		return recvmmsg(fd, hdr, n, MSG_DONTWAIT, NULL);
+
+	while(count < n && !io_uring_peek_cqe(&rx->ring, &cqe)){
+		if(!(cqe->flags & IORING_CQE_F_MORE))
+			rx->armed = 0;
+
+		if(cqe->res < 0){
+			/* Out of buffers is not an error, the receive is armed again below */
+			if(cqe->res != -ENOBUFS)
+				err = -cqe->res;
+			io_uring_cqe_seen(&rx->ring, cqe);
+			if(err)
+				break;
+			continue;
+		}
+
+		if(!(cqe->flags & IORING_CQE_F_BUFFER)){
+			io_uring_cqe_seen(&rx->ring, cqe);
+			continue;
+		}
+
+		bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		buf = rx->bufs + bid * bufsize;
+
+		if((out = io_uring_recvmsg_validate(buf, cqe->res, &rx->mh)) != NULL){
+			h   = &hdr[count].msg_hdr;
+			len = io_uring_recvmsg_payload_length(out, cqe->res, &rx->mh);
+
+			if(h->msg_name){
+				if(h->msg_namelen > out->namelen)
+					h->msg_namelen = out->namelen;
+				memcpy(h->msg_name, io_uring_recvmsg_name(out), h->msg_namelen);
+			}
+
+			h->msg_flags = out->flags;
+			if(len > h->msg_iov[0].iov_len){
+				len = h->msg_iov[0].iov_len;
+				h->msg_flags |= MSG_TRUNC;
+			}
+			memcpy(h->msg_iov[0].iov_base, io_uring_recvmsg_payload(out, &rx->mh), len);
+			hdr[count++].msg_len = len;
+		}
+
+		io_uring_buf_ring_add(rx->br, buf, bufsize, bid, io_uring_buf_ring_mask(IOU_NBUFS), 0);
+		io_uring_buf_ring_advance(rx->br, 1);
+		io_uring_cqe_seen(&rx->ring, cqe);
+	}
+
+	if(!rx->armed)
+		iou_arm(rx, fd);
+
+	if(count)
+		return count;
+
+	errno = err ? err : EAGAIN;
+	return -1;
+}
+
+int iou_pollfd(int fd)
+{
+	struct iou_rx* rx;
+
+	if(!(rx = iou_rx()) || iou_arm(rx, fd))
+		return -1;
+
+	return rx->ring.ring_fd;
+}
@@ -1,103 +1,646 @@
+#define _GNU_SOURCE
 #include <errno.h>
+#include <fcntl.h>
 #include <string.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if !__APPLE__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
 
 #include <minos.h>
 #include <minos_internal.h>
+#include <ring.h>
+#ifdef MCL_IO_URING
+#include <iouring.h>
+#endif
 
 static int ndev = 0;
+static int batch = MCL_MSG_BATCH;
+static int poll_mode = MCL_POLL_SPIN;
+static uint64_t poll_budget = MCL_POLL_BUDGET;
+static int wake_fd = -1;
+static int io_mode = MCL_MSG_IO_SOCKET;
 
 int msg_setup(int devs){
+    const char* env;
+
     ndev = devs;
+
+    if((env = getenv("MCL_POLL_MODE")) != NULL){
+        if(!strcmp(env, "block"))
+            poll_mode = MCL_POLL_BLOCK;
+        else if(strcmp(env, "spin"))
+            eprintf("Invalid MCL_POLL_MODE %s, must be spin or block.", env);
+    }
+
+    if((env = getenv("MCL_POLL_BUDGET")) != NULL)
+        poll_budget = strtoull(env, NULL, 10);
+
+#if __APPLE__
+    if(poll_mode == MCL_POLL_BLOCK){
+        eprintf("MCL_POLL_MODE=block is not supported on this platform, using spin.");
+        poll_mode = MCL_POLL_SPIN;
+    }
+#else
+    if(poll_mode == MCL_POLL_BLOCK && wake_fd < 0){
+        wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if(wake_fd < 0){
+            eprintf("Error creating shutdown eventfd.");
+            perror("eventfd");
+            return -1;
+        }
+    }
+#endif
+
+    if((env = getenv("MCL_MSG_BATCH")) != NULL){
+        batch = atoi(env);
+        if(batch < 1 || batch > MCL_MSG_BATCH){
+            eprintf("Invalid MCL_MSG_BATCH %s, must be between 1 and %d.", env, MCL_MSG_BATCH);
+            batch = MCL_MSG_BATCH;
+        }
+    }
+
+#ifdef MCL_IO_URING
+    /* Sockets unless io_uring is asked for explicitly */
+    if((env = getenv("MCL_MSG_IO")) != NULL){
+        if(!strcmp(env, "uring"))
+            io_mode = MCL_MSG_IO_URING;
+        else if(strcmp(env, "socket"))
+            eprintf("Invalid MCL_MSG_IO %s, must be socket or uring.", env);
+    }
+
+    if(io_mode == MCL_MSG_IO_URING && iou_setup(MCL_MAX_MSG_SIZE)){
+        eprintf("io_uring is not available, using sockets.");
+        io_mode = MCL_MSG_IO_SOCKET;
+    }
+#endif
+
     return 0;
 }
 
-static inline int msg_assemble(struct mcl_msg_struct* msg, uint64_t* data)
+void msg_finit(void)
 {
+	if(wake_fd >= 0)
+		close(wake_fd);
+	wake_fd = -1;
+}
+
+/*
+ * Maximum number of messages to drain per wakeup.
+ */
+int msg_batch_size(void)
+{
+    return batch;
+}
+
+/*
+ * Event loops call msg_poll_idle() after every round that found no work. In
+ * spin mode (default) it just yields. In block mode it yields for
+ * MCL_POLL_BUDGET consecutive idle rounds and then returns 1, telling the
+ * caller to go to sleep with msg_poller_wait() or msg_event_wait(). Any round
+ * that finds work should reset *idle to 0.
+ */
+int msg_poll_idle(uint64_t* idle)
+{
+	if(poll_mode == MCL_POLL_SPIN || ++(*idle) < poll_budget){
+		sched_yield();
+		return 0;
+	}
+
+	*idle = 0;
+	return 1;
+}
+
+/*
+ * Wake up all the threads sleeping in msg_poller_wait() and msg_event_wait()
+ * for good. Async-signal-safe.
+ */
+void msg_poll_wakeup(void)
+{
+	uint64_t v = 1;
+
+	if(wake_fd >= 0 && write(wake_fd, &v, sizeof(v)) < 0)
+		return;
+}
+
+#if !__APPLE__
+/*
+ * Each thread waiting on a socket gets its own poller. The socket is added
+ * with EPOLLEXCLUSIVE, so an incoming datagram wakes up a single thread.
+ * With drain set, the datagrams are only doorbells for a ring and are
+ * discarded after waking up.
+ */
+int msg_poller_init(msg_poller_t* p, int fd, int drain)
+{
+	struct epoll_event ev;
+#ifdef MCL_IO_URING
+	int ret;
+#endif
+
+	p->fd    = fd;
+	p->drain = drain;
+	p->epfd  = -1;
+
+	if(poll_mode == MCL_POLL_SPIN)
+		return 0;
+
+	p->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if(p->epfd < 0){
+		eprintf("Error creating epoll descriptor.");
+		perror("epoll_create1");
+		return -1;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = wake_fd;
+	if(epoll_ctl(p->epfd, EPOLL_CTL_ADD, wake_fd, &ev))
+		goto err;
+
+	ev.events = EPOLLIN;
+#ifdef EPOLLEXCLUSIVE
+	ev.events |= EPOLLEXCLUSIVE;
+#endif
+#ifdef MCL_IO_URING
+	/* Datagrams land in the completion queue of this thread's io_uring */
+	if(io_mode == MCL_MSG_IO_URING && !drain && (ret = iou_pollfd(fd)) >= 0)
+		fd = ret;
+#endif
+	ev.data.fd = fd;
+	if(epoll_ctl(p->epfd, EPOLL_CTL_ADD, fd, &ev))
+		goto err;
+
+	return 0;
+
+err:
+	eprintf("Error adding descriptors to epoll set.");
+	perror("epoll_ctl");
+	close(p->epfd);
+	p->epfd = -1;
+	return -1;
+}
+
+void msg_poller_fini(msg_poller_t* p)
+{
+	if(p->epfd >= 0)
+		close(p->epfd);
+	p->epfd = -1;
+}
+
+/*
+ * Sleep until the socket is readable or msg_poll_wakeup() is called.
+ */
+int msg_poller_wait(msg_poller_t* p)
+{
+	struct epoll_event ev[2];
+	uint64_t data[MCL_MAX_MSG_SIZE / sizeof(uint64_t)];
+	int ret;
+
+	if(p->epfd < 0)
+		return 0;
+
+	ret = epoll_wait(p->epfd, ev, 2, -1);
+	if(ret < 0 && errno != EINTR){
+		eprintf("Error waiting for messages.");
+		perror("epoll_wait");
+		return -1;
+	}
+
+	if(p->drain)
+		while(recv(p->fd, data, sizeof(data), MSG_DONTWAIT) > 0)
+			;
+
+	return 0;
+}
+
+/*
+ * Events wake up a single thread that sleeps until some condition it polls
+ * for changes (e.g. a queue becoming non-empty). The waiter calls
+ * msg_event_park(), checks the condition once more and then calls either
+ * msg_event_wait() or msg_event_unpark(). Whoever changes the condition calls
+ * msg_event_notify(), which costs a system call only if the waiter is parked.
+ */
+int msg_event_init(msg_event_t* e)
+{
+	e->parked = 0;
+	e->fd = -1;
+
+	if(poll_mode == MCL_POLL_SPIN)
+		return 0;
+
+	e->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(e->fd < 0){
+		eprintf("Error creating eventfd.");
+		perror("eventfd");
+		return -1;
+	}
+
+	return 0;
+}
+
+void msg_event_fini(msg_event_t* e)
+{
+	if(e->fd >= 0)
+		close(e->fd);
+	e->fd = -1;
+}
+
+void msg_event_wait(msg_event_t* e)
+{
+	struct pollfd fds[2] = {{ .fd = e->fd, .events = POLLIN },
+				{ .fd = wake_fd, .events = POLLIN }};
+	uint64_t v;
+
+	if(e->fd >= 0 && poll(fds, 2, -1) > 0 && (fds[0].revents & POLLIN))
+		if(read(e->fd, &v, sizeof(v)) < 0 && errno != EAGAIN)
+			perror("read");
+
+	msg_event_unpark(e);
+}
+
+void msg_event_notify(msg_event_t* e)
+{
+	uint64_t v = 1;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if(!__atomic_load_n(&e->parked, __ATOMIC_RELAXED))
+		return;
+
+	if(write(e->fd, &v, sizeof(v)) < 0)
+		perror("write");
+}
+#else
+int msg_poller_init(msg_poller_t* p, int fd, int drain)
+{
+	p->fd = fd;
+	p->drain = drain;
+	p->epfd = -1;
+	return 0;
+}
+
+void msg_poller_fini(msg_poller_t* p) {}
+int msg_poller_wait(msg_poller_t* p) { return 0; }
+int msg_event_init(msg_event_t* e) { e->parked = 0; e->fd = -1; return 0; }
+void msg_event_fini(msg_event_t* e) {}
+void msg_event_wait(msg_event_t* e) { msg_event_unpark(e); }
+void msg_event_notify(msg_event_t* e) {}
+#endif
+
+void msg_event_park(msg_event_t* e)
+{
+	__atomic_store_n(&e->parked, 1, __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void msg_event_unpark(msg_event_t* e)
+{
+	__atomic_store_n(&e->parked, 0, __ATOMIC_RELAXED);
+}
+
+/*
+ * Wire format (all multi-byte integers are little endian):
+ *
+ *   byte 0      MSG_WIRE_VERSION
+ *   byte 1      command
+ *   bytes 2-3   total length of the message, header included
+ *   varint      mask of the MSG_FIELD_* that follow
+ *   fields      in MSG_FIELD_* order, only those set in the mask
+ *
+ * A field is omitted when it is zero, so the receiver gets back the values
+ * set by msg_init(). Scalars are unsigned LEB128 varints. Dependencies are
+ * sent as a count followed by zigzag encoded deltas from the previous rid,
+ * since requests of the same client tend to depend on recent rids. Every
+ * resident argument is mem_id, flags, pid (only for shared arguments),
+ * overall_size, mem_size and mem_offset.
+ */
+static inline uint8_t* msg_put_varint(uint8_t* p, uint64_t v)
+{
+	while(v >= 0x80){
+		*p++ = (uint8_t) v | 0x80;
+		v >>= 7;
+	}
+	*p++ = (uint8_t) v;
+	return p;
+}
+
+static inline const uint8_t* msg_get_varint(const uint8_t* p, const uint8_t* end, uint64_t* v)
+{
+	uint64_t r = 0;
+	unsigned int shift;
+
+	for(shift = 0; p < end && shift < 64; shift += 7){
+		uint8_t b = *p++;
+		r |= ((uint64_t) (b & 0x7f)) << shift;
+		if(!(b & 0x80)){
+			*v = r;
+			return p;
+		}
+	}
+	return NULL;
+}
+
+static inline uint64_t msg_zigzag(int64_t v)
+{
+	return ((uint64_t) v << 1) ^ (uint64_t) (v >> 63);
+}
+
+static inline int64_t msg_unzigzag(uint64_t v)
+{
+	return (int64_t) (v >> 1) ^ -(int64_t) (v & 0x1);
+}
+
+static inline uint64_t msg_fields(struct mcl_msg_struct* msg)
+{
+	uint64_t fields = 0;
+
+	if(msg->type)
+		fields |= MSG_FIELD_TYPE;
+	if(msg->flags)
+		fields |= MSG_FIELD_FLAGS;
+	if(msg->rid)
+		fields |= MSG_FIELD_RID;
+	if(msg->pes)
+		fields |= MSG_FIELD_PES;
+	if(msg->mem)
+		fields |= MSG_FIELD_MEM;
+	if(msg->taskid)
+		fields |= MSG_FIELD_TASKID;
+	for(int i=0; i<MCL_DEV_DIMS; i++)
+		if(msg->pesdata.pes[i] || msg->pesdata.lpes[i])
+			fields |= MSG_FIELD_PESDATA;
+	if(msg->ndependencies)
+		fields |= MSG_FIELD_DEPS;
+	if(msg->nres)
+		fields |= MSG_FIELD_RES;
+	if(msg->credits)
+		fields |= MSG_FIELD_CREDITS;
+	if(msg->deadline)
+		fields |= MSG_FIELD_DEADLINE;
+	if(msg->weight)
+		fields |= MSG_FIELD_WEIGHT;
+	if(msg->runtime)
+		fields |= MSG_FIELD_RUNTIME;
+	if(msg->nacks)
+		fields |= MSG_FIELD_ACKS;
+	if(msg->max_reqs || msg->max_mem)
+		fields |= MSG_FIELD_LIMITS;
+
+	return fields;
+}
+
+/*
+ * Encode msg into data, which must be at least MCL_MAX_MSG_SIZE bytes.
+ * Return the number of bytes to send, -1 on failure.
+ */
+static inline ssize_t msg_assemble(struct mcl_msg_struct* msg, uint8_t* data)
+{
+	uint64_t fields;
+	uint8_t* p;
+	size_t len;
+
 	if(!msg || !data){
 		eprintf("Invalid arguments.");
 		return -1;
 	}
-	data[0] =            (msg->cmd   << MSG_CMD_SHIFT)   & MSG_CMD_MASK;
-	data[0] = data[0] | ((msg->type  << MSG_TYPE_SHIFT)  & MSG_TYPE_MASK);
-	data[0] = data[0] | ((msg->flags << MSG_FLAGS_SHIFT) & MSG_FLAGS_MASK);
-	data[0] = data[0] | ((msg->rid   << MSG_RID_SHIFT)   & MSG_RID_MASK);
-	data[1] =            (msg->pes   << MSG_PES_SHIFT)   & MSG_PES_MASK;
-	data[1] = data[1] | ((msg->mem   << MSG_MEM_SHIFT)   & MSG_MEM_MASK);
-	data[1] = data[1] | ((msg->nres  << MSG_NRES_SHIFT)   & MSG_NRES_MASK);
-	data[2] =           ((msg->taskid  << MSG_TASKID_SHIFT)   & MSG_TASKID_MASK);
+
+	if(msg->cmd > 0xff || msg->ndependencies > MCL_MAX_DEPENDENCIES || msg->nres > MCL_RES_ARGS_MAX ||
+	   msg->nacks > MCL_ACKS_MAX){
+		eprintf("Invalid message (cmd=0x%"PRIx64" ndeps=%"PRIu32" nres=%"PRIu64" nacks=%"PRIu32").",
+			msg->cmd, msg->ndependencies, msg->nres, msg->nacks);
+		return -1;
+	}
+
+	fields = msg_fields(msg);
+	data[0] = MSG_WIRE_VERSION;
+	data[1] = (uint8_t) msg->cmd;
+	p = msg_put_varint(data + MSG_HDR_SIZE, fields);
+
+	if(fields & MSG_FIELD_TYPE)
+		p = msg_put_varint(p, msg->type);
+	if(fields & MSG_FIELD_FLAGS)
+		p = msg_put_varint(p, msg->flags);
+	if(fields & MSG_FIELD_RID)
+		p = msg_put_varint(p, msg->rid);
+	if(fields & MSG_FIELD_PES)
+		p = msg_put_varint(p, msg->pes);
+	if(fields & MSG_FIELD_MEM)
+		p = msg_put_varint(p, msg->mem);
+	if(fields & MSG_FIELD_TASKID)
+		p = msg_put_varint(p, msg->taskid);
+	if(fields & MSG_FIELD_PESDATA){
+		for(int i=0; i<MCL_DEV_DIMS; i++)
+			p = msg_put_varint(p, msg->pesdata.pes[i]);
+		for(int i=0; i<MCL_DEV_DIMS; i++)
+			p = msg_put_varint(p, msg->pesdata.lpes[i]);
+	}
 
 	Dprintf("Number of dependencies inside message send: %"PRIu32"", msg->ndependencies);
-	((uint32_t*)data)[6] = msg->ndependencies;
-	if(msg->ndependencies){
-		memcpy(&((uint32_t*)data)[7], msg->dependencies, sizeof(uint32_t) * MCL_MAX_DEPENDENCIES);
+	if(fields & MSG_FIELD_DEPS){
+		int64_t prev = 0;
+
+		p = msg_put_varint(p, msg->ndependencies);
+		for(uint32_t i=0; i<msg->ndependencies; i++){
+			p = msg_put_varint(p, msg_zigzag((int64_t) msg->dependencies[i] - prev));
+			prev = msg->dependencies[i];
+		}
 	}
 
-    data += 3 + ((MCL_MAX_DEPENDENCIES + 1)/2);
-    for(int i=0; i<MCL_DEV_DIMS; i++){
-		data[i] = msg->pesdata.pes[i];
-		data[MCL_DEV_DIMS+i] = msg->pesdata.lpes[i];
+	if(fields & MSG_FIELD_RES){
+		p = msg_put_varint(p, msg->nres);
+		for(int i=0; i<msg->nres; i++){
+			msg_arg_t* arg = &msg->resdata[i];
+
+			p = msg_put_varint(p, arg->mem_id);
+			p = msg_put_varint(p, arg->flags);
+			if(arg->flags & MSG_ARGFLAG_SHARED)
+				p = msg_put_varint(p, arg->pid);
+			p = msg_put_varint(p, arg->overall_size);
+			p = msg_put_varint(p, arg->mem_size);
+			p = msg_put_varint(p, arg->mem_offset);
+		}
 	}
-	
-    data += (2*MCL_DEV_DIMS);
-    for(int i = 0, j = 0; i < msg->nres; i += 1, j += 2){
-        data[j] =           ((msg->resdata[i].mem_id   << MSG_MEMID_SHIFT)   & MSG_MEMID_MASK);
-		data[j] = data[j] | ((msg->resdata[i].pid      << MSG_PID_SHIFT)     & MSG_PID_MASK);
-		data[j] = data[j] | ((msg->resdata[i].flags    << MSG_MEMFLAG_SHIFT) & MSG_MEMFLAG_MASK);
-		data[j+1] =             ((msg->resdata[i].overall_size << MSG_OVERALL_SHIFT) & MSG_OVERALL_MASK);
-        data[j+1] = data[j+1] | ((msg->resdata[i].mem_size << MSG_MEMSIZE_SHIFT) & MSG_MEMSIZE_MASK);
-		data[j+1] = data[j+1] | ((msg->resdata[i].mem_offset << MSG_OFFSET_SHIFT) & MSG_OFFSET_MASK);
-    }
-	return 0;
+
+	if(fields & MSG_FIELD_CREDITS)
+		p = msg_put_varint(p, msg->credits);
+	if(fields & MSG_FIELD_DEADLINE)
+		p = msg_put_varint(p, msg->deadline);
+	if(fields & MSG_FIELD_WEIGHT)
+		p = msg_put_varint(p, msg->weight);
+	if(fields & MSG_FIELD_RUNTIME)
+		p = msg_put_varint(p, msg->runtime);
+	if(fields & MSG_FIELD_ACKS){
+		int64_t prev = 0;
+
+		p = msg_put_varint(p, msg->nacks);
+		for(uint32_t i=0; i<msg->nacks; i++){
+			p = msg_put_varint(p, msg_zigzag((int64_t) msg->acks[i].rid - prev));
+			p = msg_put_varint(p, msg->acks[i].res);
+			prev = msg->acks[i].rid;
+		}
+	}
+	if(fields & MSG_FIELD_LIMITS){
+		p = msg_put_varint(p, msg->max_reqs);
+		p = msg_put_varint(p, msg->max_mem);
+	}
+
+	len = p - data;
+	data[2] = len & 0xff;
+	data[3] = (len >> 8) & 0xff;
+
+	return len;
 }
 
-static inline int msg_disassemble(uint64_t* data, struct mcl_msg_struct* msg, const char* src)
+#define MSG_GET(p, end, v)					\
+	do{							\
+		uint64_t __v;					\
+		if(((p) = msg_get_varint(p, end, &__v)) == NULL)	\
+			goto err_trunc;				\
+		(v) = __v;					\
+	}while(0)
+
+/*
+ * Decode size bytes received from src into msg.
+ */
+static inline int msg_disassemble(const uint8_t* data, size_t size, struct mcl_msg_struct* msg, const char* src)
 {
+	const uint8_t *p, *end;
+	uint64_t fields, len;
+
 	if(!msg || !data || !src){
 		eprintf("Invalid arguments.");
 		return -1;
 	}
 
-        if(msg_init(msg)){
-                eprintf("Could not initialize message");
-                return -1;
-        }
+	if(msg_init(msg)){
+		eprintf("Could not initialize message");
+		return -1;
+	}
 
-	msg->cmd   = (data[0] & MSG_CMD_MASK)   >> MSG_CMD_SHIFT;
-	msg->type  = (data[0] & MSG_TYPE_MASK)  >> MSG_TYPE_SHIFT;
-	msg->flags = (data[0] & MSG_FLAGS_MASK) >> MSG_FLAGS_SHIFT;
-	msg->rid   = (data[0] & MSG_RID_MASK)   >> MSG_RID_SHIFT;
-	msg->pes   = (data[1] & MSG_PES_MASK)   >> MSG_PES_SHIFT;
-	msg->mem   = (data[1] & MSG_MEM_MASK)   >> MSG_MEM_SHIFT;
-	msg->nres  =  (data[1] & MSG_NRES_MASK) >> MSG_NRES_SHIFT;
-	msg->taskid  =  (data[2] & MSG_TASKID_MASK) >> MSG_TASKID_SHIFT;
-
-	msg->ndependencies = ((uint32_t*)data)[6];
-	memcpy(msg->dependencies, &((uint32_t*)data)[7], sizeof(uint32_t) * msg->ndependencies);
-	Dprintf("Number of dependencies inside message recieve: %"PRIu32"", msg->ndependencies);
+	if(size < MSG_HDR_SIZE){
+		eprintf("Message from %s too short (%lu bytes).", src, size);
+		return -1;
+	}
 
-    for(int i=0; i<MCL_DEV_DIMS; i++){
-        msg->pesdata.pes[i] = data[2+i];
-        msg->pesdata.lpes[i] = data[2+MCL_DEV_DIMS+i];
-    }
+	if(data[0] != MSG_WIRE_VERSION){
+		eprintf("Message from %s has wire version %u, expected %u.", src, data[0], MSG_WIRE_VERSION);
+		return -1;
+	}
+
+	len = data[2] | ((uint64_t) data[3] << 8);
+	if(len < MSG_HDR_SIZE || len > size){
+		eprintf("Message from %s has invalid length %"PRIu64" (%lu bytes received).", src, len, size);
+		return -1;
+	}
+
+	msg->cmd = data[1];
+	p = data + MSG_HDR_SIZE;
+	end = data + len;
+
+	MSG_GET(p, end, fields);
+	if(fields & ~MSG_FIELD_ALL){
+		eprintf("Message from %s has unknown fields 0x%"PRIx64".", src, fields & ~MSG_FIELD_ALL);
+		return -1;
+	}
+
+	if(fields & MSG_FIELD_TYPE)
+		MSG_GET(p, end, msg->type);
+	if(fields & MSG_FIELD_FLAGS)
+		MSG_GET(p, end, msg->flags);
+	if(fields & MSG_FIELD_RID)
+		MSG_GET(p, end, msg->rid);
+	if(fields & MSG_FIELD_PES)
+		MSG_GET(p, end, msg->pes);
+	if(fields & MSG_FIELD_MEM)
+		MSG_GET(p, end, msg->mem);
+	if(fields & MSG_FIELD_TASKID)
+		MSG_GET(p, end, msg->taskid);
+	if(fields & MSG_FIELD_PESDATA){
+		for(int i=0; i<MCL_DEV_DIMS; i++)
+			MSG_GET(p, end, msg->pesdata.pes[i]);
+		for(int i=0; i<MCL_DEV_DIMS; i++)
+			MSG_GET(p, end, msg->pesdata.lpes[i]);
+	}
+
+	if(fields & MSG_FIELD_DEPS){
+		int64_t prev = 0;
+		uint64_t delta;
+
+		MSG_GET(p, end, msg->ndependencies);
+		if(msg->ndependencies > MCL_MAX_DEPENDENCIES){
+			eprintf("Message from %s has too many dependencies (%"PRIu32").", src, msg->ndependencies);
+			return -1;
+		}
+		for(uint32_t i=0; i<msg->ndependencies; i++){
+			MSG_GET(p, end, delta);
+			prev += msg_unzigzag(delta);
+			msg->dependencies[i] = (uint32_t) prev;
+		}
+	}
+	Dprintf("Number of dependencies inside message recieve: %"PRIu32"", msg->ndependencies);
 
-    if(msg->nres) {
+	if(fields & MSG_FIELD_RES){
+		MSG_GET(p, end, msg->nres);
+		if(msg->nres > MCL_RES_ARGS_MAX){
+			eprintf("Message from %s has too many resident arguments (%"PRIu64").", src, msg->nres);
+			msg->nres = 0;
+			return -1;
+		}
 		Dprintf("Number of resident memory inside message receive: %"PRIu64"", msg->nres);
-        msg->resdata = (msg_arg_t*)malloc(msg->nres * sizeof(msg_arg_t));
-        if(!msg->resdata){
-            eprintf("Unable to allocate memory");
-            return -1;
-        }
-        for(int i = 0, j = 3 + ((MCL_MAX_DEPENDENCIES + 1)/2) + (2*MCL_DEV_DIMS); i < msg->nres; i += 1, j += 2){
-            msg->resdata[i].mem_id   = (data[j] & MSG_MEMID_MASK)     >> MSG_MEMID_SHIFT;
-			msg->resdata[i].pid      = (data[j] & MSG_PID_MASK)       >> MSG_PID_SHIFT;
-            msg->resdata[i].flags    = (data[j] & MSG_MEMFLAG_MASK)   >> MSG_MEMFLAG_SHIFT;
-			msg->resdata[i].overall_size = (data[j+1] & MSG_OVERALL_MASK) >> MSG_OVERALL_SHIFT;
-			msg->resdata[i].mem_size     = (data[j+1] & MSG_MEMSIZE_MASK) >> MSG_MEMSIZE_SHIFT;
-			msg->resdata[i].mem_offset   = (data[j+1] & MSG_OFFSET_MASK) >> MSG_OFFSET_SHIFT;
-        }
-    }
-	
+		for(int i=0; i<msg->nres; i++){
+			msg_arg_t* arg = &msg->resdata[i];
+
+			MSG_GET(p, end, arg->mem_id);
+			MSG_GET(p, end, arg->flags);
+			arg->pid = 0;
+			if(arg->flags & MSG_ARGFLAG_SHARED)
+				MSG_GET(p, end, arg->pid);
+			MSG_GET(p, end, arg->overall_size);
+			MSG_GET(p, end, arg->mem_size);
+			MSG_GET(p, end, arg->mem_offset);
+		}
+	}
+
+	if(fields & MSG_FIELD_CREDITS)
+		MSG_GET(p, end, msg->credits);
+	if(fields & MSG_FIELD_DEADLINE)
+		MSG_GET(p, end, msg->deadline);
+	if(fields & MSG_FIELD_WEIGHT)
+		MSG_GET(p, end, msg->weight);
+	if(fields & MSG_FIELD_RUNTIME)
+		MSG_GET(p, end, msg->runtime);
+	if(fields & MSG_FIELD_ACKS){
+		int64_t prev = 0;
+		uint64_t delta;
+
+		MSG_GET(p, end, msg->nacks);
+		if(msg->nacks > MCL_ACKS_MAX){
+			eprintf("Message from %s has too many ACKs (%"PRIu32").", src, msg->nacks);
+			msg->nacks = 0;
+			return -1;
+		}
+		for(uint32_t i=0; i<msg->nacks; i++){
+			MSG_GET(p, end, delta);
+			prev += msg_unzigzag(delta);
+			msg->acks[i].rid = (uint64_t) prev;
+			MSG_GET(p, end, msg->acks[i].res);
+		}
+	}
+	if(fields & MSG_FIELD_LIMITS){
+		MSG_GET(p, end, msg->max_reqs);
+		MSG_GET(p, end, msg->max_mem);
+	}
+
 	return 0;
+
+err_trunc:
+	eprintf("Message 0x%"PRIx64" from %s is truncated.", msg->cmd, src);
+	msg->nres = 0;
+	msg->nacks = 0;
+	return -1;
 }
 
 int msg_init(struct mcl_msg_struct* m)
@@ -111,13 +654,65 @@ int msg_init(struct mcl_msg_struct* m)
     m->nres  = 0x0;
 	
 	m->taskid = 0x0;
+	m->credits = 0x0;
+	m->deadline = 0x0;
+	m->weight = 0x0;
+	m->runtime = 0x0;
+	m->nacks = 0x0;
+	m->max_reqs = 0x0;
+	m->max_mem = 0x0;
 	memset(m->dependencies, 0, sizeof(uint32_t) * MCL_MAX_DEPENDENCIES);
     memset(&(m->pesdata), 0x0, sizeof(msg_pes_t));
     m->ndependencies = 0;
-    m->resdata = NULL;
 	return 0;
 }
 
+/*
+ * Socket I/O goes either straight to the system calls or through io_uring
+ * (MCL_MSG_IO=uring). Single receives always use recvfrom(), so that threads
+ * that receive only once, like the registration, never keep an io_uring
+ * receive armed on the socket.
+ */
+static inline ssize_t msg_sendto(int fd, uint8_t* data, size_t len, struct sockaddr_un* dst)
+{
+#ifdef MCL_IO_URING
+	if(io_mode == MCL_MSG_IO_URING){
+		struct iovec iov = { .iov_base = data, .iov_len = len };
+		struct mmsghdr hdr;
+
+		memset(&hdr, 0, sizeof(struct mmsghdr));
+		hdr.msg_hdr.msg_name    = dst;
+		hdr.msg_hdr.msg_namelen = sizeof(struct sockaddr_un);
+		hdr.msg_hdr.msg_iov     = &iov;
+		hdr.msg_hdr.msg_iovlen  = 1;
+
+		return iou_sendmmsg(fd, &hdr, 1) == 1 ? hdr.msg_len : -1;
+	}
+#endif
+	return sendto(fd, (void*) data, len, 0, (struct sockaddr*) dst,
+		      sizeof(struct sockaddr_un));
+}
+
+#if !__APPLE__
+static inline int msg_sendmmsg(int fd, struct mmsghdr* hdr, int n)
+{
+#ifdef MCL_IO_URING
+	if(io_mode == MCL_MSG_IO_URING)
+		return iou_sendmmsg(fd, hdr, n);
+#endif
+	return sendmmsg(fd, hdr, n, 0);
+}
+
+static inline int msg_recvmmsg(int fd, struct mmsghdr* hdr, int n)
+{
+#ifdef MCL_IO_URING
+	if(io_mode == MCL_MSG_IO_URING)
+		return iou_recvmmsg(fd, hdr, n);
+#endif
+	return recvmmsg(fd, hdr, n, MSG_DONTWAIT, NULL);
+}
+#endif
+
 /*
  * Return:
  *    0 on success (message sent)
@@ -127,23 +722,16 @@ int msg_init(struct mcl_msg_struct* m)
 */
 int msg_send(struct mcl_msg_struct* msg, int fd, struct sockaddr_un* dst)
 {
-    ssize_t data_size = MCL_MSG_SIZE + (sizeof(uint64_t) * msg->nres * 2);
-	uint64_t*  data = (uint64_t*)malloc(data_size);
-    if(!data){
-        eprintf("Error allocating message memory.");
-    }
-	ssize_t len = data_size, ret;
+	uint8_t data[MCL_MAX_MSG_SIZE];
+	ssize_t len, ret;
 	
 	Dprintf("Sending msg cmd: 0x%" PRIx64 " to %s",msg->cmd,dst->sun_path);
-	if(msg_assemble(msg, data)){
+	if((len = msg_assemble(msg, data)) < 0){
 		eprintf("Error assembling message.");
-                free(data);
 		return -1;
 	}
 
-	ret = sendto(fd, (void*)data, len, 0, (struct sockaddr*) dst,
-		     sizeof(struct sockaddr_un));
-        free(data);
+	ret = msg_sendto(fd, data, len, dst);
 
 	if(ret == len)
 		return 0;
@@ -162,13 +750,14 @@ int msg_send(struct mcl_msg_struct* msg, int fd, struct sockaddr_un* dst)
 /*
  *  Return:
  *     0 on success (message recevied)
- *    -1 on failure (no message received, something went wrong)
+ *    -1 on failure (no message received, something went wrong), errno is
+ *       EBADMSG if a malformed message has been received and discarded
  *     1 if no message has been received but no error was detected (EGAIN, non-blocking)
  */
 int msg_recv(struct mcl_msg_struct* msg, int fd, struct sockaddr_un* src)
 {
-	uint64_t data[8 + ((MCL_MAX_DEPENDENCIES+1)/2) + (2 * MCL_RES_ARGS_MAX)];
-	uint64_t data_size = MCL_MAX_MSG_SIZE;
+	uint8_t   data[MCL_MAX_MSG_SIZE];
+	uint64_t  data_size = MCL_MAX_MSG_SIZE;
 	socklen_t len;
 	ssize_t   bytes;
 
@@ -187,15 +776,340 @@ int msg_recv(struct mcl_msg_struct* msg, int fd, struct sockaddr_un* src)
 	}
 
 	Dprintf("Received %ld bytes from %s", bytes, src->sun_path);
-	if(msg_disassemble(data, msg, src->sun_path)){
+	if(msg_disassemble(data, bytes, msg, src->sun_path)){
 		eprintf("Error disassembling message.");
+		errno = EBADMSG;
 		return -1;
 	}
 	
 	return 0;
 }
 
-void msg_free(struct mcl_msg_struct* msg) {
-    free(msg->resdata);
-    msg->resdata = NULL;
+#if !__APPLE__
+/*
+ * Send up to n messages with a single system call, msgs[i] is sent to dst[i].
+ * Return:
+ *    number of messages sent, which might be less than n (0 if the operation
+ *    would have blocked). Need to try again with the remaining messages.
+ *   -1 on failure
+ */
+int msg_send_batch(struct mcl_msg_struct* msgs, int n, int fd, struct sockaddr_un* dst)
+{
+	uint8_t data[MCL_MSG_BATCH][MCL_MAX_MSG_SIZE];
+	struct mmsghdr hdr[MCL_MSG_BATCH];
+	struct iovec iov[MCL_MSG_BATCH];
+	ssize_t len;
+	int i, ret;
+
+	if(n > MCL_MSG_BATCH)
+		n = MCL_MSG_BATCH;
+
+	memset(hdr, 0, n * sizeof(struct mmsghdr));
+	for(i = 0; i < n; i++){
+		if((len = msg_assemble(&msgs[i], data[i])) < 0){
+			eprintf("Error assembling message.");
+			return -1;
+		}
+		iov[i].iov_base = data[i];
+		iov[i].iov_len  = len;
+		hdr[i].msg_hdr.msg_name    = &dst[i];
+		hdr[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_un);
+		hdr[i].msg_hdr.msg_iov     = &iov[i];
+		hdr[i].msg_hdr.msg_iovlen  = 1;
+	}
+
+	Dprintf("Sending %d messages", n);
+	ret = msg_sendmmsg(fd, hdr, n);
+
+	if(ret >= 0)
+		return ret;
+
+	if(errno == EAGAIN)
+		return 0;
+
+	eprintf("Error sending batch of %d messages.", n);
+	perror("sendmmsg");
+	return -1;
+}
+
+/*
+ * Receive up to n messages with a single system call, src[i] is set to the
+ * sender of msgs[i]. Malformed messages are dropped and do not take a slot
+ * in msgs.
+ * Return:
+ *    number of messages received (0 if no message was available)
+ *   -1 on failure
+ */
+int msg_recv_batch(struct mcl_msg_struct* msgs, int n, int fd, struct sockaddr_un* src)
+{
+	uint8_t data[MCL_MSG_BATCH][MCL_MAX_MSG_SIZE];
+	struct mmsghdr hdr[MCL_MSG_BATCH];
+	struct iovec iov[MCL_MSG_BATCH];
+	int i, ret, good;
+
+	if(n > MCL_MSG_BATCH)
+		n = MCL_MSG_BATCH;
+
+	memset(hdr, 0, n * sizeof(struct mmsghdr));
+	for(i = 0; i < n; i++){
+		iov[i].iov_base = data[i];
+		iov[i].iov_len  = MCL_MAX_MSG_SIZE;
+		hdr[i].msg_hdr.msg_name    = &src[i];
+		hdr[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_un);
+		hdr[i].msg_hdr.msg_iov     = &iov[i];
+		hdr[i].msg_hdr.msg_iovlen  = 1;
+	}
+
+	ret = msg_recvmmsg(fd, hdr, n);
+
+	if(ret < 0){
+		if(errno == EAGAIN)
+			return 0;
+		eprintf("Error receiving messages");
+		perror("recvmmsg");
+		return -1;
+	}
+
+	Dprintf("Received %d messages", ret);
+	for(i = 0, good = 0; i < ret; i++){
+		if(msg_disassemble(data[i], hdr[i].msg_len, &msgs[good], src[i].sun_path)){
+			eprintf("Error disassembling message, dropping it.");
+			continue;
+		}
+		if(good != i)
+			src[good] = src[i];
+		good++;
+	}
+
+	return good;
+}
+#else
+int msg_send_batch(struct mcl_msg_struct* msgs, int n, int fd, struct sockaddr_un* dst)
+{
+	int i, ret;
+
+	for(i = 0; i < n; i++)
+		if((ret = msg_send(&msgs[i], fd, &dst[i])))
+			return ret < 0 && i == 0 ? -1 : i;
+
+	return n;
+}
+
+int msg_recv_batch(struct mcl_msg_struct* msgs, int n, int fd, struct sockaddr_un* src)
+{
+	int i, ret, good = 0;
+
+	for(i = 0; i < n; i++){
+		if((ret = msg_recv(&msgs[good], fd, &src[good])) < 0 && errno == EBADMSG)
+			continue;
+		if(ret)
+			return ret < 0 && good == 0 ? -1 : good;
+		good++;
+	}
+
+	return good;
+}
+#endif
+
+static inline void msg_ring_name(char* name, size_t len, pid_t pid)
+{
+	const char* format;
+
+	if((format = getenv("MCL_RING_NAME")) == NULL)
+		format = MCL_RING_NAME;
+
+	snprintf(name, len, format, (long) pid);
+}
+
+static inline int msg_ring_map(mcl_ring_t* ring, int fd, int create)
+{
+	size_t rsize = ring_size(MCL_RING_SLOTS, MCL_MAX_MSG_SIZE);
+	struct ring *c2s, *s2c;
+
+	ring->size = 2 * rsize;
+	if(create && ftruncate(fd, ring->size)){
+		eprintf("Error truncating ring shared memory.");
+		perror("ftruncate");
+		return -1;
+	}
+
+	if(!create){
+		struct stat st;
+
+		if(fstat(fd, &st) || (size_t) st.st_size != ring->size){
+			eprintf("Ring shared memory has an unexpected size.");
+			return -1;
+		}
+	}
+
+	ring->base = mmap(NULL, ring->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(ring->base == MAP_FAILED){
+		eprintf("Error mapping ring shared memory.");
+		perror("mmap");
+		ring->base = NULL;
+		return -1;
+	}
+
+	c2s = (struct ring*) ring->base;
+	s2c = (struct ring*) ((char*) ring->base + rsize);
+	ring->tx = create ? c2s : s2c;
+	ring->rx = create ? s2c : c2s;
+
+	/* The segment comes from the client, check it before using it */
+	if(!create && (ring_check(ring->tx, &ring->tx_geom, rsize, MCL_RING_SLOTS, MCL_MAX_MSG_SIZE) ||
+		       ring_check(ring->rx, &ring->rx_geom, rsize, MCL_RING_SLOTS, MCL_MAX_MSG_SIZE))){
+		eprintf("Ring shared memory has an unexpected layout.");
+		munmap(ring->base, ring->size);
+		ring->base = NULL;
+		return -1;
+	}
+
+	if(create && (ring_init(ring->tx, &ring->tx_geom, MCL_RING_SLOTS, MCL_MAX_MSG_SIZE) ||
+		      ring_init(ring->rx, &ring->rx_geom, MCL_RING_SLOTS, MCL_MAX_MSG_SIZE))){
+		eprintf("Error initializing rings.");
+		munmap(ring->base, ring->size);
+		ring->base = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * The client creates the shared memory segment with the rings before registering,
+ * the scheduler opens it when it processes the registration request.
+ */
+int msg_ring_create(mcl_ring_t* ring, pid_t pid)
+{
+	char name[MCL_MAX_NAME_LEN];
+	int fd, ret;
+
+	msg_ring_name(name, sizeof(name), pid);
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+	if(fd < 0){
+		eprintf("Error creating ring shared memory %s.", name);
+		perror("shm_open");
+		return -1;
+	}
+
+	ret = msg_ring_map(ring, fd, 1);
+	close(fd);
+	if(ret)
+		shm_unlink(name);
+
+	return ret;
+}
+
+int msg_ring_open(mcl_ring_t* ring, pid_t pid)
+{
+	char name[MCL_MAX_NAME_LEN];
+	int fd, ret;
+
+	msg_ring_name(name, sizeof(name), pid);
+	fd = shm_open(name, O_RDWR, 0);
+	if(fd < 0){
+		eprintf("Error opening ring shared memory %s.", name);
+		perror("shm_open");
+		return -1;
+	}
+
+	ret = msg_ring_map(ring, fd, 0);
+	close(fd);
+
+	return ret;
+}
+
+void msg_ring_close(mcl_ring_t* ring)
+{
+	if(ring->base)
+		munmap(ring->base, ring->size);
+	ring->base = NULL;
+	ring->tx = NULL;
+	ring->rx = NULL;
+}
+
+void msg_ring_unlink(pid_t pid)
+{
+	char name[MCL_MAX_NAME_LEN];
+
+	msg_ring_name(name, sizeof(name), pid);
+	shm_unlink(name);
+}
+
+/*
+ * Same return values of msg_send(), 1 means that the ring is full.
+ */
+int msg_ring_send(struct mcl_msg_struct* msg, mcl_ring_t* ring)
+{
+	uint8_t data[MCL_MAX_MSG_SIZE];
+	ssize_t len;
+	int ret;
+
+	if((len = msg_assemble(msg, data)) < 0){
+		eprintf("Error assembling message.");
+		return -1;
+	}
+
+	ret = ring_push(ring->tx, &ring->tx_geom, data, len);
+	if(ret < 0)
+		eprintf("Error sending message 0x%" PRIx64 ".", msg->cmd);
+
+	return ret;
+}
+
+/*
+ * Same return values of msg_recv(), 1 means that the ring is empty.
+ */
+int msg_ring_recv(struct mcl_msg_struct* msg, mcl_ring_t* ring)
+{
+	uint8_t data[MCL_MAX_MSG_SIZE];
+	size_t len = sizeof(data);
+	int ret;
+
+	if((ret = ring_pop(ring->rx, &ring->rx_geom, data, &len)) > 0)
+		return 1;
+	if(ret < 0){
+		eprintf("Dropping oversized message from ring.");
+		return -1;
+	}
+
+	Dprintf("Received %lu bytes from ring", len);
+	if(msg_disassemble(data, len, msg, "ring")){
+		eprintf("Error disassembling message.");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Ring consumers park before sleeping on the socket, ring producers ring the
+ * doorbell (an empty NEX message on the socket) when the consumer is parked.
+ */
+void msg_ring_park(mcl_ring_t* ring)
+{
+	ring_park(ring->rx);
+}
+
+void msg_ring_unpark(mcl_ring_t* ring)
+{
+	ring_unpark(ring->rx);
+}
+
+int msg_ring_pending(mcl_ring_t* ring)
+{
+	return !ring_empty(ring->rx, &ring->rx_geom);
+}
+
+int msg_ring_doorbell(mcl_ring_t* ring, int fd, struct sockaddr_un* dst)
+{
+	struct mcl_msg_struct msg;
+
+	if(!ring_parked(ring->tx))
+		return 0;
+
+	msg_init(&msg);
+	msg.cmd = MSG_CMD_NEX;
+
+	return msg_send(&msg, fd, dst) < 0 ? -1 : 0;
 }
@@ -36,8 +36,9 @@
  * - Size of the hash table must be power of two: there is not a valid reason
  *   to not do that, as provides advantadges in hash masking and bit extraction.
  *
- * - Size of the hash table is fixed once and for all. For now the table
- *   doesn't support dynamic resize. 
+ * - Size of the hash table is fixed. ph_resize() moves the elements to a new
+ *   table, it is up to the user to call it (and to serialize it with other
+ *   accesses) when ph_used() gets close to the size.
  *
  * - Removal of elements is handled by 'tombstones':
  *   Due to collisions you cannot simply remove elements by put NULL (0), since
@@ -75,6 +76,7 @@ struct ph_table *ph_init(size_t size)
 
 	p->mask = size-1;
 	p->count = 0;
+	p->graves = 0;
 	memset(p->buckets, 0, size*sizeof(void*));
 
 	return p;
@@ -101,6 +103,8 @@ int ph_add_generic(struct ph_table *h, void *value, size_t keyoff, size_t keylen
 
 		if (!h->buckets[i] || h->buckets[i] == PH_ENTRY_DELETED) {
 			/* free slot found */
+			if (h->buckets[i])
+				h->graves--;
 			h->buckets[i] = value;
 			h->count++;
 			break;
@@ -179,6 +183,7 @@ void *ph_remove_generic(struct ph_table *h, const void *key, size_t keyoff, size
 				/* found */
 				h->buckets[i] = PH_ENTRY_DELETED;
 				--h->count;
+				++h->graves;
 				return entry;
 			}
 			/* collision, go ahead */
@@ -191,3 +196,22 @@ void *ph_remove_generic(struct ph_table *h, const void *key, size_t keyoff, size
 
 	return NULL;
 }
+
+struct ph_table *ph_resize_generic(struct ph_table *h, size_t size, size_t keyoff, size_t keylen)
+{
+	struct ph_table *p;
+	void *entry;
+
+	if (size <= h->count + 1 || !(p = ph_init(size)))
+		return NULL;
+
+	for (size_t i = 0; i <= h->mask; i++) {
+		entry = h->buckets[i];
+		if (entry && entry != PH_ENTRY_DELETED)
+			ph_add_generic(p, entry, keyoff, keylen);
+	}
+
+	free(h);
+
+	return p;
+}
@@ -0,0 +1,179 @@
+/**
+ * RING - Bounded lock-free queue of fixed-size slots
+ *
+ * Rationale:
+ * - Array of slots, each one tagged with a sequence number (D. Vyukov's bounded
+ *   MPMC queue). A slot at position pos is free for a producer when its
+ *   sequence equals pos, and ready for a consumer when it equals pos + 1.
+ *   Producers and consumers claim positions with a CAS on head and tail
+ *   respectively and then publish the slot by bumping its sequence number.
+ *
+ * - No locks and no pointers: the ring can be shared between processes through
+ *   a shared memory mapping, which is what the MCL shared memory transport does.
+ *
+ * - Number of slots must be a power of two, so positions can be masked.
+ *
+ * - Slot addresses and length checks use the caller's struct ring_geom, never
+ *   the header in the ring, which the peer process can overwrite at any time.
+ */
+
+#include "include/ring.h"
+
+#include <string.h>
+
+#define __ld_acq(addr)      __atomic_load_n(addr, __ATOMIC_ACQUIRE)
+#define __ld_rlx(addr)      __atomic_load_n(addr, __ATOMIC_RELAXED)
+#define __st_rel(addr, val) __atomic_store_n(addr, val, __ATOMIC_RELEASE)
+#define __cas(addr, old, new) \
+	__atomic_compare_exchange_n(addr, old, new, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)
+
+static inline size_t __slot_size(size_t payload)
+{
+	size_t size = sizeof(struct ring_slot) + payload;
+
+	return (size + RING_CACHELINE - 1) & ~((size_t) RING_CACHELINE - 1);
+}
+
+static inline struct ring_slot *__slot(struct ring *r, const struct ring_geom *g, uint64_t pos)
+{
+	return (struct ring_slot *) (r->slots + (pos & g->mask) * g->slot_size);
+}
+
+static inline void __geom(struct ring_geom *g, uint64_t nslots, size_t payload)
+{
+	g->mask = nslots - 1;
+	g->slot_size = __slot_size(payload);
+	g->payload = payload;
+}
+
+size_t ring_size(uint64_t nslots, size_t payload)
+{
+	return sizeof(struct ring) + nslots * __slot_size(payload);
+}
+
+int ring_init(struct ring *r, struct ring_geom *g, uint64_t nslots, size_t payload)
+{
+	if (nslots == 0 || (nslots & (nslots - 1)) != 0)
+		return -1;
+
+	__geom(g, nslots, payload);
+	memset(r, 0, sizeof(*r));
+	r->mask = g->mask;
+	r->slot_size = g->slot_size;
+	r->payload = g->payload;
+
+	for (uint64_t i = 0; i < nslots; i++) {
+		struct ring_slot *s = __slot(r, g, i);
+		s->len = 0;
+		__st_rel(&s->seq, i);
+	}
+
+	return 0;
+}
+
+int ring_check(struct ring *r, struct ring_geom *g, size_t size, uint64_t nslots, size_t payload)
+{
+	if (nslots == 0 || (nslots & (nslots - 1)) != 0 ||
+	    size < ring_size(nslots, payload) ||
+	    __ld_rlx(&r->mask) != nslots - 1 ||
+	    __ld_rlx(&r->payload) != payload ||
+	    __ld_rlx(&r->slot_size) != __slot_size(payload))
+		return -1;
+
+	/* From the arguments, not from the header that has just been checked */
+	__geom(g, nslots, payload);
+
+	return 0;
+}
+
+int ring_push(struct ring *r, const struct ring_geom *g, const void *data, size_t len)
+{
+	struct ring_slot *s;
+	uint64_t pos, seq;
+	int64_t diff;
+
+	if (len > g->payload)
+		return -1;
+
+	pos = __ld_rlx(&r->head);
+	for (;;) {
+		s = __slot(r, g, pos);
+		seq = __ld_acq(&s->seq);
+		diff = (int64_t) seq - (int64_t) pos;
+
+		if (diff == 0) {
+			if (__cas(&r->head, &pos, pos + 1))
+				break;
+		} else if (diff < 0) {
+			return 1;
+		} else {
+			pos = __ld_rlx(&r->head);
+		}
+	}
+
+	memcpy(s->data, data, len);
+	s->len = len;
+	__st_rel(&s->seq, pos + 1);
+
+	return 0;
+}
+
+int ring_pop(struct ring *r, const struct ring_geom *g, void *data, size_t *len)
+{
+	struct ring_slot *s;
+	uint64_t pos, seq, n;
+	int64_t diff;
+	int ret = 0;
+
+	pos = __ld_rlx(&r->tail);
+	for (;;) {
+		s = __slot(r, g, pos);
+		seq = __ld_acq(&s->seq);
+		diff = (int64_t) seq - (int64_t) (pos + 1);
+
+		if (diff == 0) {
+			if (__cas(&r->tail, &pos, pos + 1))
+				break;
+		} else if (diff < 0) {
+			return 1;
+		} else {
+			pos = __ld_rlx(&r->tail);
+		}
+	}
+
+	/* The producer may live in another process, do not trust the length */
+	n = __ld_rlx(&s->len);
+	if (n > g->payload || n > *len) {
+		ret = -1;
+	} else {
+		memcpy(data, s->data, n);
+		*len = n;
+	}
+	__st_rel(&s->seq, pos + g->mask + 1);
+
+	return ret;
+}
+
+int ring_empty(struct ring *r, const struct ring_geom *g)
+{
+	uint64_t pos = __ld_acq(&r->tail);
+
+	return __ld_acq(&__slot(r, g, pos)->seq) != pos + 1;
+}
+
+void ring_park(struct ring *r)
+{
+	__atomic_add_fetch(&r->parked, 1, __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void ring_unpark(struct ring *r)
+{
+	__atomic_sub_fetch(&r->parked, 1, __ATOMIC_SEQ_CST);
+}
+
+uint64_t ring_parked(struct ring *r)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	return __ld_rlx(&r->parked);
+}
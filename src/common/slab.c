@@ -0,0 +1,153 @@
+/**
+ * SLAB - Pools of fixed-size objects
+ *
+ * Rationale:
+ * - Objects that are allocated and released at a high rate (one or more per
+ *   message) are recycled instead of going through malloc()/free() every time.
+ *   Memory is taken from the heap SLAB_OBJS objects at a time and stays in the
+ *   pool until slab_fini().
+ *
+ * - Each thread caches free objects in a per-pool list indexed by the pool id,
+ *   in thread-local storage. The shared list is only touched, under the pool
+ *   lock, to move SLAB_BATCH objects at a time.
+ *
+ * - Pool ids are never reused, so a cache left behind by a thread that
+ *   exited (or a pool that was destroyed) is simply never looked at again.
+ */
+
+#include "include/slab.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#define SLAB_ALIGN(x) (((x) + 15) & ~((size_t) 15))
+
+struct slab_cache {
+	struct slab_obj *free;
+	size_t           n;
+};
+
+static unsigned int npools = 0;
+static __thread struct slab_cache caches[SLAB_MAX_POOLS];
+
+int slab_init(struct slab_pool *p, size_t size)
+{
+	unsigned int id = __atomic_fetch_add(&npools, 1, __ATOMIC_RELAXED);
+
+	if (id >= SLAB_MAX_POOLS)
+		return -1;
+
+	if (size < sizeof(struct slab_obj))
+		size = sizeof(struct slab_obj);
+
+	p->size  = SLAB_ALIGN(size);
+	p->id    = id;
+	p->free  = NULL;
+	p->slabs = NULL;
+	pthread_mutex_init(&p->lock, NULL);
+
+	return 0;
+}
+
+void slab_fini(struct slab_pool *p)
+{
+	struct slab *s;
+
+	while ((s = p->slabs)) {
+		p->slabs = s->next;
+		free(s);
+	}
+	p->free = NULL;
+	pthread_mutex_destroy(&p->lock);
+}
+
+/* Pool lock must be held */
+static int slab_grow(struct slab_pool *p)
+{
+	struct slab *s;
+	struct slab_obj *o;
+	char *objs;
+
+	s = (struct slab *) malloc(SLAB_ALIGN(sizeof(struct slab)) + SLAB_OBJS * p->size);
+	if (!s)
+		return -1;
+
+	s->next  = p->slabs;
+	p->slabs = s;
+
+	objs = (char *) s + SLAB_ALIGN(sizeof(struct slab));
+	for (int i = SLAB_OBJS - 1; i >= 0; i--) {
+		o       = (struct slab_obj *) (objs + i * p->size);
+		o->next = p->free;
+		p->free = o;
+	}
+
+	return 0;
+}
+
+static int slab_refill(struct slab_pool *p, struct slab_cache *c)
+{
+	struct slab_obj *o;
+
+	pthread_mutex_lock(&p->lock);
+	if (!p->free && slab_grow(p)) {
+		pthread_mutex_unlock(&p->lock);
+		return -1;
+	}
+
+	while (p->free && c->n < SLAB_BATCH) {
+		o       = p->free;
+		p->free = o->next;
+		o->next = c->free;
+		c->free = o;
+		c->n++;
+	}
+	pthread_mutex_unlock(&p->lock);
+
+	return 0;
+}
+
+static void slab_drain(struct slab_pool *p, struct slab_cache *c)
+{
+	struct slab_obj *o;
+
+	pthread_mutex_lock(&p->lock);
+	while (c->n > SLAB_BATCH) {
+		o       = c->free;
+		c->free = o->next;
+		o->next = p->free;
+		p->free = o;
+		c->n--;
+	}
+	pthread_mutex_unlock(&p->lock);
+}
+
+void *slab_alloc(struct slab_pool *p)
+{
+	struct slab_cache *c = &caches[p->id];
+	struct slab_obj *o;
+
+	if (!c->free && slab_refill(p, c))
+		return NULL;
+
+	o       = c->free;
+	c->free = o->next;
+	c->n--;
+
+	return o;
+}
+
+void slab_free(struct slab_pool *p, void *obj)
+{
+	struct slab_cache *c = &caches[p->id];
+	struct slab_obj *o = (struct slab_obj *) obj;
+
+	if (!obj)
+		return;
+
+	o->next = c->free;
+	c->free = o;
+
+	if (++c->n >= 2 * SLAB_BATCH)
+		slab_drain(p, c);
+}
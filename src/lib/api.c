@@ -139,6 +139,32 @@ int mcl_task_set_kernel(mcl_handle *h, char *name, uint64_t nargs)
     return __set_kernel(h, name, nargs);
 }
 
+int mcl_task_set_priority(mcl_handle *h, uint32_t prio)
+{
+    if (!h || prio > MCL_TASK_PRIO_MAX)
+    {
+        eprintf("Invalid argument for task set priority");
+        return -MCL_ERR_INVARG;
+    }
+
+    Dprintf("Setting task %u priority to %" PRIu32, h->rid, prio);
+
+    return __set_priority(h, prio);
+}
+
+int mcl_task_set_deadline(mcl_handle *h, uint64_t usecs)
+{
+    if (!h)
+    {
+        eprintf("Invalid argument for task set deadline");
+        return -MCL_ERR_INVARG;
+    }
+
+    Dprintf("Setting task %u deadline to %" PRIu64 " us from now", h->rid, usecs);
+
+    return __set_deadline(h, usecs);
+}
+
 int mcl_hdl_free(mcl_handle *h)
 {
     mcl_request *req;
@@ -159,6 +185,7 @@ int mcl_hdl_free(mcl_handle *h)
     req = req_del(&hash_reqs, h->rid);
     if (req)
     {
+        free(req->tsk->dependencies);
         free(req->tsk);
         free(req);
         stats_dec(mcl_desc.nreqs);
@@ -214,6 +241,7 @@ int mcl_get_dev(uint32_t id, mcl_dev_info *dev)
 int mcl_init(uint64_t workers, uint64_t flags)
 {
     uint64_t i;
+    const char *dispatch;
 
     if (cas(&status, MCL_NONE, MCL_STARTED) == false)
     {
@@ -231,14 +259,31 @@ int mcl_init(uint64_t workers, uint64_t flags)
     mcl_desc.flags = flags;
     mcl_desc.pid = getpid();
     mcl_desc.out_msg = 0;
+    mcl_desc.credits = MCL_CREDITS_MIN;
+    mcl_desc.credit_waiters = 0;
+    pthread_mutex_init(&mcl_desc.credit_lock, NULL);
+    pthread_cond_init(&mcl_desc.credit_cond, NULL);
+    mcl_desc.admit_max_reqs = 0;
+    mcl_desc.admit_max_mem = 0;
+    mcl_desc.admit_reqs = 0;
+    mcl_desc.admit_mem = 0;
+    mcl_desc.admit_waiters = 0;
+    mcl_desc.retry = NULL;
+    mcl_desc.nretry = 0;
+    pthread_mutex_init(&mcl_desc.admit_lock, NULL);
+    pthread_cond_init(&mcl_desc.admit_cond, NULL);
 #ifdef _STATS
     mcl_desc.nreqs = 0;
     mcl_desc.max_reqs = 0;
 #endif
-    pthread_barrier_init(&mcl_desc.wt_barrier, NULL, mcl_desc.workers + 2);
 
-    Dprintf("Initializing Minos Computing Library (wt=%" PRIu64 " flags=0x%" PRIx64 " max_msg=%lu (buffer size=%d msg size=%lu))",
-            mcl_desc.workers, mcl_desc.flags, MCL_MSG_MAX, MCL_SND_BUF, MCL_MSG_SIZE);
+    /* MCL_DISPATCH=thread: a single thread receives and routes messages to workers */
+    dispatch = getenv("MCL_DISPATCH");
+    mcl_desc.dispatch = dispatch && !strcmp(dispatch, "thread");
+    pthread_barrier_init(&mcl_desc.wt_barrier, NULL, mcl_desc.workers + 2 + mcl_desc.dispatch);
+
+    Dprintf("Initializing Minos Computing Library (wt=%" PRIu64 " flags=0x%" PRIx64 " max_msg=%lu (buffer size=%d max msg size=%lu))",
+            mcl_desc.workers, mcl_desc.flags, (unsigned long) MCL_MSG_MAX, MCL_SND_BUF, (unsigned long) MCL_MAX_MSG_SIZE);
 
     if (cli_setup())
     {
@@ -275,6 +320,16 @@ int mcl_init(uint64_t workers, uint64_t flags)
 #endif
     }
 
+    if (mcl_desc.dispatch)
+    {
+        Dprintf("Creating dispatcher thread...");
+        if (pthread_create(&mcl_desc.wdispatch, NULL, dispatcher, NULL))
+        {
+            eprintf("Error creating dispatcher thread.");
+            goto err_setup;
+        }
+    }
+
     if (flags & MCL_SET_BIND_WORKERS)
     {
 #ifndef __APPLE__
@@ -324,6 +379,7 @@ int mcl_finit(void)
     }
 
     cas(&status, MCL_ACTIVE, MCL_DONE);
+    msg_poll_wakeup();
 
     Dprintf("Terminating workers...");
     for (i = 0; i < mcl_desc.workers; i++)
@@ -334,6 +390,12 @@ int mcl_finit(void)
     }
     Dprintf("Worker threads terminated.");
 
+    if (mcl_desc.dispatch)
+    {
+        pthread_join(mcl_desc.wdispatch, NULL);
+        Dprintf("Dispatcher thread terminated.");
+    }
+
     Dprintf("Terminating cleanup thread...");
     pthread_join(mcl_desc.wcleanup, NULL);
     Dprintf("Cleanup thread terminated.");
@@ -726,6 +788,16 @@ static int mcl_exec_common(mcl_handle *h, uint64_t *pes, uint64_t *lsize, uint64
         eprintf("Invalid arguments, no dependency list is null but ndependencies is 0.");
         return -MCL_ERR_INVARG;
     }
+    if (ndependencies > 0)
+    {
+        t->dependencies = (mcl_request **)malloc(ndependencies * sizeof(mcl_request *));
+        if (!t->dependencies)
+        {
+            eprintf("Error allocating dependency list");
+            return -MCL_ERR_MEMALLOC;
+        }
+    }
+
     uint32_t dep_idx = 0;
     for (i = 0; i < ndependencies; i++)
     {
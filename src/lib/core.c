@@ -15,6 +15,7 @@
 #include <atomics.h>
 #include <minos.h>
 #include <minos_internal.h>
+#include <ring.h>
 #include <stats.h>
 #include <uthash.h>
 #include <utlist.h>
@@ -37,10 +38,26 @@ mcl_resource_t *mcl_res = NULL;
 mcl_class_t *mcl_class = NULL;
 
 char *shared_mem_name = NULL;
+static msg_event_t pending_ev;
+
+/* MCL_DISPATCH=thread: messages for worker i, and the event it sleeps on */
+static struct ring **inboxes = NULL;
+static struct ring_geom inbox_geom;
+static msg_event_t *inbox_evs = NULL;
 
 static inline int cli_msg_send(struct mcl_msg_struct *msg) {
     int ret;
 
+    if (mcl_desc.ring) {
+        while (((ret = msg_ring_send(msg, mcl_desc.ring)) > 0))
+            sched_yield();
+
+        if (!ret)
+            ret = msg_ring_doorbell(mcl_desc.ring, mcl_desc.sock_fd, &mcl_desc.saddr);
+
+        return ret;
+    }
+
     while (((ret = msg_send(msg, mcl_desc.sock_fd, &mcl_desc.saddr)) > 0))
         sched_yield();
 
@@ -50,9 +67,160 @@ static inline int cli_msg_send(struct mcl_msg_struct *msg) {
 static inline int cli_msg_recv(struct mcl_msg_struct *msg) {
     struct sockaddr_un src;
 
+    if (mcl_desc.ring)
+        return msg_ring_recv(msg, mcl_desc.ring);
+
     return msg_recv(msg, mcl_desc.sock_fd, &src);
 }
 
+static inline int cli_msg_send_batch(struct mcl_msg_struct *msgs, int n) {
+    struct sockaddr_un dst[MCL_MSG_BATCH];
+    int i, sent, ret;
+
+    if (mcl_desc.ring) {
+        for (i = 0; i < n; i++)
+            if (cli_msg_send(&msgs[i]))
+                return -1;
+
+        return 0;
+    }
+
+    for (i = 0; i < n && i < MCL_MSG_BATCH; i++)
+        dst[i] = mcl_desc.saddr;
+
+    for (sent = 0; sent < n; sent += ret) {
+        ret = msg_send_batch(msgs + sent, n - sent, mcl_desc.sock_fd, dst);
+        if (ret < 0)
+            return -1;
+        if (ret == 0)
+            sched_yield();
+    }
+
+    return 0;
+}
+
+/*
+ * Every request sent to the scheduler takes a credit, which is given back when
+ * the scheduler answers. The scheduler sets the number of credits of the client
+ * in its replies, based on its capacity and on the number of clients. Threads
+ * that run out of credits sleep until a reply comes back.
+ */
+static inline void cli_credit_acquire(void) {
+    uint64_t out;
+
+    while (1) {
+        out = __atomic_load_n(&(mcl_desc.out_msg), __ATOMIC_RELAXED);
+        if (out < __atomic_load_n(&(mcl_desc.credits), __ATOMIC_RELAXED)) {
+            if (cas(&(mcl_desc.out_msg), out, out + 1))
+                return;
+            continue;
+        }
+
+        pthread_mutex_lock(&mcl_desc.credit_lock);
+        ainc(&(mcl_desc.credit_waiters));
+        while (__atomic_load_n(&(mcl_desc.out_msg), __ATOMIC_SEQ_CST) >=
+               __atomic_load_n(&(mcl_desc.credits), __ATOMIC_SEQ_CST))
+            pthread_cond_wait(&mcl_desc.credit_cond, &mcl_desc.credit_lock);
+        adec(&(mcl_desc.credit_waiters));
+        pthread_mutex_unlock(&mcl_desc.credit_lock);
+    }
+}
+
+/*
+ * Give back a credit and apply the number of credits granted by the scheduler
+ * (0 if the reply does not carry any).
+ */
+static inline void cli_credit_release_n(uint64_t credits, uint64_t n) {
+    if (credits)
+        __atomic_store_n(&(mcl_desc.credits), credits, __ATOMIC_SEQ_CST);
+    if (!n)
+        return;
+    fas(&(mcl_desc.out_msg), n);
+
+    if (__atomic_load_n(&(mcl_desc.credit_waiters), __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&mcl_desc.credit_lock);
+        pthread_cond_broadcast(&mcl_desc.credit_cond);
+        pthread_mutex_unlock(&mcl_desc.credit_lock);
+    }
+}
+
+static inline void cli_credit_release(uint64_t credits) {
+    cli_credit_release_n(credits, 1);
+}
+
+/*
+ * Give back the credits taken by the messages of req, once: the reply to the
+ * EXE message and a failure to send may race.
+ */
+static inline void cli_credit_release_req(mcl_request *req, uint64_t credits) {
+    cli_credit_release_n(credits, __atomic_exchange_n(&req->credits, 0, __ATOMIC_SEQ_CST));
+}
+
+/*
+ * Admission control. The scheduler grants at registration the number of
+ * requests and the memory (pages) the client may have outstanding, from
+ * submission to completion. Threads that would go over a limit sleep until
+ * requests complete, so the scheduler does not have to refuse them. While
+ * requests refused by the scheduler (MSG_CMD_BUSY) wait to be sent again,
+ * new requests wait too so that the refused ones go first. A request is
+ * always admitted when nothing is outstanding.
+ */
+static inline int cli_admit_full(uint64_t mem) {
+    if (mcl_desc.nretry)
+        return 1;
+    if (!mcl_desc.admit_reqs)
+        return 0;
+
+    return (mcl_desc.admit_max_reqs && mcl_desc.admit_reqs >= mcl_desc.admit_max_reqs) ||
+           (mcl_desc.admit_max_mem && mcl_desc.admit_mem + mem > mcl_desc.admit_max_mem);
+}
+
+static inline void cli_admit(uint64_t mem) {
+    pthread_mutex_lock(&mcl_desc.admit_lock);
+    while (cli_admit_full(mem)) {
+        mcl_desc.admit_waiters++;
+        pthread_cond_wait(&mcl_desc.admit_cond, &mcl_desc.admit_lock);
+        mcl_desc.admit_waiters--;
+    }
+    mcl_desc.admit_reqs++;
+    mcl_desc.admit_mem += mem;
+    pthread_mutex_unlock(&mcl_desc.admit_lock);
+}
+
+static void cli_retry(void);
+
+static inline void cli_admit_release(uint64_t mem) {
+    uint64_t retry;
+
+    pthread_mutex_lock(&mcl_desc.admit_lock);
+    mcl_desc.admit_reqs--;
+    mcl_desc.admit_mem -= mem;
+    retry = mcl_desc.nretry;
+    if (mcl_desc.admit_waiters)
+        pthread_cond_broadcast(&mcl_desc.admit_cond);
+    pthread_mutex_unlock(&mcl_desc.admit_lock);
+
+    if (retry)
+        cli_retry();
+}
+
+/*
+ * Return the number of messages received (0 if none was available) or -1 on error.
+ */
+static inline int cli_msg_recv_batch(struct mcl_msg_struct *msgs, int n) {
+    struct sockaddr_un src[MCL_MSG_BATCH];
+    int count = 0, ret;
+
+    if (mcl_desc.ring) {
+        while (count < n && !(ret = msg_ring_recv(&msgs[count], mcl_desc.ring)))
+            count++;
+
+        return count ? count : (ret < 0 ? -1 : 0);
+    }
+
+    return msg_recv_batch(msgs, n, mcl_desc.sock_fd, src);
+}
+
 static inline uint32_t get_rid(void) {
     return ainc(&curr_h);
 }
@@ -454,6 +622,32 @@ err:
     return -ret;
 }
 
+int __set_priority(mcl_handle *h, uint32_t prio) {
+    mcl_request *r = NULL;
+
+    r = rlist_search(&ptasks, &ptasks_lock, h->rid);
+    if (!r)
+        return -MCL_ERR_INVREQ;
+
+    req_getTask(r)->prio = prio;
+
+    return 0;
+}
+
+int __set_deadline(mcl_handle *h, uint64_t usecs) {
+    mcl_request *r = NULL;
+    struct timespec now;
+
+    r = rlist_search(&ptasks, &ptasks_lock, h->rid);
+    if (!r)
+        return -MCL_ERR_INVREQ;
+
+    __get_time(&now);
+    req_getTask(r)->deadline = usecs ? BILLION * now.tv_sec + now.tv_nsec + usecs * 1000 : 0;
+
+    return 0;
+}
+
 mcl_handle *__task_init(char *path, char *name, uint64_t nargs, char *opts, unsigned long flags) {
     mcl_handle *h = __task_create(0);
 
@@ -501,33 +695,173 @@ int __set_arg(mcl_handle *h, uint64_t id, void *addr, size_t size, off_t offset,
     return 0;
 }
 
-int __am_exec(mcl_handle *hdl, mcl_request *req, uint64_t flags) {
+/*
+ * Build the EXE message of req from its task, the flags and memory saved by
+ * __am_exec and the resident data it found. Requests refused by the scheduler
+ * are sent again with the same message.
+ */
+static void __exe_msg(mcl_request *req, struct mcl_msg_struct *msg) {
     mcl_task *t = req_getTask(req);
-    struct mcl_msg_struct msg;
-    int retcode = 0;
+    msg_arg_t *arg;
+    mcl_rdata *el;
     mcl_arg *a;
 
-    assert(hdl->status == MCL_REQ_ALLOCATED);
-    msg_init(&msg);
+    msg_init(msg);
 
-    msg.cmd = MSG_CMD_EXE;
-    msg.rid = hdl->rid;
-    msg.pes = t->tpes;
-    msg.type = flags & MCL_TASK_TYPE_MASK;
-    msg.flags = (flags & MCL_TASK_FLAG_MASK) >> MCL_TASK_FLAG_SHIFT;
-    msg.nres = 0;
+    msg->cmd = MSG_CMD_EXE;
+    msg->rid = req->key;
+    msg->pes = t->tpes;
+    msg->mem = req->mem;
+    msg->type = req->flags & MCL_TASK_TYPE_MASK;
+    msg->flags = (req->flags & MCL_TASK_FLAG_MASK) >> MCL_TASK_FLAG_SHIFT;
+    msg->flags |= ((uint64_t)t->prio << MSG_FLAG_PRIO_SHIFT) & MSG_FLAG_PRIO_MASK;
+    msg->deadline = t->deadline;
+    msg->taskid = t->kernel ? t->kernel->id : 0;
+    msg->nres = 0;
 
     for (int i = 0; i < MCL_DEV_DIMS; i++) {
-        msg.pesdata.pes[i] = t->pes[i];
-        msg.pesdata.lpes[i] = t->lpes[i];
+        msg->pesdata.pes[i] = t->pes[i];
+        msg->pesdata.lpes[i] = t->lpes[i];
+    }
+
+    for (uint64_t i = 0; i < t->nargs; i++) {
+        a = &(t->args[i]);
+        if (!(a->flags & MCL_ARG_BUFFER) || !(a->flags & MCL_ARG_RESIDENT))
+            continue;
+
+        el = a->rdata_el;
+        arg = &msg->resdata[msg->nres++];
+        memset(arg, 0, sizeof(msg_arg_t));
+        arg->mem_id = el->id;
+
+        if (a->flags & MCL_ARG_DYNAMIC) {
+            arg->flags = MSG_ARGFLAG_EXCLUSIVE;
+        }
+
+        if (a->flags & MCL_ARG_SHARED) {
+            arg->flags |= MSG_ARGFLAG_SHARED;
+            arg->pid = mcl_get_shared_mem_pid(a->addr);
+        }
+
+        /*
+         * Schedulers that accepted wide descriptors at registration get sizes and
+         * offsets in bytes, the others in MCL_MEM_PAGE_SIZE units.
+         */
+        if (mcl_desc.reg_flags & MSG_REGFLAG_WIDE) {
+            arg->flags |= MSG_ARGFLAG_WIDE;
+            arg->overall_size = el->size;
+            arg->mem_size = a->size;
+            arg->mem_offset = a->offset;
+        }
+        else {
+            arg->overall_size = (uint64_t)((el->size / MCL_MEM_PAGE_SIZE) + .5);
+            arg->mem_size = (uint64_t)((a->size - 1) / MCL_MEM_PAGE_SIZE + 1.0);
+            arg->mem_offset = a->offset / (uint64_t)MCL_MEM_PAGE_SIZE;
+        }
     }
 
     /*
-     * It is most time efficient to allocate the greatest memory that could be needed, but likely it
-     * is an overshoot
+     * Dependencies that do not fit in the EXE message are sent right after it in
+     * MSG_CMD_DEPS messages, the scheduler holds the task until the last one.
      */
-    msg.resdata = malloc(t->nargs * sizeof(msg_arg_t));
-    memset(msg.resdata, 0, t->nargs * sizeof(msg_arg_t));
+    msg->ndependencies = t->ndependencies < MCL_MAX_DEPENDENCIES ? t->ndependencies : MCL_MAX_DEPENDENCIES;
+    for (uint32_t i = 0; i < msg->ndependencies; i++) {
+        msg->dependencies[i] = t->dependencies[i]->key;
+    }
+    if (msg->ndependencies < t->ndependencies)
+        msg->flags |= MSG_FLAG_MORE;
+}
+
+/*
+ * Send the EXE message of req and the MSG_CMD_DEPS messages that follow it.
+ * The caller has taken the credit of the EXE message, each DEPS message takes
+ * one more without waiting (the reply that gives credits back only comes once
+ * the scheduler has all the dependencies). They are all given back with the
+ * reply to the EXE message. Return 0, 1 if the EXE message could not be sent
+ * or -1 if the dependencies could not be sent.
+ */
+static int __exe_send(mcl_request *req) {
+    mcl_task *t = req_getTask(req);
+    struct mcl_msg_struct msg;
+
+    __exe_msg(req, &msg);
+
+    // Dprintf("Sending EXE AM RID: %"PRIu64" PEs: %"PRIu64" MEM: %"PRIu64, msg.rid, msg.pes,
+    //     msg.mem);
+
+    if (cli_msg_send(&msg)) {
+        eprintf("Error sending msg 0x%" PRIx64, msg.cmd);
+        return 1;
+    }
+
+    for (uint32_t sent = msg.ndependencies; sent < t->ndependencies; sent += msg.ndependencies) {
+        msg_init(&msg);
+        msg.cmd = MSG_CMD_DEPS;
+        msg.rid = req->key;
+        msg.ndependencies = t->ndependencies - sent;
+        if (msg.ndependencies > MCL_MAX_DEPENDENCIES) {
+            msg.ndependencies = MCL_MAX_DEPENDENCIES;
+            msg.flags = MSG_FLAG_MORE;
+        }
+
+        for (uint32_t i = 0; i < msg.ndependencies; i++)
+            msg.dependencies[i] = t->dependencies[sent + i]->key;
+
+        ainc(&(mcl_desc.out_msg));
+        ainc(&req->credits);
+        if (cli_msg_send(&msg)) {
+            eprintf("Error sending dependencies of task %" PRIu32, req->key);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * The EXE message of req went through but not all its dependencies: fail the
+ * request and tell the scheduler, which hands it back like any other request
+ * once the dependencies it got are satisfied, so that we can reply with an
+ * error without running it. Give back its credits; the caller releases the
+ * admission slot.
+ */
+static void __exe_abort(mcl_request *req) {
+    struct mcl_msg_struct msg;
+
+    __atomic_store_n(&req->aborted, 1, __ATOMIC_SEQ_CST);
+
+    msg_init(&msg);
+    msg.cmd = MSG_CMD_DEPS;
+    msg.rid = req->key;
+    msg.flags = MSG_FLAG_ABORT;
+    if (cli_msg_send(&msg))
+        eprintf("Error aborting task %" PRIu32, req->key);
+
+    cli_credit_release_req(req, 0);
+    req->hdl->ret = MCL_RET_ERROR;
+    cas(&(req->hdl->status), MCL_REQ_PENDING, MCL_REQ_COMPLETED);
+    adec(&mcl_desc.num_reqs);
+}
+
+int __am_exec(mcl_handle *hdl, mcl_request *req, uint64_t flags) {
+    mcl_task *t = req_getTask(req);
+    int retcode = 0;
+    uint64_t nres = 0;
+    mcl_arg *a;
+    int ret;
+
+    assert(hdl->status == MCL_REQ_ALLOCATED);
+
+    for (uint64_t i = 0; i < t->nargs; i++)
+        if ((t->args[i].flags & MCL_ARG_BUFFER) && (t->args[i].flags & MCL_ARG_RESIDENT))
+            nres++;
+
+    if (nres > MCL_RES_ARGS_MAX) {
+        eprintf("Task %" PRIu32 " has %" PRIu64 " resident arguments, at most %d are supported.",
+                hdl->rid, nres, MCL_RES_ARGS_MAX);
+        retcode = MCL_ERR_INVARG;
+        goto err;
+    }
 
     mcl_rdata *el;
     uint8_t swap_success;
@@ -539,16 +873,13 @@ int __am_exec(mcl_handle *hdl, mcl_request *req, uint64_t flags) {
             msg_init(&free_msg);
             free_msg.cmd = MSG_CMD_FREE;
             free_msg.nres = 1;
-            free_msg.resdata = (msg_arg_t *)malloc(sizeof(msg_arg_t));
             memset(free_msg.resdata, 0, sizeof(msg_arg_t));
             free_msg.resdata[0].mem_id = el->id;
             free_msg.resdata[0].mem_size = el->size;
             if (cli_msg_send(&free_msg)) {
                 eprintf("Error sending msg 0x%" PRIx64 ".", free_msg.cmd);
-                msg_free(&msg);
                 goto err;
             }
-            msg_free(&free_msg);
             Dprintf("\t Argument %" PRIu64 " free message sent", i);
 
             rdata_del(el);
@@ -556,43 +887,17 @@ int __am_exec(mcl_handle *hdl, mcl_request *req, uint64_t flags) {
 
         if ((a->flags & MCL_ARG_BUFFER) && (a->flags & MCL_ARG_RESIDENT)) {
             el = rdata_get(a->addr, 1);
-            if (el) {
-                msg.resdata[msg.nres].mem_id = el->id;
-                msg.resdata[msg.nres].overall_size = (uint64_t)((el->size / MCL_MEM_PAGE_SIZE) + .5);
-            }
-            else {
-                msg.resdata[msg.nres].mem_id = get_mem_id();
-                el = rdata_add(a->addr, msg.resdata[msg.nres].mem_id, a->size, a->flags);
-                msg.resdata[msg.nres].overall_size = (uint64_t)((el->size / MCL_MEM_PAGE_SIZE) + .5);
-            }
+            if (!el)
+                el = rdata_add(a->addr, get_mem_id(), a->size, a->flags);
             a->rdata_el = el;
 
-            if (a->flags & MCL_ARG_DYNAMIC) {
-                msg.resdata[msg.nres].flags = MSG_ARGFLAG_EXCLUSIVE;
-            }
-
-            if (a->flags & MCL_ARG_SHARED) {
-                msg.resdata[msg.nres].flags |= MSG_ARGFLAG_SHARED;
-                msg.resdata[msg.nres].pid = mcl_get_shared_mem_pid(a->addr);
-            }
-            msg.resdata[msg.nres].mem_size = (uint64_t)((a->size - 1) / MCL_MEM_PAGE_SIZE + 1.0);
-            msg.resdata[msg.nres].mem_offset = a->offset / (uint64_t)MCL_MEM_PAGE_SIZE;
-            msg.nres += 1;
-
             // The entire buffer has to be allocated at once to the task memory needs to
             // be adjusted for subbuffers
             t->mem += (el->size - a->size);
         }
     }
-    msg.mem = ceil((t->mem * (1 + MCL_TASK_OVERHEAD)) / MCL_PAGE_SIZE);
-
-    msg.ndependencies = t->ndependencies;
-    for (uint64_t i = 0; i < t->ndependencies; i++) {
-        msg.dependencies[i] = t->dependencies[i]->key;
-    }
-
-    // Dprintf("Sending EXE AM RID: %"PRIu64" PEs: %"PRIu64" MEM: %"PRIu64, msg.rid, msg.pes,
-    //     msg.mem);
+    req->flags = flags;
+    req->mem = ceil((t->mem * (1 + MCL_TASK_OVERHEAD)) / MCL_PAGE_SIZE);
 
     if (!cas(&(hdl->status), MCL_REQ_ALLOCATED, MCL_REQ_PENDING)) {
         eprintf("Task %" PRIu32 " failed to execute with incorrect status: %" PRIu64 ".", hdl->rid, hdl->status);
@@ -601,22 +906,26 @@ int __am_exec(mcl_handle *hdl, mcl_request *req, uint64_t flags) {
     };
     stats_timestamp(hdl->stat_submit);
 
-    while (__atomic_load_n(&(mcl_desc.out_msg), __ATOMIC_RELAXED) >= MCL_MSG_MAX)
-        sched_yield();
-
-    ainc(&(mcl_desc.out_msg));
+    cli_admit(req->mem);
+    cli_credit_acquire();
+    __atomic_store_n(&req->credits, 1, __ATOMIC_SEQ_CST);
 
-    if (cli_msg_send(&msg)) {
-        eprintf("Error sending msg 0x%" PRIx64, msg.cmd);
+    ret = __exe_send(req);
+    if (ret > 0) {
+        cli_credit_release_req(req, 0);
+        cli_admit_release(req->mem);
         retcode = MCL_ERR_SRVCOMM;
         goto err;
     }
-    msg_free(&msg);
+    else if (ret < 0) {
+        __exe_abort(req);
+        cli_admit_release(req->mem);
+        return -MCL_ERR_SRVCOMM;
+    }
 
     return 0;
 
 err:
-    msg_free(&msg);
     swap_success = cas(&(hdl->status), MCL_REQ_ALLOCATED, MCL_REQ_COMPLETED);
     assert(swap_success);
     hdl->ret = MCL_RET_ERROR;
@@ -637,13 +946,11 @@ int __am_null(mcl_request *req) {
     msg.mem = 0x0;
     msg.flags = 0x0;
 
-    while (__atomic_load_n(&(mcl_desc.out_msg), __ATOMIC_RELAXED) >= MCL_MSG_MAX)
-        sched_yield();
-
-    ainc(&(mcl_desc.out_msg));
+    cli_credit_acquire();
 
     if (cli_msg_send(&msg)) {
         eprintf("Error sending msg 0x%" PRIx64, msg.cmd);
+        cli_credit_release(0);
         goto err;
     }
 
@@ -653,17 +960,15 @@ int __am_null(mcl_request *req) {
     assert(swap_success);
     hdl->ret = MCL_RET_SUCCESS;
 
-    adec(&(mcl_desc.out_msg));
+    cli_credit_release(0);
 
     adec(&mcl_desc.num_reqs);
-    msg_free(&msg);
 
     return 0;
 
 err:
     adec(&mcl_desc.num_reqs);
     free(req);
-    msg_free(&msg);
 
     return -MCL_ERR_MEMALLOC;
 }
@@ -697,20 +1002,79 @@ int __internal_wait(mcl_handle *h, int blocking, uint64_t timeout) {
     return -1;
 }
 
+static void cli_dispatch_fini(void) {
+    if (inboxes)
+        for (uint64_t i = 0; i < mcl_desc.workers; i++)
+            free(inboxes[i]);
+    if (inbox_evs)
+        for (uint64_t i = 0; i < mcl_desc.workers; i++)
+            msg_event_fini(&inbox_evs[i]);
+    free(inboxes);
+    free(inbox_evs);
+    inboxes = NULL;
+    inbox_evs = NULL;
+}
+
+static int cli_dispatch_init(void) {
+    inboxes = (struct ring **)calloc(mcl_desc.workers, sizeof(struct ring *));
+    inbox_evs = (msg_event_t *)calloc(mcl_desc.workers, sizeof(msg_event_t));
+    if (!inboxes || !inbox_evs)
+        goto err;
+
+    for (uint64_t i = 0; i < mcl_desc.workers; i++)
+        inbox_evs[i].fd = -1;
+
+    for (uint64_t i = 0; i < mcl_desc.workers; i++) {
+        inboxes[i] = (struct ring *)malloc(ring_size(MCL_DISPATCH_SLOTS, sizeof(mcl_msg)));
+        if (!inboxes[i] || ring_init(inboxes[i], &inbox_geom, MCL_DISPATCH_SLOTS, sizeof(mcl_msg)))
+            goto err;
+        if (msg_event_init(&inbox_evs[i]))
+            goto err;
+    }
+
+    return 0;
+
+err:
+    eprintf("Error setting up worker message queues.");
+    cli_dispatch_fini();
+    return -1;
+}
+
 int cli_register(void) {
     struct mcl_msg_struct msg;
+    mcl_ring_t *ring = NULL;
+    const char *transport, *weight;
     int ret;
 
     msg_init(&msg);
     msg.cmd = MSG_CMD_REG;
     msg.rid = get_rid();
     msg.threads = (2 + mcl_desc.workers);
+    msg.flags = MSG_REGFLAG_WIDE;
+
+    /* Share of the devices relative to other clients, 1..MCL_WEIGHT_MAX */
+    if ((weight = getenv("MCL_SCHED_WEIGHT")))
+        msg.weight = strtoull(weight, NULL, 10);
+
+    /*
+     * Offer the shared memory transport to the scheduler. The rings are used
+     * only after the scheduler confirms that it has attached them.
+     */
+    if ((transport = getenv("MCL_MSG_TRANSPORT")) && !strcmp(transport, "shm")) {
+        ring = (mcl_ring_t *)malloc(sizeof(mcl_ring_t));
+        if (ring && !msg_ring_create(ring, mcl_desc.pid))
+            msg.flags |= MSG_REGFLAG_RING;
+        else {
+            eprintf("Unable to create shared memory rings, using socket.");
+            free(ring);
+            ring = NULL;
+        }
+    }
 
     if (cli_msg_send(&msg)) {
         eprintf("Error sending msg 0x%" PRIx64, msg.cmd);
         goto err;
     }
-    msg_free(&msg);
 
     Dprintf("Waiting for scheduler to accept registration request...");
 
@@ -725,13 +1089,34 @@ int cli_register(void) {
         goto err;
     }
 
+    if (ring) {
+        /* Both sides have the rings mapped now, the name is no longer needed */
+        msg_ring_unlink(mcl_desc.pid);
+        if (msg.flags & MSG_REGFLAG_RING) {
+            mcl_desc.ring = ring;
+            Dprintf("Using shared memory rings to communicate with the scheduler.");
+        }
+        else {
+            msg_ring_close(ring);
+            free(ring);
+        }
+    }
+
     mcl_desc.start_cpu = msg.res;
+    if (msg.credits)
+        mcl_desc.credits = msg.credits;
+    mcl_desc.reg_flags = msg.flags & MSG_REGFLAG_WIDE;
+    mcl_desc.admit_max_reqs = msg.max_reqs;
+    mcl_desc.admit_max_mem = msg.max_mem;
     Dprintf("Client registration confirmed.");
-    msg_free(&msg);
     return 0;
 
 err:
-    msg_free(&msg);
+    if (ring) {
+        msg_ring_close(ring);
+        msg_ring_unlink(mcl_desc.pid);
+        free(ring);
+    }
     return -1;
 }
 
@@ -746,14 +1131,12 @@ int cli_deregister(void) {
         eprintf("Error sending msg 0x%" PRIx64 ".", msg.cmd);
         goto err;
     }
-    msg_free(&msg);
 
     // Wait for request to be accepted...
 
     return 0;
 
 err:
-    msg_free(&msg);
     return -1;
 }
 
@@ -905,6 +1288,14 @@ int cli_setup(void) {
         goto err_rdata;
     }
 
+    if (msg_event_init(&pending_ev)) {
+        eprintf("Error initializing pending tasks event");
+        goto err_rdata;
+    }
+
+    if (mcl_desc.dispatch && cli_dispatch_init())
+        goto err_rdata;
+
     if (cli_register()) {
         eprintf("Error registering process %d.", mcl_desc.pid);
         goto err_rdata;
@@ -913,6 +1304,9 @@ int cli_setup(void) {
     return 0;
 
 err_rdata:
+    cli_dispatch_fini();
+    msg_event_fini(&pending_ev);
+    msg_finit();
     mcl_shm_free();
     rdata_free();
 err_res:
@@ -955,8 +1349,21 @@ int cli_shutdown(void) {
     if (cli_deregister())
         eprintf("Error de-registering process %d", mcl_desc.pid);
 
+    if (mcl_desc.ring) {
+        msg_ring_close(mcl_desc.ring);
+        free(mcl_desc.ring);
+        mcl_desc.ring = NULL;
+    }
+
     close(mcl_desc.sock_fd);
     unlink(mcl_desc.caddr.sun_path);
+    cli_dispatch_fini();
+    msg_event_fini(&pending_ev);
+    msg_finit();
+    pthread_cond_destroy(&mcl_desc.credit_cond);
+    pthread_mutex_destroy(&mcl_desc.credit_lock);
+    pthread_cond_destroy(&mcl_desc.admit_cond);
+    pthread_mutex_destroy(&mcl_desc.admit_lock);
 
     for (uint64_t i = 0; i < mcl_desc.info->nplts; i++) {
         for (uint64_t j = 0; j < mcl_plts[i].ndev; j++) {
@@ -1235,6 +1642,9 @@ err:
 static inline int __task_release(mcl_request *r) {
     mcl_task *t = req_getTask(r);
     mcl_context *ctx = task_getCtxAddr(t);
+    mcl_msg free_msgs[MCL_MSG_BATCH];
+    mcl_rdata *free_rdata[MCL_MSG_BATCH];
+    int nfree = 0;
     int i;
     int ret = 0;
     Dprintf("Task %u Removing %" PRIu64 " arguemnts", req_getHdl(r)->rid, t->nargs);
@@ -1258,29 +1668,32 @@ static inline int __task_release(mcl_request *r) {
             }
 
             if (t->args[i].flags & MCL_ARG_DONE) {
-                mcl_msg free_msg;
-                msg_init(&free_msg);
-                free_msg.cmd = MSG_CMD_FREE;
-                free_msg.nres = 1;
-                free_msg.resdata = (msg_arg_t *)malloc(sizeof(msg_arg_t));
-                memset(free_msg.resdata, 0, sizeof(msg_arg_t));
-                free_msg.resdata[0].mem_id = t->args[i].rdata_el->id;
-                free_msg.resdata[0].mem_size = t->args[i].size;
-                if (cli_msg_send(&free_msg)) {
-                    eprintf("Error sending msg 0x%" PRIx64 ".", free_msg.cmd);
-                    msg_free(&free_msg);
-                    ret = MCL_ERR_SRVCOMM;
-                    continue;
-                }
-                msg_free(&free_msg);
-
-                Dprintf("\t Argument %d free message sent", i);
-                rdata_del(t->args[i].rdata_el);
+                msg_init(&free_msgs[nfree]);
+                free_msgs[nfree].cmd = MSG_CMD_FREE;
+                free_msgs[nfree].nres = 1;
+                memset(&free_msgs[nfree].resdata[0], 0, sizeof(msg_arg_t));
+                free_msgs[nfree].resdata[0].mem_id = t->args[i].rdata_el->id;
+                free_msgs[nfree].resdata[0].mem_size = t->args[i].size;
+                free_rdata[nfree++] = t->args[i].rdata_el;
             }
         }
         else {
             clReleaseMemObject(ctx->buffers[i]);
         }
+
+        /* FREE messages for the released arguments are sent in batches */
+        if (nfree == MCL_MSG_BATCH || (nfree && i == t->nargs - 1)) {
+            if (cli_msg_send_batch(free_msgs, nfree)) {
+                eprintf("Error sending %d FREE messages.", nfree);
+                ret = MCL_ERR_SRVCOMM;
+            }
+            else {
+                Dprintf("\t %d free messages sent", nfree);
+                while (nfree)
+                    rdata_del(free_rdata[--nfree]);
+            }
+            nfree = 0;
+        }
     }
 
     if (r->hdl->cmd != MSG_CMD_TRAN)
@@ -1320,24 +1733,10 @@ static inline int create_waitlist(mcl_task *t, uint64_t res, int *nwait, cl_even
             waitlist[waitlist_idx++] = dep_task->ctx.event;
         }
         else {
-            uint32_t dep_idx = ainc(&dep_task->ndependents);
-
             // Temporary solution to pause thread
-            // eprintf("Trying to enqueue dependency from another device for handle %s depending on %s, res: %"PRIu64", dep res: %"PRIu64"", t->kname, dep_task->kname, res, r->res);
-            while (__atomic_load_n(&(dep_task->dependent_events[dep_idx]), __ATOMIC_SEQ_CST) == NULL) {
+            while (!__atomic_load_n(&(dep_task->completed), __ATOMIC_SEQ_CST)) {
                 sched_yield();
             }
-
-            // waitlist[waitlist_idx] = clCreateUserEvent(ctx, &err);
-            // if (cas(&(dep_task->dependent_events[dep_idx]), NULL, waitlist[waitlist_idx]))
-            //{
-            //     waitlist_idx += 1;
-            // }
-            // else
-            //{
-            //     // The task must have finished, so we don't need to wait anymore
-            //     clReleaseEvent(waitlist[waitlist_idx]);
-            // }
         }
     }
     *nwait = waitlist_idx;
@@ -1356,14 +1755,21 @@ static inline int cli_exec_am(struct worker_struct *desc, struct mcl_msg_struct
     uint8_t swap_success = 0;
     int retcode = 0;
 
-    adec(&(mcl_desc.out_msg));
     msg_init(&ack);
 
     r = req_search(&hash_reqs, msg->rid);
     if (!r) {
+        cli_credit_release(msg->credits);
         retcode = MCL_ERR_INVREQ;
         goto err;
     }
+    cli_credit_release_req(r, msg->credits);
+
+    /* Failed when its dependencies could not be sent, only let the scheduler know */
+    if (__atomic_load_n(&r->aborted, __ATOMIC_SEQ_CST)) {
+        retcode = MCL_ERR_SRVCOMM;
+        goto err;
+    }
 
     h = req_getHdl(r);
     t = req_getTask(r);
@@ -1403,10 +1809,19 @@ static inline int cli_exec_am(struct worker_struct *desc, struct mcl_msg_struct
     }
 
     int nwait = 0;
-    cl_event waitlist[MCL_MAX_DEPENDENCIES];
+    cl_event waitlist_buf[MCL_MAX_DEPENDENCIES];
+    cl_event *waitlist = waitlist_buf;
+    if (t->ndependencies > MCL_MAX_DEPENDENCIES) {
+        waitlist = (cl_event *)malloc(t->ndependencies * sizeof(cl_event));
+        if (!waitlist) {
+            retcode = MCL_ERR_MEMALLOC;
+            goto err_setup;
+        }
+    }
     create_waitlist(t, r->res, &nwait, waitlist);
 
     stats_timestamp(h->stat_exec_start);
+    __get_time(&r->tstart);
 
     cl_event kernel_event;
     if (h->cmd != MSG_CMD_TRAN) {
@@ -1419,6 +1834,9 @@ static inline int cli_exec_am(struct worker_struct *desc, struct mcl_msg_struct
         ret = clEnqueueMarkerWithWaitList(queue, 0, NULL, &kernel_event);
     }
 
+    if (waitlist != waitlist_buf)
+        free(waitlist);
+
     if (ret != CL_SUCCESS) {
         retcode = MCL_ERR_EXEC;
         eprintf("Error executing task %u (%d)", h->rid, ret);
@@ -1493,6 +1911,7 @@ static inline int cli_exec_am(struct worker_struct *desc, struct mcl_msg_struct
 
     free(read_events);
     assert(rlist_add(&ftasks, &ftasks_lock, r) == 0);
+    msg_event_notify(&pending_ev);
     ainc(&(desc->ntasks));
     Dprintf("Added task %u to queue (total: %ld, ret: %d)", h->rid, desc->ntasks, ret);
 
@@ -1513,6 +1932,7 @@ err_setup: /** TODO: check this **/
             clReleaseMemObject(ctx->buffers[i]);
 
 err_req:
+    cli_admit_release(r->mem);
     adec(&mcl_desc.num_reqs);
     cas(&(h->status), MCL_REQ_INPROGRESS, MCL_REQ_COMPLETED);
     h->ret = MCL_RET_ERROR;
@@ -1522,22 +1942,112 @@ err:
     ack.cmd = MSG_CMD_ERR;
     ack.rid = msg->rid;
     cli_msg_send(&ack);
-    msg_free(&ack);
 
     return -retcode;
 }
 
+/*
+ * Send again the requests refused by the scheduler, in the order they were
+ * submitted.
+ */
+static void cli_retry(void) {
+    mcl_request *r, *next;
+    uint64_t n = 0, failed = 0, mem = 0;
+
+    pthread_mutex_lock(&mcl_desc.admit_lock);
+    r = mcl_desc.retry;
+    mcl_desc.retry = NULL;
+    pthread_mutex_unlock(&mcl_desc.admit_lock);
+
+    for (; r; r = next) {
+        next = r->retry_next;
+        n++;
+        /* Failed already, its admission slot has been released */
+        if (__atomic_load_n(&r->aborted, __ATOMIC_SEQ_CST))
+            continue;
+
+        Dprintf("Sending again request %" PRIu32, r->key);
+
+        /* Take the credit without waiting, this thread may be the one that gives them back */
+        ainc(&(mcl_desc.out_msg));
+        ainc(&r->credits);
+        switch (__exe_send(r)) {
+        case 1:
+            eprintf("Error sending again request %" PRIu32, r->key);
+            cli_credit_release_req(r, 0);
+            failed++;
+            mem += r->mem;
+            r->hdl->ret = MCL_RET_ERROR;
+            cas(&(r->hdl->status), MCL_REQ_PENDING, MCL_REQ_COMPLETED);
+            adec(&mcl_desc.num_reqs);
+            break;
+        case -1:
+            __exe_abort(r);
+            failed++;
+            mem += r->mem;
+            break;
+        default:
+            break;
+        }
+    }
+
+    if (!n)
+        return;
+
+    pthread_mutex_lock(&mcl_desc.admit_lock);
+    mcl_desc.nretry -= n;
+    mcl_desc.admit_reqs -= failed;
+    mcl_desc.admit_mem -= mem;
+    if (mcl_desc.admit_waiters)
+        pthread_cond_broadcast(&mcl_desc.admit_cond);
+    pthread_mutex_unlock(&mcl_desc.admit_lock);
+}
+
+/*
+ * The scheduler refused a request (MSG_CMD_BUSY): queue it to be sent again
+ * when one of our requests completes. If all the outstanding requests have
+ * been refused nothing will complete, wait MCL_RETRY_NS and send them again.
+ */
+static inline int cli_busy_am(struct worker_struct *desc, struct mcl_msg_struct *msg) {
+    struct timespec ts = {.tv_sec = 0, .tv_nsec = MCL_RETRY_NS};
+    mcl_request *r, **p;
+    int stalled;
+
+    r = req_search(&hash_reqs, msg->rid);
+    if (!r) {
+        cli_credit_release(msg->credits);
+        return MCL_ERR_INVREQ;
+    }
+    cli_credit_release_req(r, msg->credits);
+
+    /* Failed already, the scheduler dropped it from its refused requests */
+    if (__atomic_load_n(&r->aborted, __ATOMIC_SEQ_CST))
+        return 0;
+
+    Dprintf("Worker %" PRIu64 ": scheduler busy, request %u will be sent again", desc->id, r->key);
+
+    pthread_mutex_lock(&mcl_desc.admit_lock);
+    for (p = &mcl_desc.retry; *p && (*p)->key < r->key; p = &(*p)->retry_next)
+        ;
+    r->retry_next = *p;
+    *p = r;
+    stalled = ++mcl_desc.nretry == mcl_desc.admit_reqs;
+    pthread_mutex_unlock(&mcl_desc.admit_lock);
+
+    if (stalled) {
+        nanosleep(&ts, NULL);
+        cli_retry();
+    }
+
+    return 0;
+}
+
 void CL_CALLBACK __task_complete(cl_event e, cl_int s, void *v_request) {
     mcl_request *r = (mcl_request *)v_request;
     mcl_task *tsk = r->tsk;
 
     // Notify waiting kernels on other devices
-    cl_event dep_event, sentinel = (cl_event)(-1);
-    for (uint32_t i = 0; i < MCL_MAX_DEPENDENCIES; i++) {
-        __atomic_exchange(&(tsk->dependent_events[i]), &sentinel, &dep_event, __ATOMIC_SEQ_CST);
-        // if (dep_event)
-        //     clSetUserEventStatus(dep_event, CL_COMPLETE);
-    }
+    __atomic_store_n(&(tsk->completed), 1, __ATOMIC_SEQ_CST);
 }
 
 static inline int __check_task(mcl_request *r) {
@@ -1549,6 +2059,7 @@ static inline int __check_task(mcl_request *r) {
     int retcode = 0;
     cl_int eventStatus = CL_SUBMITTED;
     int attempts = MCL_TASK_CHECK_ATTEMPTS;
+    struct timespec now;
 
     while (eventStatus != CL_COMPLETE && attempts) {
         sched_yield();
@@ -1567,6 +2078,7 @@ static inline int __check_task(mcl_request *r) {
     if (eventStatus != CL_COMPLETE)
         return 1;
 
+    __get_time(&now);
     uint8_t swap_success = cas(&(h->status), MCL_REQ_EXECUTING, MCL_REQ_FINISHING);
     assert(swap_success);
 
@@ -1586,9 +2098,10 @@ static inline int __check_task(mcl_request *r) {
     msg_init(&ack);
     ack.cmd = MSG_CMD_DONE;
     ack.rid = h->rid;
+    ack.runtime = __diff_time_ns(now, r->tstart);
     if (cli_msg_send(&ack))
         retcode = MCL_ERR_SRVCOMM;
-    msg_free(&ack);
+    cli_admit_release(r->mem);
 
     h->ret = retcode ? MCL_RET_ERROR : MCL_RET_SUCCESS;
 
@@ -1621,6 +2134,7 @@ static inline int __check_task(mcl_request *r) {
 void *check_pending(void *data) {
     mcl_rlist *li;
     mcl_request *r;
+    uint64_t idle = 0;
 
     int ret;
 
@@ -1645,8 +2159,17 @@ void *check_pending(void *data) {
         r = NULL;
         li = rlist_pop(&ftasks, &ftasks_lock);
 
-        if (li == NULL)
+        if (li == NULL) {
+            if (msg_poll_idle(&idle)) {
+                msg_event_park(&pending_ev);
+                if (!rlist_count(&ftasks, &ftasks_lock) && __atomic_load_n(&status, __ATOMIC_SEQ_CST) != MCL_DONE)
+                    msg_event_wait(&pending_ev);
+                else
+                    msg_event_unpark(&pending_ev);
+            }
             continue;
+        }
+        idle = 0;
 
         r = li->req;
         ret = __check_task(r);
@@ -1665,6 +2188,95 @@ void *check_pending(void *data) {
 
     pthread_exit(NULL);
 }
+/*
+ * Pop up to n messages from the inbox of worker id.
+ */
+static inline int cli_inbox_recv(uint64_t id, struct mcl_msg_struct *msgs, int n) {
+    size_t len = sizeof(struct mcl_msg_struct);
+    int count = 0;
+
+    while (count < n && !ring_pop(inboxes[id], &inbox_geom, &msgs[count], &len))
+        count++;
+
+    return count;
+}
+
+static inline void cli_dispatch_push(struct mcl_msg_struct *msg) {
+    uint64_t w = msg->res % mcl_desc.workers;
+
+    while (ring_push(inboxes[w], &inbox_geom, msg, sizeof(struct mcl_msg_struct)) > 0 &&
+           __atomic_load_n(&(status), __ATOMIC_RELAXED) != MCL_DONE)
+        sched_yield();
+    msg_event_notify(&inbox_evs[w]);
+}
+
+/*
+ * With MCL_DISPATCH=thread a single thread receives all messages from the
+ * scheduler and hands each one to the worker that owns the target device
+ * (msg->res), so the same worker always drives the same command queues.
+ */
+void *dispatcher(void *data) {
+    struct mcl_msg_struct msgs[MCL_MSG_BATCH];
+    int batch = msg_batch_size();
+    msg_poller_t poller;
+    uint64_t idle = 0;
+    uint32_t j, nacks;
+    int i, n;
+
+    if (msg_poller_init(&poller, mcl_desc.sock_fd, mcl_desc.ring != NULL)) {
+        eprintf("Dispatcher: Error setting up poller.");
+        pthread_barrier_wait(&mcl_desc.wt_barrier);
+        pthread_exit(NULL);
+    }
+
+    Dprintf("\t Dispatcher thread started...");
+    pthread_barrier_wait(&mcl_desc.wt_barrier);
+
+    while (__atomic_load_n(&(status), __ATOMIC_RELAXED) != MCL_DONE) {
+        n = cli_msg_recv_batch(msgs, batch);
+
+        if (n == -1) {
+            eprintf("Dispatcher: Error receiving message.");
+            break;
+        }
+
+        if (n == 0) {
+            if (msg_poll_idle(&idle)) {
+                if (mcl_desc.ring)
+                    msg_ring_park(mcl_desc.ring);
+                if ((!mcl_desc.ring || !msg_ring_pending(mcl_desc.ring)) &&
+                    __atomic_load_n(&(status), __ATOMIC_SEQ_CST) != MCL_DONE)
+                    msg_poller_wait(&poller);
+                if (mcl_desc.ring)
+                    msg_ring_unpark(mcl_desc.ring);
+            }
+            continue;
+        }
+        idle = 0;
+
+        for (i = 0; i < n; i++) {
+            if (msgs[i].cmd != MSG_CMD_ACKS) {
+                cli_dispatch_push(&msgs[i]);
+                continue;
+            }
+
+            /* Each request of a batch goes to the worker of its device */
+            nacks = msgs[i].nacks;
+            msgs[i].cmd = MSG_CMD_ACK;
+            msgs[i].nacks = 0;
+            for (j = 0; j < nacks; j++) {
+                msgs[i].rid = msgs[i].acks[j].rid;
+                msgs[i].res = msgs[i].acks[j].res;
+                cli_dispatch_push(&msgs[i]);
+            }
+        }
+    }
+
+    msg_poller_fini(&poller);
+    Dprintf("\t Dispatcher thread terminated");
+    pthread_exit(NULL);
+}
+
 /*
  * Woker threads process incoming messages and pending tasks. Processing incoming
  * messages has higher priority becuase each message may spawn new tasks. If there
@@ -1674,8 +2286,12 @@ void *check_pending(void *data) {
  */
 void *worker(void *data) {
     struct worker_struct *desc = (struct worker_struct *)data;
-    int ret;
-    struct mcl_msg_struct msg;
+    struct mcl_msg_struct msgs[MCL_MSG_BATCH], *msg;
+    int batch = msg_batch_size();
+    msg_poller_t poller = {.epfd = -1};
+    uint64_t idle = 0;
+    uint32_t j;
+    int i, n, ret;
 
     Dprintf("\t Starting worker thread %" PRIu64 " (ntasks=%lu)",
             desc->id, desc->ntasks);
@@ -1701,43 +2317,95 @@ void *worker(void *data) {
     desc->n_transfers = 0;
     desc->bytes_transfered = 0;
 #endif
+    /* With the rings, datagrams on the socket are only doorbells */
+    if (!mcl_desc.dispatch && msg_poller_init(&poller, mcl_desc.sock_fd, mcl_desc.ring != NULL)) {
+        eprintf("Worker %" PRIu64 ": Error setting up poller.", desc->id);
+        pthread_barrier_wait(&mcl_desc.wt_barrier);
+        pthread_exit(NULL);
+    }
+
     pthread_barrier_wait(&mcl_desc.wt_barrier);
 
     while (__atomic_load_n(&(status), __ATOMIC_RELAXED) != MCL_DONE) {
-        sched_yield();
-        ret = cli_msg_recv(&msg);
+        if (mcl_desc.dispatch)
+            n = cli_inbox_recv(desc->id, msgs, batch);
+        else
+            n = cli_msg_recv_batch(msgs, batch);
 
-        if (ret == -1) {
+        if (n == -1) {
             eprintf("Worker %" PRIu64 ": Error receiving message.",
                     desc->id);
+            msg_poller_fini(&poller);
             pthread_exit(NULL);
         }
 
-        if (ret == 0) {
+        if (n == 0 && mcl_desc.dispatch) {
+            if (msg_poll_idle(&idle)) {
+                msg_event_park(&inbox_evs[desc->id]);
+                if (ring_empty(inboxes[desc->id], &inbox_geom) &&
+                    __atomic_load_n(&(status), __ATOMIC_SEQ_CST) != MCL_DONE)
+                    msg_event_wait(&inbox_evs[desc->id]);
+                else
+                    msg_event_unpark(&inbox_evs[desc->id]);
+            }
+            continue;
+        }
+
+        if (n == 0) {
+            if (msg_poll_idle(&idle)) {
+                if (mcl_desc.ring)
+                    msg_ring_park(mcl_desc.ring);
+                if ((!mcl_desc.ring || !msg_ring_pending(mcl_desc.ring)) &&
+                    __atomic_load_n(&(status), __ATOMIC_SEQ_CST) != MCL_DONE)
+                    msg_poller_wait(&poller);
+                if (mcl_desc.ring)
+                    msg_ring_unpark(mcl_desc.ring);
+            }
+            continue;
+        }
+        idle = 0;
+
+        for (i = 0; i < n; i++) {
+            msg = &msgs[i];
             Dprintf("\t Worker %" PRIu64 " received message 0x%" PRIx64
                     " for request %" PRIu64,
-                    desc->id, msg.cmd,
-                    msg.rid);
+                    desc->id, msg->cmd,
+                    msg->rid);
 #ifdef _STATS
             desc->nreqs++;
             stats_inc(mcl_desc.nreqs);
 #endif
-            switch (msg.cmd) {
+            switch (msg->cmd) {
             case MSG_CMD_FREE:
-                ret = cli_evict_am(desc, &msg);
+                ret = cli_evict_am(desc, msg);
                 break;
             case MSG_CMD_ACK:
-                ret = cli_exec_am(desc, &msg);
+                ret = cli_exec_am(desc, msg);
+                if (ret)
+                    eprintf("Error executing AM %" PRIu64 " (%d).", msg->cmd, ret);
+                break;
+            case MSG_CMD_ACKS:
+                for (j = 0; j < msg->nacks; j++) {
+                    msg->rid = msg->acks[j].rid;
+                    msg->res = msg->acks[j].res;
+                    ret = cli_exec_am(desc, msg);
+                    if (ret)
+                        eprintf("Error executing AM %" PRIu64 " for request %" PRIu64 " (%d).",
+                                msg->cmd, msg->rid, ret);
+                }
+                break;
+            case MSG_CMD_BUSY:
+                ret = cli_busy_am(desc, msg);
                 if (ret)
-                    eprintf("Error executing AM %" PRIu64 " (%d).", msg.cmd, ret);
+                    eprintf("Error executing AM %" PRIu64 " (%d).", msg->cmd, ret);
                 break;
             default:
                 break;
             }
-            msg_free(&msg);
         }
     }
 
+    msg_poller_fini(&poller);
     Dprintf("\t Worker thread %" PRIu64 " terminated", desc->id);
 #ifdef _STATS
     stprintf("W[%" PRIu64 "] NREQS: %" PRIu64 " Pending Tasks: %lu, Max Tasks: %lu",
@@ -82,6 +82,15 @@ extern "C"
  */
 #define MCL_FLAG_NO_RES 0x100
 
+/**
+ * @brief Range of task priorities
+ *
+ * Tasks with a higher priority are scheduled before the ones with a lower priority when the scheduler
+ * runs the 'prio' class. Other classes ignore priorities. Tasks start at MCL_TASK_PRIO_MIN.
+ */
+#define MCL_TASK_PRIO_MIN 0
+#define MCL_TASK_PRIO_MAX 7
+
 
 #define MCL_PRG_NONE 0x01
 #define MCL_PRG_SRC 0x02
@@ -376,6 +385,28 @@ extern "C"
      */
     int mcl_task_set_kernel(mcl_handle *hdl, char *kname, uint64_t nargs);
 
+    /**
+     * @brief Set the scheduling priority of a task
+     * @ingroup General
+     *
+     * @param hdl Handle associated with task
+     * @param prio Priority between MCL_TASK_PRIO_MIN and MCL_TASK_PRIO_MAX, higher is scheduled first
+     * @return int 0 on success
+     */
+    int mcl_task_set_priority(mcl_handle *hdl, uint32_t prio);
+
+    /**
+     * @brief Set the deadline of a task
+     * @ingroup General
+     *
+     * The 'edf' scheduler class places tasks with the earliest deadline first. Other classes ignore deadlines.
+     *
+     * @param hdl Handle associated with task
+     * @param usecs Time from now, in microseconds, within which the task should complete. 0 removes the deadline
+     * @return int 0 on success
+     */
+    int mcl_task_set_deadline(mcl_handle *hdl, uint64_t usecs);
+
     /**
      * @brief Set up an argument associated with a task
      * @ingroup Args
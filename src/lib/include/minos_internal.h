@@ -14,6 +14,7 @@
 #include <pthread.h>
 
 #include <debug.h>
+#include <ring.h>
 #include <uthash.h>
 
 #include "mem_list.h"
@@ -34,14 +35,41 @@
 #define MCL_SHM_NAME "mcl_shm"
 #define MCL_SHM_SIZE 1UL << 22
 #define MCL_SOCK_NAME "/tmp/mcl_sched_sock"
+#define MCL_CALIB_FILE "mcl_calib" /* in $XDG_CACHE_HOME or ~/.cache */
 #define MCL_SOCK_CNAME "/tmp/mcl_client.%ld"
 #define MCL_SND_BUF (1 << 22UL)
 #define MCL_RCV_BUF MCL_SND_BUF
-#define MCL_MSG_SIZE (9 * sizeof(uint64_t)) + ((MCL_MAX_DEPENDENCIES + 1) * sizeof(uint32_t))
+/* Worst case encoded sizes: header, field mask, scalars, pesdata, counts */
+#define MCL_MSG_SIZE (MSG_HDR_SIZE + (16 + 2 * MCL_DEV_DIMS) * MSG_VARINT_MAX)
 #define MCL_RES_ARGS_MAX 16
-#define MCL_MAX_MSG_SIZE (MCL_MSG_SIZE + (MCL_RES_ARGS_MAX * sizeof(uint64_t)))
+/* (rid, device) pairs in a MSG_CMD_ACKS message */
+#define MCL_ACKS_MAX 16
+#define MCL_MAX_MSG_SIZE (MCL_MSG_SIZE + (MCL_MAX_DEPENDENCIES + 6 * MCL_RES_ARGS_MAX + 2 * MCL_ACKS_MAX) * MSG_VARINT_MAX)
 #define MCL_MSG_MAX (MCL_RCV_BUF / MCL_MAX_MSG_SIZE)
+/* Fewest outstanding requests the scheduler grants to a client */
+#define MCL_CREDITS_MIN 16
+/* Fair-share weight of a client that does not set MCL_SCHED_WEIGHT */
+#define MCL_WEIGHT_DFT 100
+/*
+ * Largest fair-share weight the scheduler accepts; larger weights are clamped.
+ * Keeps used * MCL_WEIGHT_DFT / weight from rounding every client's virtual
+ * time charge down to zero.
+ */
+#define MCL_WEIGHT_MAX (100 * MCL_WEIGHT_DFT)
+/* Outstanding requests a client may have when MCL_SCHED_MAX_REQS is not set */
+#define MCL_CLIENT_MAX_REQS 4096
+/* Time a client waits before sending again requests refused by the scheduler */
+#define MCL_RETRY_NS 1000000
+#define MCL_MSG_BATCH 32
 #define MCL_NUM_DEV_TYPES 4
+#define MCL_RING_NAME "/mcl_ring.%ld"
+#define MCL_RING_SLOTS 1024
+#define MCL_DISPATCH_SLOTS 256
+#define MCL_POLL_SPIN 0
+#define MCL_POLL_BLOCK 1
+#define MCL_POLL_BUDGET 1024
+#define MCL_MSG_IO_SOCKET 0
+#define MCL_MSG_IO_URING 1
 
 #define MSG_CMD_NEX 0x00
 #define MSG_CMD_REG 0x01
@@ -53,55 +81,46 @@
 #define MSG_CMD_DONE 0x07
 #define MSG_CMD_FREE 0x08
 #define MSG_CMD_TRAN 0x09
-
-#define MSG_CMD_SIZE 0x04
-#define MSG_TYPE_SIZE 0x10
-#define MSG_RES1_SIZE 0x0c
-#define MSG_RID_SIZE 0x20
-#define MSG_PES_SIZE 0x20
-#define MSG_MEM_SIZE 0x1a
-#define MSG_FLAGS_SIZE 0x06
-#define MSG_NRES_SIZE 0x06
-#define MSG_TASKID_SIZE 0x20
-#define MSG_MEMID_SIZE 0x20
-#define MSG_PID_SIZE 0x1c
-#define MSG_MEMFLAG_SIZE 0x04
-#define MSG_OVERALL_SIZE 0x20
-#define MSG_MEMSIZE_SIZE 0x10
-#define MSG_OFFSET_SIZE 0x10
-
-#define MSG_CMD_MASK 0xf000000000000000
-#define MSG_TYPE_MASK 0x0ffff00000000000
-#define MSG_FLAGS_MASK 0x0000003f00000000
-#define MSG_RID_MASK 0x00000000ffffffff
-#define MSG_PES_MASK 0xffffffff00000000
-#define MSG_MEM_MASK 0x00000000ffffffc0
-#define MSG_NRES_MASK 0x000000000000003f
-#define MSG_TASKID_MASK 0x00000000ffffffff
-#define MSG_MEMID_MASK 0xffffffff00000000
-#define MSG_PID_MASK 0x00000000fffffff0
-#define MSG_MEMFLAG_MASK 0x000000000000000f
-#define MSG_OVERALL_MASK 0xffffffff00000000
-#define MSG_MEMSIZE_MASK 0x00000000ffff0000
-#define MSG_OFFSET_MASK 0x000000000000ffff
-
-#define MSG_CMD_SHIFT 0x3c
-#define MSG_TYPE_SHIFT 0x2c
-#define MSG_FLAGS_SHIFT 0x20
-#define MSG_RID_SHIFT 0x00
-#define MSG_PES_SHIFT 0x20
-#define MSG_MEM_SHIFT 0x06
-#define MSG_NRES_SHIFT 0x00
-#define MSG_TASKID_SHIFT 0x00
-#define MSG_MEMID_SHIFT 0x20
-#define MSG_PID_SHIFT 0x04
-#define MSG_MEMFLAG_SHIFT 0x00
-#define MSG_OVERALL_SHIFT 0x20
-#define MSG_MEMSIZE_SHIFT 0x10
-#define MSG_OFFSET_SHIFT 0x00
+#define MSG_CMD_DEPS 0x0a
+#define MSG_CMD_ACKS 0x0b
+#define MSG_CMD_BUSY 0x0c
+
+#define MSG_WIRE_VERSION 0x01
+#define MSG_HDR_SIZE 4
+#define MSG_VARINT_MAX 10
+
+#define MSG_FIELD_TYPE 0x0001
+#define MSG_FIELD_FLAGS 0x0002
+#define MSG_FIELD_RID 0x0004
+#define MSG_FIELD_PES 0x0008
+#define MSG_FIELD_MEM 0x0010
+#define MSG_FIELD_TASKID 0x0020
+#define MSG_FIELD_PESDATA 0x0040
+#define MSG_FIELD_DEPS 0x0080
+#define MSG_FIELD_RES 0x0100
+#define MSG_FIELD_CREDITS 0x0200
+#define MSG_FIELD_DEADLINE 0x0400
+#define MSG_FIELD_WEIGHT 0x0800
+#define MSG_FIELD_RUNTIME 0x1000
+#define MSG_FIELD_ACKS 0x2000
+#define MSG_FIELD_LIMITS 0x4000
+#define MSG_FIELD_ALL 0x7fff
 
 #define MSG_ARGFLAG_EXCLUSIVE 0x01
 #define MSG_ARGFLAG_SHARED 0x02
+/* Sizes and offsets of the argument are in bytes instead of MCL_MEM_PAGE_SIZE units */
+#define MSG_ARGFLAG_WIDE 0x04
+
+#define MSG_REGFLAG_RING 0x01
+#define MSG_REGFLAG_WIDE 0x02
+
+/* EXE/DEPS: more dependencies follow in a MSG_CMD_DEPS message */
+#define MSG_FLAG_MORE 0x10
+/* DEPS: the remaining dependencies could not be sent, the client fails the request */
+#define MSG_FLAG_ABORT 0x100
+/* EXE: task priority, MCL_TASK_PRIO_MIN to MCL_TASK_PRIO_MAX */
+#define MSG_FLAG_PRIO_MASK 0xe0
+#define MSG_FLAG_PRIO_SHIFT 5
 
 #define CLI_NONE 0x0
 #define CLI_ACTIVE 0x1
@@ -117,7 +136,10 @@
 #define MCL_DEV_MUL_FPGA 1
 #define MCL_DEV_MUL_DF 1
 
-// These should be adjusted based on specific device but I am not sure how to get that now
+/*
+ * Defaults for max_kernels and pes_mul, used when the scheduler does not
+ * calibrate devices (MCL_CALIBRATE=0) or the calibration of a device fails.
+ */
 #define MCL_DEV_MKERNELS_GPU 64 // CUDA compute capability 6.0 and 7.0
 #define MCL_DEV_MKERNELS_CPU 4
 #define MCL_DEV_MKERNELS_FPGA 4
@@ -166,7 +188,11 @@ typedef struct mcl_device_struct
     cl_device_type type;
     cl_long mem_size;
     uint64_t pes;
+    uint64_t pes_mul;     /* PEs in flight per PE before the device saturates */
     uint64_t max_kernels;
+    uint64_t launch_ns;   /* kernel launch overhead, 0 if unknown */
+    double bw_h2d;        /* host to device bandwidth (bytes/ns), 0 if unknown */
+    double bw_d2h;        /* device to host bandwidth (bytes/ns), 0 if unknown */
     cl_int punits;
     char name[CL_MAX_TEXT];
     double driver_version;
@@ -237,11 +263,56 @@ typedef struct mcl_sched_struct
 {
     uint64_t nclients;
     uint64_t flags;
+    uint64_t credits;
+    uint64_t max_reqs; /* per client, 0 if unlimited */
+    uint64_t max_mem;  /* per client (bytes), 0 if unlimited */
 #ifdef _STATS
     uint64_t nreqs;
 #endif
 } mcl_sched_t;
 
+/**
+ * @brief Shared memory transport between a client and the scheduler.
+ * Each side produces into tx and consumes from rx, the two rings live
+ * in the same shared memory segment. Their geometry is kept here, out of
+ * the segment.
+ */
+typedef struct mcl_ring_struct
+{
+    struct ring *tx;
+    struct ring *rx;
+    struct ring_geom tx_geom;
+    struct ring_geom rx_geom;
+    void *base;
+    size_t size;
+} mcl_ring_t;
+
+/**
+ * @brief Sleep on a socket in MCL_POLL_MODE=block (one per waiting thread)
+ */
+typedef struct msg_poller_struct
+{
+    int epfd;
+    int fd;
+    int drain;
+} msg_poller_t;
+
+/**
+ * @brief Wake up a sleeping thread when a condition it polls for changes
+ */
+typedef struct msg_event_struct
+{
+    int fd;
+    uint32_t parked;
+} msg_event_t;
+
+/* Request of a client refused by the scheduler, see sched_admit */
+typedef struct mcl_refused_struct
+{
+    uint64_t rid;
+    struct mcl_refused_struct *next;
+} mcl_refused_t;
+
 typedef struct mcl_client_struct
 {
     pid_t pid;
@@ -249,7 +320,13 @@ typedef struct mcl_client_struct
     uint64_t flags;
     uint64_t start_cpu;
     uint64_t num_threads;
+    uint64_t weight;
+    uint64_t nreqs; /* requests accepted and not completed */
+    uint64_t mem;   /* memory (bytes) of those requests */
+    struct mcl_refused_struct *refused; /* requests refused, in the order they came */
+    uint64_t refs;                      /* the client list and scheduling threads */
     struct sockaddr_un addr;
+    mcl_ring_t *ring;
     struct mcl_client_struct *prev;
     struct mcl_client_struct *next;
 } mcl_client_t;
@@ -266,13 +343,33 @@ typedef struct mcl_desc_struct
     int sock_fd;
     struct sockaddr_un caddr;
     struct sockaddr_un saddr;
+    mcl_ring_t *ring;
     uint64_t out_msg;
+    uint64_t credits;
+    uint64_t credit_waiters;
+    pthread_mutex_t credit_lock;
+    pthread_cond_t credit_cond;
+    uint64_t reg_flags;
+
+    /* Admission limits granted by the scheduler (0 if unlimited) and usage */
+    uint64_t admit_max_reqs;
+    uint64_t admit_max_mem; /* pages */
+    uint64_t admit_reqs;
+    uint64_t admit_mem;
+    uint64_t admit_waiters;
+    pthread_mutex_t admit_lock;
+    pthread_cond_t admit_cond;
+    /* Requests refused by the scheduler, in rid order */
+    struct mcl_request_struct *retry;
+    uint64_t nretry;
 
     mcl_info_t *info;
     mcl_device_t *devs;
 
     struct worker_struct *wids;
     pthread_t wcleanup;
+    pthread_t wdispatch;
+    int dispatch;
     pthread_barrier_t wt_barrier;
     unsigned long num_reqs;
 
@@ -303,6 +400,12 @@ typedef struct msg_pes_struct
     uint64_t lpes[MCL_DEV_DIMS];
 } msg_pes_t;
 
+typedef struct msg_ack_struct
+{
+    uint64_t rid;
+    uint64_t res;
+} msg_ack_t;
+
 /**
  * @brief Structure of message between client and scheduler
  * pid doesn't get sent but this struct store the src pid
@@ -327,7 +430,21 @@ typedef struct mcl_msg_struct
     uint32_t taskid;
     msg_pes_t pesdata;
     uint64_t nres;
-    msg_arg_t *resdata;
+    msg_arg_t resdata[MCL_RES_ARGS_MAX];
+    /** Scheduler to client: number of requests the client may have outstanding **/
+    uint64_t credits;
+    /** EXE: CLOCK_MONOTONIC time (ns) by which the task should complete, 0 if none **/
+    uint64_t deadline;
+    /** REG: fair-share weight of the client, 0 for MCL_WEIGHT_DFT, at most MCL_WEIGHT_MAX **/
+    uint64_t weight;
+    /** DONE: execution time (ns) of the task on the device, 0 if unknown **/
+    uint64_t runtime;
+    /** ACKS: requests of the client scheduled in the same round **/
+    uint32_t nacks;
+    msg_ack_t acks[MCL_ACKS_MAX];
+    /** REG ACK: requests and memory (pages) the client may have outstanding, 0 if unlimited **/
+    uint64_t max_reqs;
+    uint64_t max_mem;
 } mcl_msg;
 
 typedef struct mcl_pobj_struct{
@@ -359,6 +476,7 @@ struct kernel_program{
 
 typedef struct mcl_kernel_struct{
         char*                     name;
+        uint32_t                  id;      /* hash of the name, sent as task id */
         unsigned long             targets;
         struct kernel_program*    prg;
         pthread_rwlock_t          lock;
@@ -437,11 +555,12 @@ typedef struct mcl_task_struct
 	mcl_context  ctx;
 
     uint32_t ndependencies;
-    struct mcl_request_struct *dependencies[MCL_MAX_DEPENDENCIES];
+    struct mcl_request_struct **dependencies;
     uint64_t dependency_status;
-    uint32_t ndependents;
-    cl_event dependent_events[MCL_MAX_DEPENDENCIES];
+    uint64_t completed;
 
+    uint32_t prio;
+    uint64_t deadline;
     uint64_t tpes;
     uint64_t pes[MCL_DEV_DIMS];
     uint64_t lpes[MCL_DEV_DIMS];
@@ -461,6 +580,12 @@ typedef struct mcl_request_struct
     mcl_task *tsk;
     UT_hash_handle hh;
     struct worker_struct *worker;
+    struct timespec tstart; /* kernel enqueued on the device */
+    uint64_t flags;         /* task flags, to build the EXE message again */
+    uint64_t mem;           /* memory (pages) requested from the scheduler */
+    uint64_t credits;       /* credits taken by its EXE and DEPS messages, until the reply */
+    uint32_t aborted;       /* its dependencies could not be sent, failed already */
+    struct mcl_request_struct *retry_next;
 } mcl_request;
 
 typedef struct mcl_rlist_struct
@@ -545,6 +670,7 @@ int cli_setup(void);
 int cli_shutdown(void);
 
 void *worker(void *);
+void *dispatcher(void *);
 void *check_pending(void *);
 
 int __am_null(mcl_request *);
@@ -556,6 +682,8 @@ int __task_cleanup(mcl_task *);
 int __set_arg(mcl_handle *, uint64_t, void *, size_t, off_t, uint64_t);
 int __set_prg(char*, char*, unsigned long);
 int __set_kernel(mcl_handle*, char*, uint64_t);
+int __set_priority(mcl_handle*, uint32_t);
+int __set_deadline(mcl_handle*, uint64_t);
 void CL_CALLBACK __task_complete(cl_event e, cl_int status, void *v_request);
 
 mcl_transfer *__transfer_create(uint64_t, uint64_t, uint64_t);
@@ -565,10 +693,35 @@ int __invalidate_buffer(void *);
 cl_command_queue __get_queue(uint64_t);
 
 int msg_setup(int);
+void msg_finit(void);
 int msg_init(mcl_msg *);
 int msg_send(mcl_msg *, int, struct sockaddr_un *);
 int msg_recv(mcl_msg *, int, struct sockaddr_un *);
-void msg_free(mcl_msg *);
+int msg_send_batch(mcl_msg *, int, int, struct sockaddr_un *);
+int msg_recv_batch(mcl_msg *, int, int, struct sockaddr_un *);
+int msg_batch_size(void);
+int msg_ring_create(mcl_ring_t *, pid_t);
+int msg_ring_open(mcl_ring_t *, pid_t);
+void msg_ring_close(mcl_ring_t *);
+void msg_ring_unlink(pid_t);
+int msg_ring_send(mcl_msg *, mcl_ring_t *);
+int msg_ring_recv(mcl_msg *, mcl_ring_t *);
+void msg_ring_park(mcl_ring_t *);
+void msg_ring_unpark(mcl_ring_t *);
+int msg_ring_pending(mcl_ring_t *);
+int msg_ring_doorbell(mcl_ring_t *, int, struct sockaddr_un *);
+
+int msg_poll_idle(uint64_t *);
+void msg_poll_wakeup(void);
+int msg_poller_init(msg_poller_t *, int, int);
+void msg_poller_fini(msg_poller_t *);
+int msg_poller_wait(msg_poller_t *);
+int msg_event_init(msg_event_t *);
+void msg_event_fini(msg_event_t *);
+void msg_event_park(msg_event_t *);
+void msg_event_unpark(msg_event_t *);
+void msg_event_wait(msg_event_t *);
+void msg_event_notify(msg_event_t *);
 
 int req_init(void);
 int req_add(mcl_request **, uint32_t, mcl_request *);
@@ -586,7 +739,7 @@ int rlist_count(mcl_rlist **, pthread_rwlock_t *);
 mcl_rlist *rlist_pop(mcl_rlist **, pthread_rwlock_t *);
 int rlist_append(mcl_rlist **, pthread_rwlock_t *, mcl_rlist *);
 
-int cli_remove(struct mcl_client_struct **, pid_t);
+struct mcl_client_struct *cli_remove(struct mcl_client_struct **, pid_t);
 int cli_add(struct mcl_client_struct **, struct mcl_client_struct *);
 struct mcl_client_struct *cli_search(struct mcl_client_struct **, pid_t);
 pid_t cli_get_pid(const char *);
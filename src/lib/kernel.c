@@ -10,6 +10,7 @@
 
 extern mcl_desc_t mcl_desc;
 extern mcl_resource_t* mcl_res;
+extern uint32_t hashlittle(const void* key, size_t length, uint32_t initval);
 mcl_kernel* kerMap = NULL;
 pthread_rwlock_t kerMap_lock;
 
@@ -110,6 +111,7 @@ mcl_kernel* kerMap_add(char* name)
                 goto kernel;
         }
         strcpy(k->name, name);
+        k->id      = hashlittle(k->name, strlen(k->name), 0);
         k->targets = 0x0;
         k->prg     = NULL;
         pthread_rwlock_init(&(k->lock), NULL);
@@ -18,10 +18,32 @@ typedef struct lru_list_node {
 pthread_mutex_t lru_lock;
 lru_data_t *lru_list;
 lru_data_t **dev_lru_list;
+uint64_t *dev_lru_free; /* bytes on the lists not in use, per device */
+
+/* lru_lock must be held */
+static inline int lru_listed(lru_data_t *el) {
+    return el->next || el->prev;
+}
+
+/* lru_lock must be held */
+static inline void lru_unlink(lru_data_t *el) {
+    enode_t *e = el->parent;
+
+    if (!e->refs)
+        dev_lru_free[e->dev] -= e->mem_data->size;
+    DL_DELETE(lru_list, el);
+    DL_DELETE2((dev_lru_list[e->dev]), el, dev_prev, dev_next);
+
+    el->next = NULL;
+    el->prev = NULL;
+    el->dev_next = NULL;
+    el->dev_prev = NULL;
+}
 
 void lru_init(mcl_resource_t *res, int ndev) {
     dev_lru_list = malloc(sizeof(lru_data_t *) * ndev);
     memset(dev_lru_list, 0, sizeof(lru_data_t *) * ndev);
+    dev_lru_free = calloc(ndev, sizeof(uint64_t));
     lru_list = NULL;
     pthread_mutex_init(&lru_lock, NULL);
     return;
@@ -52,13 +74,7 @@ enode_t *lru_evict(void) {
     enode_t *ret = el->parent;
 
     Dprintf("Trying to delete memid %" PRIu64 " from dev %d lru list", ret->mem_data->mem_id, ret->dev);
-    DL_DELETE2((dev_lru_list[ret->dev]), el, dev_prev, dev_next);
-    DL_DELETE(lru_list, el);
-
-    el->next = NULL;
-    el->prev = NULL;
-    el->dev_next = NULL;
-    el->dev_prev = NULL;
+    lru_unlink(el);
 
     pthread_mutex_unlock(&lru_lock);
     return ret;
@@ -82,13 +98,7 @@ enode_t *lru_evict_from_dev(int dev) {
 
     enode_t *ret = el->parent;
 
-    DL_DELETE(lru_list, el);
-    DL_DELETE2((dev_lru_list[dev]), el, dev_prev, dev_next);
-
-    el->next = NULL;
-    el->prev = NULL;
-    el->dev_next = NULL;
-    el->dev_prev = NULL;
+    lru_unlink(el);
 
     pthread_mutex_unlock(&lru_lock);
     return ret;
@@ -98,10 +108,8 @@ int lru_used(enode_t *e) {
     pthread_mutex_lock(&lru_lock);
     lru_data_t *el = (lru_data_t *)e->pol_data;
 
-    if (el->next || el->prev) {
-        DL_DELETE(lru_list, el);
-        DL_DELETE2((dev_lru_list[e->dev]), el, dev_prev, dev_next);
-    }
+    if (lru_listed(el))
+        lru_unlink(el);
 
     DL_APPEND(lru_list, el);
     DL_APPEND2((dev_lru_list[e->dev]), el, dev_prev, dev_next);
@@ -113,21 +121,26 @@ int lru_used(enode_t *e) {
 }
 
 int lru_released(enode_t *e) {
-    adec(&(e->refs));
+    pthread_mutex_lock(&lru_lock);
+    if (adec(&(e->refs)) == 1 && lru_listed((lru_data_t *)e->pol_data))
+        dev_lru_free[e->dev] += e->mem_data->size;
+    pthread_mutex_unlock(&lru_lock);
     return 0;
 }
 
 int lru_removed(enode_t *e) {
     pthread_mutex_lock(&lru_lock);
     lru_data_t *el = (lru_data_t *)e->pol_data;
-    if (el->next || el->prev) {
-        DL_DELETE(lru_list, el);
-        DL_DELETE2((dev_lru_list[e->dev]), el, dev_prev, dev_next);
-    }
+    if (lru_listed(el))
+        lru_unlink(el);
     pthread_mutex_unlock(&lru_lock);
     return 0;
 }
 
+uint64_t lru_evictable(int dev) {
+    return ld_acq(&dev_lru_free[dev]);
+}
+
 void lru_destroy(void) {
 }
 
@@ -139,4 +152,5 @@ const struct sched_eviction_policy lru_eviction_policy = {
     .removed = lru_removed,
     .destroy = lru_destroy,
     .evict = lru_evict,
-    .evict_from_dev = lru_evict_from_dev};
\ No newline at end of file
+    .evict_from_dev = lru_evict_from_dev,
+    .evictable = lru_evictable};
\ No newline at end of file
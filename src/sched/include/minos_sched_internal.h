@@ -105,6 +105,10 @@ struct sched_request
     uint64_t dev;
     uint64_t num_attempts;
     uint32_t task_id;
+    uint32_t prio;
+    uint64_t deadline;
+    uint64_t est; /* estimated execution time on dev, set by the resource policy */
+    int picking;  /* a scheduling thread is running find_resource() on it */
 
     uint64_t dpes[MCL_DEV_DIMS];
     uint64_t lpes[MCL_DEV_DIMS];
@@ -139,6 +143,7 @@ struct sched_eviction_policy
     int (*removed)(enode_t *);
     enode_t *(*evict)(void);
     enode_t *(*evict_from_dev)(int);
+    uint64_t (*evictable)(int); /* bytes of data not in use on a device */
     void (*destroy)(void);
 };
 
@@ -155,20 +160,49 @@ struct sched_class
     struct sched_request *(*pick_next)(void);
     int (*queue_len)(void);
     int (*complete)(struct sched_request *);
+    int (*stats)(void);                         /* optional */
+    int (*attach)(pid_t pid, uint64_t weight); /* optional, client registered */
+    int (*detach)(pid_t pid);                  /* optional, client ended */
+    int (*depend)(struct sched_request *r,
+                  struct sched_request *dep);  /* optional, r waits for dep */
 };
 
 extern struct sched_class fifo_class;
 extern struct sched_class fffs_class;
+extern struct sched_class prio_class;
+extern struct sched_class edf_class;
+extern struct sched_class fair_class;
+extern struct sched_class ws_class;
+extern struct sched_class heft_class;
 extern struct sched_class *sched_curr;
 
+/* Devices the calling scheduling thread places requests on */
+extern __thread uint64_t sched_devs;
+
+static inline int sched_owns_device(int dev)
+{
+    return (sched_devs >> dev) & 0x1;
+}
+
 int default_assign_resource(sched_req_t *r);
 int default_put_resource(sched_req_t *);
 int default_stats();
 int scheduler_evict_mem(int dev);
 
+/*
+ * Protects the device mask, device count and sub-buffers of resident data.
+ * Scheduling threads change them when they place or evict data and read them
+ * in find_resource(), devices owned by other threads included.
+ * sched_rdata_add_device(), sched_rdata_rm_device() and
+ * sched_rdata_region_on_device() expect it to be held, for writing and
+ * reading respectively; sched_rdata_on_device() does not.
+ */
+extern pthread_rwlock_t sched_rdata_mlock;
+
 int sched_rdata_init(void);
 int sched_rdata_add_device(sched_rdata *el, int dev);
 int sched_rdata_on_device(sched_rdata *el, int dev);
+uint64_t sched_rdata_region_on_device(sched_rdata *el, mcl_partition_t *region, int dev);
 int sched_rdata_rm_device(sched_rdata *el, int dev);
 int sched_rdata_rm_pid(pid_t pid, uint64_t *mem_freed, uint64_t ndevs);
 int sched_rdata_add(sched_rdata *el);
@@ -176,6 +210,15 @@ sched_rdata *sched_rdata_rm(uint64_t mem_id, pid_t pid);
 sched_rdata *sched_rdata_get(uint64_t mem_id, pid_t pid);
 int sched_rdata_free(void);
 
+int sched_model_init(void);
+void sched_model_fini(void);
+void sched_model_update(sched_req_t *r, uint64_t ns);
+/* Estimated execution time (ns) of r on dev, 0 if unknown */
+uint64_t sched_model_estimate(sched_req_t *r, int dev);
+
+/* Measure max_kernels, pes_mul and bandwidths of the devices, or read them from the cache */
+int sched_calibrate(mcl_resource_t *res, uint64_t n);
+
 static inline int sched_assign_resource(sched_req_t *r)
 {
     return sched_curr->respol->assign_resource(r);
@@ -188,9 +231,27 @@ static inline int sched_put_resource(sched_req_t *r)
 
 static inline int sched_stats()
 {
+    if (sched_curr->stats)
+        sched_curr->stats();
+
     return sched_curr->respol->stats();
 }
 
+static inline int sched_attach(pid_t pid, uint64_t weight)
+{
+    return sched_curr->attach ? sched_curr->attach(pid, weight) : 0;
+}
+
+static inline int sched_detach(pid_t pid)
+{
+    return sched_curr->detach ? sched_curr->detach(pid) : 0;
+}
+
+static inline int sched_depend(sched_req_t *r, sched_req_t *dep)
+{
+    return sched_curr->depend ? sched_curr->depend(r, dep) : 0;
+}
+
 static inline int default_complete(sched_req_t *r)
 {
     return 0;
@@ -216,16 +277,26 @@ static inline sched_req_t *sched_alloc_request(void)
     return r;
 }
 
+void sched_request_free_args(sched_req_t *r);
+
 static inline void sched_release_request(sched_req_t *r)
 {
-    free(r->resdata);
+    sched_request_free_args(r);
     sched_curr->release_request(r);
     return;
 }
 
+void sched_wakeup(void);
+/* Wait on cond for a completion, with lock held, after sending pending ACKs */
+void sched_wait(pthread_cond_t *cond, pthread_mutex_t *lock);
+int sched_find_head(sched_req_t *r, pthread_mutex_t *lock, pthread_cond_t *cond, uint64_t *gen);
+
 static inline int sched_enqueue(sched_req_t *req)
 {
-    return sched_curr->enqueue(req);
+    int ret = sched_curr->enqueue(req);
+
+    sched_wakeup();
+    return ret;
 }
 
 static inline int sched_dequeue(sched_req_t *req)
@@ -258,6 +329,11 @@ static inline enode_t *eviction_policy_evict_from_dev(int dev)
     return sched_curr->evictionpol->evict_from_dev(dev);
 }
 
+static inline uint64_t eviction_policy_evictable(int dev)
+{
+    return sched_curr->evictionpol->evictable(dev);
+}
+
 static inline int eviction_policy_used(enode_t *e)
 {
     return sched_curr->evictionpol->used(e);
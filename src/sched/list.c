@@ -15,13 +15,16 @@ static inline int cli_cmp(struct mcl_client_struct* a, struct mcl_client_struct*
 	return (a->pid > b->pid) ? -1 : 1;
 }
 
-int cli_remove(struct mcl_client_struct** head, pid_t pid)
+/*
+ * Remove the client from the list and return it, the caller frees it.
+ */
+struct mcl_client_struct* cli_remove(struct mcl_client_struct** head, pid_t pid)
 {
 	struct mcl_client_struct *el = NULL;
 
 	if(*head == NULL){
 		eprintf("Client list is empty!");
-		return -1;
+		return NULL;
 	}
 
 	DL_FOREACH(*head, el){
@@ -30,8 +33,7 @@ int cli_remove(struct mcl_client_struct** head, pid_t pid)
 			
 			adec(&mcl_sched_desc.nclients);
 			Dprintf("Client %d removed from list", pid);
-            free(el);
-			return 0;
+			return el;
 		}
 		else if(el->pid < pid)
 			goto out;
@@ -40,7 +42,7 @@ int cli_remove(struct mcl_client_struct** head, pid_t pid)
 
  out:
 	Dprintf("Client %d not found!", pid);
-	return -1;
+	return NULL;
 }
 
 int cli_add(struct mcl_client_struct** head, struct mcl_client_struct* el)
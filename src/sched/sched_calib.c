@@ -0,0 +1,431 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <minos.h>
+#include <minos_internal.h>
+#include <minos_sched_internal.h>
+
+/*
+ * Device calibration
+ *
+ * At startup the scheduler runs a small busy kernel on each CPU and GPU to
+ * measure how the device saturates, instead of relying on the compile-time
+ * MCL_DEV_MKERNELS_* and MCL_DEV_MUL_* guesses:
+ *
+ *  - launch_ns: mean time to launch and complete an empty kernel;
+ *  - max_kernels: number of concurrent single work-group kernels (one per
+ *    queue) after which doubling them no longer improves throughput;
+ *  - pes_mul: number of work items per PE in a single kernel after which
+ *    doubling them no longer improves throughput;
+ *  - bw_h2d, bw_d2h: bandwidth of a blocking transfer of CALIB_XFER_SIZE.
+ *
+ * Results are appended to a cache file keyed by device name and driver
+ * version, so warm restarts only read them back. The last entry of a device
+ * wins. The cache is MCL_CALIB_FILE in $XDG_CACHE_HOME (~/.cache if unset),
+ * or the path in the MCL_CALIB_FILE environment variable. It is only used if
+ * it is a regular file owned by the user that nobody else can write, and
+ * values read back are clamped to the ranges calibration itself can produce.
+ * MCL_CALIBRATE=0 keeps the defaults, MCL_CALIBRATE=force
+ * ignores the cache and measures again. Other device types, and devices whose
+ * calibration fails, keep the defaults set at discovery.
+ */
+
+#define CALIB_MAX_KERNELS 128     /* concurrent kernels tried, power of two */
+#define CALIB_MAX_MUL 1024        /* PE multiplier tried, power of two */
+#define CALIB_MAX_ITERS (1U << 24)
+#define CALIB_MIN_NS 200000UL     /* duration of the reference kernel */
+#define CALIB_MAX_NS 1000000000UL /* stop doubling past this */
+#define CALIB_GAIN 1.1            /* throughput gain from doubling below this is saturation */
+#define CALIB_LAUNCHES 64
+#define CALIB_XFERS 3
+#define CALIB_XFER_SIZE (64UL << 20)
+#define CALIB_MAX_BW 10000.0      /* bytes/ns, sanity limit of cached bandwidths */
+
+static const char *calib_src =
+    "__kernel void mcl_calib(__global float *out, uint iters)\n"
+    "{\n"
+    "    float a = (float)get_global_id(0), b = 1.0f;\n"
+    "    for (uint i = 0; i < iters; i++)\n"
+    "        b = mad(b, 0.999f, a);\n"
+    "    if (b == 0.0f)\n"
+    "        out[0] = a;\n"
+    "}\n";
+
+struct calib_ctx {
+    mcl_device_t *dev;
+    cl_program prg;
+    cl_kernel ker;
+    cl_mem out;
+    cl_uint iters;
+    int nqueues;
+    cl_command_queue q[CALIB_MAX_KERNELS];
+};
+
+static cl_command_queue calib_queue(mcl_device_t *dev) {
+    cl_command_queue q;
+    cl_int error;
+
+#if OPENCL2
+    if (dev->driver_version > 1.0) {
+        cl_command_queue_properties props[3] = {CL_QUEUE_PROPERTIES, 0, 0};
+        q = clCreateCommandQueueWithProperties(dev->cl_ctxt, dev->cl_dev, props, &error);
+    }
+    else {
+#endif
+#pragma GCC diagnostic ignored "-Wdeprecated-declarations"
+        q = clCreateCommandQueue(dev->cl_ctxt, dev->cl_dev, 0, &error);
+#pragma GCC diagnostic pop
+#if OPENCL2
+    }
+#endif
+
+    return error == CL_SUCCESS ? q : NULL;
+}
+
+/* Make sure at least n queues exist, returns the number available */
+static int calib_queues(struct calib_ctx *c, int n) {
+    while (c->nqueues < n) {
+        c->q[c->nqueues] = calib_queue(c->dev);
+        if (!c->q[c->nqueues])
+            break;
+        c->nqueues++;
+    }
+
+    return c->nqueues;
+}
+
+/* Run nk copies of the kernel with gsize work items each, returns ns or 0 on error */
+static uint64_t calib_run(struct calib_ctx *c, int nk, size_t gsize) {
+    struct timespec start, end;
+    int i;
+
+    if (clSetKernelArg(c->ker, 1, sizeof(cl_uint), &c->iters) != CL_SUCCESS)
+        return 0;
+
+    __get_time(&start);
+    for (i = 0; i < nk; i++)
+        if (clEnqueueNDRangeKernel(c->q[i], c->ker, 1, NULL, &gsize, NULL, 0, NULL, NULL) != CL_SUCCESS)
+            return 0;
+    for (i = 0; i < nk; i++)
+        if (clFinish(c->q[i]) != CL_SUCCESS)
+            return 0;
+    __get_time(&end);
+
+    return (__diff_time_ns(end, start)) ?: 1;
+}
+
+/* Best of CALIB_XFERS blocking transfers of size bytes, returns bytes/ns or 0 on error */
+static double calib_xfer(struct calib_ctx *c, cl_mem buf, void *host, size_t size, int write) {
+    struct timespec start, end;
+    uint64_t ns, best = 0;
+    cl_int ret;
+
+    for (int i = 0; i < CALIB_XFERS; i++) {
+        __get_time(&start);
+        if (write)
+            ret = clEnqueueWriteBuffer(c->q[0], buf, CL_TRUE, 0, size, host, 0, NULL, NULL);
+        else
+            ret = clEnqueueReadBuffer(c->q[0], buf, CL_TRUE, 0, size, host, 0, NULL, NULL);
+        __get_time(&end);
+        if (ret != CL_SUCCESS)
+            return 0.0;
+
+        ns = (__diff_time_ns(end, start)) ?: 1;
+        if (!best || ns < best)
+            best = ns;
+    }
+
+    return (double)size / best;
+}
+
+static int calib_device(mcl_device_t *dev) {
+    struct calib_ctx c;
+    cl_int ret;
+    uint64_t t, t1, launch_ns;
+    double tp, tp2;
+    size_t wg, size;
+    int k, m, max_kernels;
+
+    memset(&c, 0, sizeof(c));
+    c.dev = dev;
+
+    c.prg = clCreateProgramWithSource(dev->cl_ctxt, 1, &calib_src, NULL, &ret);
+    if (ret != CL_SUCCESS) {
+        eprintf("Error loading calibration program (ret = %d)", ret);
+        goto err;
+    }
+
+    ret = clBuildProgram(c.prg, 1, &dev->cl_dev, NULL, NULL, NULL);
+    if (ret != CL_SUCCESS) {
+        eprintf("Error compiling calibration program (ret = %d)", ret);
+        goto err_prg;
+    }
+
+    c.ker = clCreateKernel(c.prg, "mcl_calib", &ret);
+    if (ret != CL_SUCCESS) {
+        eprintf("Error creating calibration kernel (ret = %d)", ret);
+        goto err_prg;
+    }
+
+    c.out = clCreateBuffer(dev->cl_ctxt, CL_MEM_WRITE_ONLY, sizeof(float), NULL, &ret);
+    if (ret != CL_SUCCESS) {
+        eprintf("Error creating calibration buffer (ret = %d)", ret);
+        goto err_ker;
+    }
+
+    if (clSetKernelArg(c.ker, 0, sizeof(cl_mem), &c.out) != CL_SUCCESS || calib_queues(&c, 1) < 1) {
+        eprintf("Error setting up calibration kernel");
+        goto err_queues;
+    }
+
+    /* Launch overhead */
+    c.iters = 0;
+    if (!calib_run(&c, 1, 1))
+        goto err_run;
+    for (t = 0, k = 0; k < CALIB_LAUNCHES; k++) {
+        t1 = calib_run(&c, 1, 1);
+        if (!t1)
+            goto err_run;
+        t += t1;
+    }
+    launch_ns = t / CALIB_LAUNCHES;
+
+    /* Reference kernel: one work group running for at least CALIB_MIN_NS */
+    wg = dev->wgsize ? dev->wgsize : 1;
+    c.iters = 1024;
+    while ((t1 = calib_run(&c, 1, wg)) && t1 < CALIB_MIN_NS && c.iters < CALIB_MAX_ITERS)
+        c.iters *= 2;
+    if (!t1)
+        goto err_run;
+
+    /* Concurrent kernels */
+    tp = 1.0 / t1;
+    for (k = 1; k < CALIB_MAX_KERNELS; k *= 2) {
+        if (calib_queues(&c, 2 * k) < 2 * k)
+            break;
+        t = calib_run(&c, 2 * k, wg);
+        if (!t)
+            goto err_run;
+        tp2 = 2.0 * k / t;
+        Dprintf("\t%d kernels: %" PRIu64 " ns", 2 * k, t);
+        if (tp2 < tp * CALIB_GAIN || t > CALIB_MAX_NS)
+            break;
+        tp = tp2;
+    }
+    max_kernels = k;
+
+    /* Work items per PE */
+    t = calib_run(&c, 1, dev->pes);
+    if (!t)
+        goto err_run;
+    tp = (double)dev->pes / t;
+    for (m = 1; m < CALIB_MAX_MUL; m *= 2) {
+        t = calib_run(&c, 1, dev->pes * 2 * m);
+        if (!t)
+            goto err_run;
+        tp2 = (double)dev->pes * 2 * m / t;
+        Dprintf("\t%" PRIu64 " work items: %" PRIu64 " ns", dev->pes * 2 * m, t);
+        if (tp2 < tp * CALIB_GAIN || t > CALIB_MAX_NS)
+            break;
+        tp = tp2;
+    }
+    dev->launch_ns = launch_ns;
+    dev->max_kernels = max_kernels;
+    dev->pes_mul = m;
+
+    /* Bandwidth */
+    size = CALIB_XFER_SIZE < (uint64_t)dev->mem_size / 4 ? CALIB_XFER_SIZE : (uint64_t)dev->mem_size / 4;
+    void *host = malloc(size);
+    cl_mem buf = clCreateBuffer(dev->cl_ctxt, CL_MEM_READ_WRITE, size, NULL, &ret);
+    if (host && ret == CL_SUCCESS) {
+        memset(host, 0, size);
+        dev->bw_h2d = calib_xfer(&c, buf, host, size, 1);
+        dev->bw_d2h = calib_xfer(&c, buf, host, size, 0);
+    }
+    if (ret == CL_SUCCESS)
+        clReleaseMemObject(buf);
+    free(host);
+
+    for (k = 0; k < c.nqueues; k++)
+        clReleaseCommandQueue(c.q[k]);
+    clReleaseMemObject(c.out);
+    clReleaseKernel(c.ker);
+    clReleaseProgram(c.prg);
+
+    return 0;
+
+err_run:
+    eprintf("Error running calibration kernel on %s", dev->name);
+err_queues:
+    for (k = 0; k < c.nqueues; k++)
+        clReleaseCommandQueue(c.q[k]);
+    clReleaseMemObject(c.out);
+err_ker:
+    clReleaseKernel(c.ker);
+err_prg:
+    clReleaseProgram(c.prg);
+err:
+    return -1;
+}
+
+/*
+ * Open the cache without following symlinks, and refuse it unless it is a
+ * regular file owned by us that neither group nor others can write.
+ */
+static FILE *calib_open(const char *path, int append) {
+    struct stat st;
+    FILE *f;
+    int fd;
+
+    if (append)
+        fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_NOFOLLOW | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    else
+        fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno != ENOENT)
+            eprintf("Unable to open calibration cache %s", path);
+        return NULL;
+    }
+
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode) || st.st_uid != geteuid() ||
+        (st.st_mode & (S_IWGRP | S_IWOTH))) {
+        eprintf("Ignoring calibration cache %s, not a private file of this user", path);
+        close(fd);
+        return NULL;
+    }
+
+    if (!(f = fdopen(fd, append ? "a" : "r")))
+        close(fd);
+
+    return f;
+}
+
+/* Default cache path, NULL if there is no home to put it in */
+static const char *calib_path(void) {
+    static char path[PATH_MAX];
+    const char *dir;
+    int len;
+
+    if ((dir = getenv("XDG_CACHE_HOME")) != NULL && dir[0] == '/')
+        len = snprintf(path, sizeof(path), "%s/%s", dir, MCL_CALIB_FILE);
+    else if ((dir = getenv("HOME")) != NULL && dir[0] == '/') {
+        len = snprintf(path, sizeof(path), "%s/.cache", dir);
+        if (len > 0 && (size_t)len < sizeof(path))
+            mkdir(path, S_IRWXU);
+        len = snprintf(path, sizeof(path), "%s/.cache/%s", dir, MCL_CALIB_FILE);
+    }
+    else
+        return NULL;
+
+    return len > 0 && (size_t)len < sizeof(path) ? path : NULL;
+}
+
+static inline uint64_t calib_clamp(uint64_t v, uint64_t min, uint64_t max) {
+    return v < min ? min : v > max ? max : v;
+}
+
+/* Look up dev in the cache, the last matching entry wins */
+static int calib_load(FILE *f, mcl_device_t *dev, const char *driver) {
+    char line[3 * CL_MAX_TEXT];
+    char *save, *name, *drv, *vals;
+    uint64_t mk, mul, launch;
+    double h2d, d2h;
+    int found = 0;
+
+    rewind(f);
+    while (fgets(line, sizeof(line), f)) {
+        name = strtok_r(line, "\t\n", &save);
+        drv = strtok_r(NULL, "\t\n", &save);
+        vals = strtok_r(NULL, "\n", &save);
+        if (!name || !drv || !vals || strcmp(name, dev->name) || strcmp(drv, driver))
+            continue;
+
+        /* The negated comparisons also reject NaN */
+        if (sscanf(vals, "%" SCNu64 "\t%" SCNu64 "\t%" SCNu64 "\t%lf\t%lf",
+                   &mk, &mul, &launch, &h2d, &d2h) != 5 ||
+            !(h2d >= 0.0) || !(d2h >= 0.0))
+            continue;
+
+        dev->max_kernels = calib_clamp(mk, 1, CALIB_MAX_KERNELS);
+        dev->pes_mul = calib_clamp(mul, 1, CALIB_MAX_MUL);
+        dev->launch_ns = calib_clamp(launch, 0, CALIB_MAX_NS);
+        dev->bw_h2d = h2d < CALIB_MAX_BW ? h2d : CALIB_MAX_BW;
+        dev->bw_d2h = d2h < CALIB_MAX_BW ? d2h : CALIB_MAX_BW;
+        found = 1;
+    }
+
+    return found ? 0 : -1;
+}
+
+int sched_calibrate(mcl_resource_t *res, uint64_t n) {
+    const char *mode, *path;
+    char driver[CL_MAX_TEXT];
+    mcl_device_t *dev;
+    FILE *cache = NULL, *out;
+    int force;
+
+    mode = getenv("MCL_CALIBRATE");
+    if (mode && !strcmp(mode, "0")) {
+        Dprintf("Device calibration disabled, using defaults.");
+        return 0;
+    }
+    force = mode && !strcmp(mode, "force");
+
+    if ((path = getenv("MCL_CALIB_FILE")) == NULL && (path = calib_path()) == NULL)
+        Dprintf("No home directory, calibration results will not be cached.");
+
+    if (path && !force)
+        cache = calib_open(path, 0);
+
+    for (uint64_t i = 0; i < n; i++) {
+        dev = res[i].dev;
+        if (!(dev->type & (MCL_TASK_CPU | MCL_TASK_GPU)))
+            continue;
+
+        if (clGetDeviceInfo(dev->cl_dev, CL_DRIVER_VERSION, CL_MAX_TEXT, driver, NULL) != CL_SUCCESS)
+            strcpy(driver, "unknown");
+        driver[strcspn(driver, "\t\n")] = '\0';
+
+        if (cache && !calib_load(cache, dev, driver)) {
+            Dprintf("Calibration of resource %" PRIu64 " (%s) found in %s", i, dev->name, path);
+            goto print;
+        }
+
+        iprintf("Calibrating resource %" PRIu64 " (%s)...", i, dev->name);
+        if (calib_device(dev)) {
+            eprintf("Calibration of resource %" PRIu64 " failed, using defaults.", i);
+            continue;
+        }
+
+        if (!path)
+            goto print;
+
+        out = calib_open(path, 1);
+        if (out) {
+            fprintf(out, "%s\t%s\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t%f\t%f\n",
+                    dev->name, driver, dev->max_kernels, dev->pes_mul, dev->launch_ns,
+                    dev->bw_h2d, dev->bw_d2h);
+            fclose(out);
+        }
+        else
+            eprintf("Unable to save calibration to %s", path);
+
+    print:
+        iprintf("Resource %" PRIu64 " (%s): max kernels %" PRIu64 ", PE multiplier %" PRIu64
+                ", launch %" PRIu64 " ns, H2D %.2f GB/s, D2H %.2f GB/s",
+                i, dev->name, dev->max_kernels, dev->pes_mul, dev->launch_ns,
+                dev->bw_h2d, dev->bw_d2h);
+    }
+
+    if (cache)
+        fclose(cache);
+
+    return 0;
+}
@@ -0,0 +1,289 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <atomics.h>
+#include <minos.h>
+#include <minos_internal.h>
+#include <minos_sched_internal.h>
+#include <slab.h>
+
+/*
+ * EDF - Earliest Deadline First scheduler
+ *
+ * Ready requests are kept in a binary min-heap ordered by deadline, requests
+ * without a deadline come after all the others. Ties, including requests
+ * without a deadline, are broken by arrival order. The resource policy only
+ * decides where the head of the heap runs; if it does not fit anywhere the
+ * class waits for a completion, like FIFO does.
+ *
+ * Deadlines are CLOCK_MONOTONIC times, clients and scheduler share the clock
+ * since they run on the same node.
+ */
+
+#define EDF_HEAP_SIZE 1024 /* initial heap capacity, doubled when full */
+
+typedef struct edf_request_struct {
+    sched_req_t req;
+    uint64_t key; /* deadline, UINT64_MAX if none */
+    uint64_t seq;
+    int64_t pos;  /* index in the heap, -1 if not queued */
+} edf_req_t;
+
+static edf_req_t **heap;
+static uint64_t hsize;
+static uint64_t hcap;
+static uint64_t hseq;
+static pthread_mutex_t edf_plock;
+static pthread_cond_t edf_cond;
+static uint64_t edf_gen; /* bumped when the head changes or resources are released */
+static struct slab_pool edf_pool;
+
+/* Deadline statistics */
+static uint64_t edf_ndeadlines;
+static uint64_t edf_nmissed;
+static uint64_t edf_max_late;
+
+struct sched_class edf_class; /* forward declaration */
+
+static inline int edf_before(edf_req_t *a, edf_req_t *b) {
+    return a->key < b->key || (a->key == b->key && a->seq < b->seq);
+}
+
+static inline void edf_set(uint64_t i, edf_req_t *el) {
+    heap[i] = el;
+    el->pos = i;
+}
+
+static void edf_sift_up(uint64_t i) {
+    edf_req_t *el = heap[i];
+
+    while (i > 0 && edf_before(el, heap[(i - 1) / 2])) {
+        edf_set(i, heap[(i - 1) / 2]);
+        i = (i - 1) / 2;
+    }
+    edf_set(i, el);
+}
+
+static void edf_sift_down(uint64_t i) {
+    edf_req_t *el = heap[i];
+    uint64_t c;
+
+    while ((c = 2 * i + 1) < hsize) {
+        if (c + 1 < hsize && edf_before(heap[c + 1], heap[c]))
+            c++;
+        if (!edf_before(heap[c], el))
+            break;
+        edf_set(i, heap[c]);
+        i = c;
+    }
+    edf_set(i, el);
+}
+
+/* edf_plock must be held */
+static inline void edf_kick(void) {
+    edf_gen++;
+    pthread_cond_broadcast(&edf_cond);
+}
+
+/* edf_plock must be held */
+static void edf_remove(edf_req_t *el) {
+    uint64_t i = el->pos;
+
+    if (i == 0)
+        edf_kick();
+    el->pos = -1;
+    if (i == --hsize)
+        return;
+
+    edf_set(i, heap[hsize]);
+    if (i > 0 && edf_before(heap[i], heap[(i - 1) / 2]))
+        edf_sift_up(i);
+    else
+        edf_sift_down(i);
+}
+
+static inline uint64_t edf_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * BILLION + ts.tv_nsec;
+}
+
+static sched_req_t *edf_alloc_request(void) {
+    edf_req_t *e = slab_alloc(&edf_pool);
+
+    if (!e)
+        return NULL;
+
+    e->pos = -1;
+
+    return &e->req;
+}
+
+static void edf_release_request(sched_req_t *r) {
+    edf_req_t *e = container_of(r, edf_req_t, req);
+
+    slab_free(&edf_pool, e);
+}
+
+static int edf_enqueue(sched_req_t *r) {
+    edf_req_t *el = container_of(r, edf_req_t, req);
+    edf_req_t **h;
+
+    Dprintf("Adding request (%d,%" PRIu64 ") with deadline %" PRIu64 "", r->key.pid, r->key.rid, r->deadline);
+    pthread_mutex_lock(&edf_plock);
+    if (hsize == hcap) {
+        h = realloc(heap, 2 * hcap * sizeof(edf_req_t *));
+        if (!h) {
+            pthread_mutex_unlock(&edf_plock);
+            eprintf("Error growing EDF queue, dropping request (%d,%" PRIu64 ")", r->key.pid, r->key.rid);
+            return -1;
+        }
+        heap = h;
+        hcap *= 2;
+    }
+
+    el->key = r->deadline ? r->deadline : UINT64_MAX;
+    el->seq = hseq++;
+    heap[hsize] = el;
+    edf_sift_up(hsize++);
+
+    /* A new head may fit where the previous one blocked */
+    if (el->pos == 0)
+        edf_kick();
+    pthread_mutex_unlock(&edf_plock);
+
+    return 0;
+}
+
+static int edf_dequeue(sched_req_t *r) {
+    edf_req_t *el = container_of(r, edf_req_t, req);
+
+    Dprintf("Removing request (%d,%" PRIu64 ")", r->key.pid, r->key.rid);
+    pthread_mutex_lock(&edf_plock);
+    if (el->pos >= 0)
+        edf_remove(el);
+    pthread_mutex_unlock(&edf_plock);
+
+    return 0;
+}
+
+static int edf_qlength(void) {
+    return ld_acq(&hsize);
+}
+
+static sched_req_t *edf_next(void) {
+    edf_req_t *r = NULL;
+
+    pthread_mutex_lock(&edf_plock);
+    while (hsize) {
+        r = heap[0];
+
+        if (sched_find_head(&r->req, &edf_plock, &edf_cond, &edf_gen) >= 0 && r->pos == 0) {
+            edf_remove(r);
+            break;
+        }
+        r = NULL;
+    }
+    pthread_mutex_unlock(&edf_plock);
+
+    return r ? &r->req : NULL;
+}
+
+static int edf_complete(sched_req_t *r) {
+    uint64_t now, late, max;
+
+    if (r && r->deadline) {
+        ainc(&edf_ndeadlines);
+        now = edf_now();
+        if (now > r->deadline) {
+            ainc(&edf_nmissed);
+            late = now - r->deadline;
+            max = ld_acq(&edf_max_late);
+            while (late > max && !cas(&edf_max_late, max, late))
+                max = ld_acq(&edf_max_late);
+            Dprintf("Request (%d,%" PRIu64 ") missed its deadline by %" PRIu64 " ns",
+                    r->key.pid, r->key.rid, late);
+        }
+    }
+
+    pthread_mutex_lock(&edf_plock);
+    edf_kick();
+    pthread_mutex_unlock(&edf_plock);
+    return 0;
+}
+
+static int edf_stats(void) {
+    iprintf("EDF: %" PRIu64 " requests with deadline completed, %" PRIu64 " missed, max lateness %" PRIu64 " ns",
+            ld_acq(&edf_ndeadlines), ld_acq(&edf_nmissed), ld_acq(&edf_max_late));
+
+    return 0;
+}
+
+static int edf_init(void *args) {
+    Dprintf("Initializing EDF (Earliest Deadline First) scheduler");
+
+    hsize = 0;
+    hseq = 0;
+    edf_gen = 0;
+    hcap = EDF_HEAP_SIZE;
+    edf_ndeadlines = edf_nmissed = edf_max_late = 0;
+
+    heap = malloc(hcap * sizeof(edf_req_t *));
+    if (!heap) {
+        eprintf("Error allocating EDF scheduler queue");
+        goto err;
+    }
+
+    if (slab_init(&edf_pool, sizeof(edf_req_t))) {
+        eprintf("Error initializing EDF scheduler request pool");
+        goto err_heap;
+    }
+
+    if (pthread_mutex_init(&edf_plock, NULL)) {
+        eprintf("Error initializing EDF scheduler plock");
+        goto err_pool;
+    }
+
+    if (pthread_cond_init(&edf_cond, NULL)) {
+        eprintf("Error initializing EDF scheduler condition variable");
+        goto err_pool;
+    }
+
+    return 0;
+
+err_pool:
+    slab_fini(&edf_pool);
+err_heap:
+    free(heap);
+err:
+    return -1;
+}
+
+static int edf_finit(void) {
+    Dprintf("Finalizing EDF scheduler");
+    edf_stats();
+    slab_fini(&edf_pool);
+    free(heap);
+
+    return 0;
+}
+
+extern const struct sched_resource_policy ff_policy;
+extern const struct sched_eviction_policy lru_eviction_policy;
+
+struct sched_class edf_class = {
+    .respol = &ff_policy,
+    .evictionpol = &lru_eviction_policy,
+    .init = edf_init,
+    .finit = edf_finit,
+    .alloc_request = edf_alloc_request,
+    .release_request = edf_release_request,
+    .enqueue = edf_enqueue,
+    .dequeue = edf_dequeue,
+    .pick_next = edf_next,
+    .queue_len = edf_qlength,
+    .complete = edf_complete,
+    .stats = edf_stats,
+};
@@ -0,0 +1,353 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <atomics.h>
+#include <minos.h>
+#include <minos_internal.h>
+#include <minos_sched_internal.h>
+#include <slab.h>
+#include <uthash.h>
+#include <utlist.h>
+
+/*
+ * FAIR - Weighted fair-share scheduler
+ *
+ * Every client (pid) has its own FIFO queue and a virtual time: the device
+ * time consumed by its requests, measured from placement to completion,
+ * scaled by MCL_WEIGHT_DFT / weight. The next request is the head of the
+ * client with the lowest virtual time that fits on a device; clients are
+ * tried in order of virtual time, so a client whose head does not fit does
+ * not hold back the others.
+ *
+ * A client that becomes active again starts from the lowest virtual time of
+ * the active clients, so being idle does not build up credit.
+ */
+
+typedef struct fair_flow_struct fair_flow_t;
+
+typedef struct fair_request_struct {
+    sched_req_t req;
+    struct fair_request_struct *next;
+    struct fair_request_struct *prev;
+    fair_flow_t *flow; /* NULL if not queued */
+    uint64_t start;
+} fair_req_t;
+
+struct fair_flow_struct {
+    pid_t pid;
+    uint64_t weight;
+    uint64_t vtime;
+    uint64_t usage; /* device time in ns */
+    uint64_t nqueued;
+    uint64_t tried;
+    int attached;
+    fair_req_t *queue;
+    fair_flow_t *next; /* active flows, with queued requests */
+    fair_flow_t *prev;
+    UT_hash_handle hh;
+};
+
+static fair_flow_t *flows;  /* all flows, by pid */
+static fair_flow_t *active; /* flows with queued requests */
+static uint64_t fair_vclock; /* virtual time of the last client served */
+static uint64_t fair_gen;
+static int plen;
+static pthread_mutex_t fair_plock;
+static pthread_cond_t fair_cond;
+static struct slab_pool fair_pool;
+
+struct sched_class fair_class; /* forward declaration */
+
+static inline uint64_t fair_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * BILLION + ts.tv_nsec;
+}
+
+/* fair_plock must be held */
+static fair_flow_t *fair_flow_get(pid_t pid, uint64_t weight) {
+    fair_flow_t *f;
+
+    HASH_FIND_INT(flows, &pid, f);
+    if (f)
+        return f;
+
+    f = calloc(1, sizeof(fair_flow_t));
+    if (!f)
+        return NULL;
+
+    f->pid = pid;
+    f->weight = weight ? weight : MCL_WEIGHT_DFT;
+    f->attached = 1;
+    HASH_ADD_INT(flows, pid, f);
+
+    return f;
+}
+
+/* fair_plock must be held */
+static void fair_flow_put(fair_flow_t *f) {
+    if (f->attached || f->nqueued)
+        return;
+
+    HASH_DEL(flows, f);
+    free(f);
+}
+
+/* fair_plock must be held */
+static void fair_remove(fair_req_t *el) {
+    fair_flow_t *f = el->flow;
+
+    DL_DELETE(f->queue, el);
+    el->flow = NULL;
+    adec(&plen);
+
+    if (--f->nqueued == 0) {
+        DL_DELETE(active, f);
+        fair_flow_put(f);
+    }
+}
+
+static sched_req_t *fair_alloc_request(void) {
+    fair_req_t *f = slab_alloc(&fair_pool);
+
+    if (!f)
+        return NULL;
+
+    f->flow = NULL;
+    f->start = 0;
+
+    return &f->req;
+}
+
+static void fair_release_request(sched_req_t *r) {
+    fair_req_t *f = container_of(r, fair_req_t, req);
+
+    slab_free(&fair_pool, f);
+}
+
+static int fair_enqueue(sched_req_t *r) {
+    fair_req_t *el = container_of(r, fair_req_t, req);
+    fair_flow_t *f, *a;
+    uint64_t vmin;
+
+    Dprintf("Adding request (%d,%" PRIu64 ")", r->key.pid, r->key.rid);
+    pthread_mutex_lock(&fair_plock);
+    if (!(f = fair_flow_get(r->key.pid, 0))) {
+        pthread_mutex_unlock(&fair_plock);
+        eprintf("Error tracking client %d, dropping request %" PRIu64 "", r->key.pid, r->key.rid);
+        return -1;
+    }
+
+    if (f->nqueued++ == 0) {
+        vmin = fair_vclock;
+        DL_FOREACH(active, a)
+            vmin = a->vtime < vmin ? a->vtime : vmin;
+        if (f->vtime < vmin)
+            f->vtime = vmin;
+        DL_APPEND(active, f);
+        /* The new client may fit where the others blocked */
+        pthread_cond_broadcast(&fair_cond);
+    }
+
+    DL_APPEND(f->queue, el);
+    el->flow = f;
+    ainc(&plen);
+    pthread_mutex_unlock(&fair_plock);
+
+    return 0;
+}
+
+static int fair_dequeue(sched_req_t *r) {
+    fair_req_t *el = container_of(r, fair_req_t, req);
+
+    Dprintf("Removing request (%d,%" PRIu64 ")", r->key.pid, r->key.rid);
+    pthread_mutex_lock(&fair_plock);
+    if (el->flow)
+        fair_remove(el);
+    pthread_mutex_unlock(&fair_plock);
+
+    return 0;
+}
+
+static int fair_qlength(void) {
+    return ld_acq(&plen);
+}
+
+static sched_req_t *fair_next(void) {
+    fair_req_t *r = NULL;
+    fair_flow_t *f, *a;
+    int dev = MCL_SCHED_BLOCK;
+    int block;
+
+    pthread_mutex_lock(&fair_plock);
+    while (active) {
+        block = 1;
+        fair_gen++;
+
+        /* Try the heads of the active clients by increasing virtual time */
+        while (1) {
+            f = NULL;
+            DL_FOREACH(active, a)
+                if (a->tried != fair_gen && (!f || a->vtime < f->vtime))
+                    f = a;
+            if (!f)
+                break;
+
+            f->tried = fair_gen;
+            r = f->queue;
+            if ((dev = fair_class.respol->find_resource(&r->req)) >= 0)
+                break;
+            if (dev == MCL_SCHED_AGAIN)
+                block = 0;
+        }
+
+        if (f) {
+            fair_vclock = f->vtime;
+            fair_remove(r);
+            r->start = fair_now();
+            break;
+        }
+
+        r = NULL;
+        if (block)
+            sched_wait(&fair_cond, &fair_plock);
+        else {
+            pthread_mutex_unlock(&fair_plock);
+            sched_yield();
+            pthread_mutex_lock(&fair_plock);
+        }
+    }
+    pthread_mutex_unlock(&fair_plock);
+
+    return r ? &r->req : NULL;
+}
+
+static int fair_complete(sched_req_t *r) {
+    fair_req_t *el;
+    fair_flow_t *f;
+    uint64_t used;
+
+    pthread_mutex_lock(&fair_plock);
+    if (r) {
+        el = container_of(r, fair_req_t, req);
+        HASH_FIND_INT(flows, &r->key.pid, f);
+        if (f && el->start) {
+            used = fair_now() - el->start;
+            f->usage += used;
+            f->vtime += used * MCL_WEIGHT_DFT / f->weight;
+        }
+    }
+    pthread_cond_broadcast(&fair_cond);
+    pthread_mutex_unlock(&fair_plock);
+
+    return 0;
+}
+
+static int fair_attach(pid_t pid, uint64_t weight) {
+    fair_flow_t *f;
+
+    pthread_mutex_lock(&fair_plock);
+    if ((f = fair_flow_get(pid, weight))) {
+        f->weight = weight ? weight : MCL_WEIGHT_DFT;
+        f->attached = 1;
+    }
+    pthread_mutex_unlock(&fair_plock);
+
+    Dprintf("Client %d has fair-share weight %" PRIu64 "", pid, weight);
+
+    return f ? 0 : -1;
+}
+
+static int fair_detach(pid_t pid) {
+    fair_flow_t *f;
+
+    pthread_mutex_lock(&fair_plock);
+    HASH_FIND_INT(flows, &pid, f);
+    if (f) {
+        f->attached = 0;
+        fair_flow_put(f);
+    }
+    pthread_mutex_unlock(&fair_plock);
+
+    return 0;
+}
+
+static int fair_stats(void) {
+    fair_flow_t *f, *tmp;
+
+    pthread_mutex_lock(&fair_plock);
+    HASH_ITER(hh, flows, f, tmp) {
+        iprintf("FAIR: client %d weight %" PRIu64 " device time %" PRIu64 " ns, %" PRIu64 " queued",
+                f->pid, f->weight, f->usage, f->nqueued);
+    }
+    pthread_mutex_unlock(&fair_plock);
+
+    return 0;
+}
+
+static int fair_init(void *args) {
+    Dprintf("Initializing FAIR (weighted fair-share) scheduler");
+
+    flows = NULL;
+    active = NULL;
+    fair_vclock = 0;
+    fair_gen = 0;
+    plen = 0;
+
+    if (slab_init(&fair_pool, sizeof(fair_req_t))) {
+        eprintf("Error initializing FAIR scheduler request pool");
+        goto err;
+    }
+
+    if (pthread_mutex_init(&fair_plock, NULL)) {
+        eprintf("Error initializing FAIR scheduler plock");
+        goto err;
+    }
+
+    if (pthread_cond_init(&fair_cond, NULL)) {
+        eprintf("Error initializing FAIR scheduler condition variable");
+        goto err;
+    }
+
+    return 0;
+
+err:
+    return -1;
+}
+
+static int fair_finit(void) {
+    fair_flow_t *f, *tmp;
+
+    Dprintf("Finalizing FAIR scheduler");
+    fair_stats();
+    HASH_ITER(hh, flows, f, tmp) {
+        HASH_DEL(flows, f);
+        free(f);
+    }
+    active = NULL;
+    slab_fini(&fair_pool);
+
+    return 0;
+}
+
+extern const struct sched_resource_policy ff_policy;
+extern const struct sched_eviction_policy lru_eviction_policy;
+
+struct sched_class fair_class = {
+    .respol = &ff_policy,
+    .evictionpol = &lru_eviction_policy,
+    .init = fair_init,
+    .finit = fair_finit,
+    .alloc_request = fair_alloc_request,
+    .release_request = fair_release_request,
+    .enqueue = fair_enqueue,
+    .dequeue = fair_dequeue,
+    .pick_next = fair_next,
+    .queue_len = fair_qlength,
+    .complete = fair_complete,
+    .stats = fair_stats,
+    .attach = fair_attach,
+    .detach = fair_detach,
+};
@@ -5,26 +5,134 @@
 #include <minos.h>
 #include <minos_internal.h>
 #include <minos_sched_internal.h>
+#include <slab.h>
 #include <utlist.h>
 
+/*
+ * Pending requests are indexed by device type and memory demand: each bucket
+ * holds, in arrival order, the requests with the same type mask whose demand
+ * (task memory minus resident data) falls in the same power of two. Picking
+ * walks the buckets in arrival order, as if they were still a single list.
+ *
+ * When every request of a bucket has been found not to fit on the devices of
+ * a scheduling thread, the bucket is marked blocked on those devices and is
+ * skipped until one of them changes. A completion unblocks it on its device
+ * if the device is below its PE limit and the available memory, plus the
+ * resident data not in use that the resource policy may evict, covers the
+ * minimum demand of the bucket. A new request in a bucket, or memory freed
+ * by a client, unblocks it on every device.
+ */
+
+typedef struct fffs_bucket_struct fffs_bucket_t;
+
 typedef struct fffs_request_struct {
     sched_req_t req;
     struct fffs_request_struct *next;
+    struct fffs_request_struct *prev;
+    fffs_bucket_t *bucket; /* NULL if not queued */
+    uint64_t seq;
 } fffs_req_t;
 
-static fffs_req_t *plist;
+struct fffs_bucket_struct {
+    uint64_t type;
+    uint64_t mclass;  /* demand in [2^(mclass-1), 2^mclass), 0 for none */
+    uint64_t devs;    /* devices of a matching type */
+    uint64_t blocked; /* devices on which no request fits */
+    fffs_req_t *head;
+    fffs_req_t *cur;  /* next request to examine while picking */
+    int scan;         /* walked while picking, no MCL_SCHED_AGAIN so far */
+    fffs_bucket_t *next;
+};
+
+static fffs_bucket_t *buckets;
+static fffs_bucket_t **fffs_heap; /* buckets being walked, by cur->seq */
+static int fffs_nbuckets;
+static uint64_t fffs_seq;
+static int plen;
 static pthread_mutex_t fffs_plock;
 static pthread_cond_t fffs_cond;
+static struct slab_pool fffs_pool;
+
+extern mcl_info_t *mcl_info;
 
 struct sched_class fffs_class; /* forward declaration */
 
+static inline uint64_t fffs_mclass(sched_req_t *r) {
+    uint64_t demand = r->mem;
+
+    for (uint64_t i = 0; i < r->nresident; i++)
+        demand = demand > r->resdata[i]->size ? demand - r->resdata[i]->size : 0;
+
+    return demand ? 64 - __builtin_clzll(demand) : 0;
+}
+
+static inline uint64_t fffs_min_demand(fffs_bucket_t *b) {
+    return b->mclass ? (uint64_t)0x01 << (b->mclass - 1) : 0;
+}
+
+/* Move h[i] down to its place in the min-heap h of n buckets */
+static void fffs_sift(fffs_bucket_t **h, int n, int i) {
+    fffs_bucket_t *b = h[i];
+    int c;
+
+    while ((c = 2 * i + 1) < n) {
+        if (c + 1 < n && h[c + 1]->cur->seq < h[c]->cur->seq)
+            c++;
+        if (b->cur->seq <= h[c]->cur->seq)
+            break;
+        h[i] = h[c];
+        i = c;
+    }
+    h[i] = b;
+}
+
+/* fffs_plock must be held */
+static fffs_bucket_t *fffs_bucket_get(uint64_t type, uint64_t mclass) {
+    fffs_bucket_t *b;
+    uint64_t ndevs = mcl_info->ndevs < CL_MAX_DEVICES ? mcl_info->ndevs : CL_MAX_DEVICES;
+
+    LL_FOREACH(buckets, b)
+        if (b->type == type && b->mclass == mclass)
+            return b;
+
+    b = calloc(1, sizeof(fffs_bucket_t));
+    if (!b)
+        return NULL;
+
+    fffs_bucket_t **h = realloc(fffs_heap, (fffs_nbuckets + 1) * sizeof(fffs_bucket_t *));
+    if (!h) {
+        free(b);
+        return NULL;
+    }
+    fffs_heap = h;
+    fffs_nbuckets++;
+
+    b->type = type;
+    b->mclass = mclass;
+    for (uint64_t i = 0; i < ndevs; i++)
+        if (mcl_res[i].dev->type & type)
+            b->devs |= (uint64_t)0x01 << i;
+    LL_PREPEND(buckets, b);
+
+    return b;
+}
+
+/* fffs_plock must be held */
+static inline void fffs_remove(fffs_req_t *el) {
+    DL_DELETE(el->bucket->head, el);
+    el->bucket = NULL;
+    plen--;
+}
+
 static sched_req_t *fffs_alloc_request(void) {
-    fffs_req_t *f = malloc(sizeof(fffs_req_t));
+    fffs_req_t *f = slab_alloc(&fffs_pool);
 
     if (!f)
         return NULL;
 
     f->next = NULL;
+    f->prev = NULL;
+    f->bucket = NULL;
 
     return &f->req;
 }
@@ -36,14 +144,15 @@ static void fffs_release_request(sched_req_t *r) {
      */
     fffs_req_t *f = container_of(r, fffs_req_t, req);
 
-    free(f);
+    slab_free(&fffs_pool, f);
 }
 
 /*
- * Add a new element at the end of the pending task queue
+ * Add a new element at the end of its bucket
  */
 static int fffs_enqueue(sched_req_t *r) {
     fffs_req_t *el = container_of(r, fffs_req_t, req);
+    fffs_bucket_t *b;
 
     if (!el) {
         eprintf("Invalid argument!");
@@ -52,8 +161,19 @@ static int fffs_enqueue(sched_req_t *r) {
 
     Dprintf("Adding request (%d,%" PRIu64 ")", r->key.pid, r->key.rid);
     pthread_mutex_lock(&fffs_plock);
-    LL_APPEND(plist, el);
-    pthread_cond_signal(&fffs_cond);
+    if (!(b = fffs_bucket_get(r->type, fffs_mclass(r)))) {
+        pthread_mutex_unlock(&fffs_plock);
+        eprintf("Error allocating FFFS bucket, dropping request (%d,%" PRIu64 ")", r->key.pid, r->key.rid);
+        return -1;
+    }
+
+    el->seq = fffs_seq++;
+    el->bucket = b;
+    DL_APPEND(b->head, el);
+    b->blocked = 0;
+    plen++;
+    /* Any scheduling thread may own a device that fits */
+    pthread_cond_broadcast(&fffs_cond);
     pthread_mutex_unlock(&fffs_plock);
 
     return 0;
@@ -69,46 +189,69 @@ static int fffs_dequeue(sched_req_t *r) {
 
     Dprintf("Removing request (%d,%" PRIu64 ")", r->key.pid, r->key.rid);
     pthread_mutex_lock(&fffs_plock);
-    if (plist)
-        LL_DELETE(plist, el);
+    if (el->bucket)
+        fffs_remove(el);
     pthread_mutex_unlock(&fffs_plock);
 
     return 0;
 }
 
 static int fffs_qlength(void) {
-    fffs_req_t *el;
-    int n;
-
-    pthread_mutex_lock(&fffs_plock);
-    LL_COUNT(plist, el, n);
-    pthread_mutex_unlock(&fffs_plock);
-
-    return n;
+    return ld_acq(&plen);
 }
 
 static sched_req_t *fffs_next(void) {
     fffs_req_t *r = NULL;
+    fffs_bucket_t *b, *c;
     int dev = MCL_SCHED_BLOCK;
-    int block = 1;
+    int block, n;
 
     pthread_mutex_lock(&fffs_plock);
     while (dev < 0) {
-        LL_FOREACH(plist, r) {
-            dev = fffs_class.respol->find_resource(&r->req);
-            block = dev == MCL_SCHED_AGAIN ? 0 : block;
+        block = 1;
+        n = 0;
+        LL_FOREACH(buckets, b) {
+            b->scan = (sched_devs & b->devs & ~b->blocked) != 0;
+            b->cur = b->scan ? b->head : NULL;
+            if (b->cur)
+                fffs_heap[n++] = b;
+        }
+        for (int i = n / 2 - 1; i >= 0; i--)
+            fffs_sift(fffs_heap, n, i);
+
+        /* Merge the buckets by arrival order */
+        while (n) {
+            c = fffs_heap[0];
+            r = c->cur;
+            c->cur = r->next;
+            if (!c->cur)
+                fffs_heap[0] = fffs_heap[--n];
+            if (n)
+                fffs_sift(fffs_heap, n, 0);
 
+            dev = fffs_class.respol->find_resource(&r->req);
             if (dev >= 0) {
-                LL_DELETE(plist, r);
+                c->scan = 0;
+                fffs_remove(r);
                 break;
             }
+            if (dev == MCL_SCHED_AGAIN) {
+                c->scan = 0;
+                block = 0;
+            }
         }
+
+        /* Nothing in a bucket walked to the end fits on our devices */
+        LL_FOREACH(buckets, b)
+            if (b->scan && !b->cur)
+                b->blocked |= sched_devs;
+
         if (dev >= 0) {
             break;
         }
 
         if (block) {
-            pthread_cond_wait(&fffs_cond, &fffs_plock);
+            sched_wait(&fffs_cond, &fffs_plock);
         }
     }
     pthread_mutex_unlock(&fffs_plock);
@@ -117,14 +260,45 @@ static sched_req_t *fffs_next(void) {
 }
 
 static int fffs_complete(sched_req_t *r) {
+    fffs_bucket_t *b;
+    mcl_resource_t *res;
+    uint64_t avail;
+    int fits;
+
+    pthread_mutex_lock(&fffs_plock);
+    if (r) {
+        res = mcl_res + r->dev;
+        avail = ld_acq(&res->mem_avail) + eviction_policy_evictable(r->dev);
+        fits = (res->dev->type & MCL_TASK_FPGA) || !ld_acq(&res->nkernels) ||
+               ld_acq(&res->pes_used) <= res->dev->pes * res->dev->pes_mul;
+        LL_FOREACH(buckets, b)
+            if (((b->devs >> r->dev) & 0x01) && fits &&
+                ((res->dev->type & MCL_TASK_FPGA) || fffs_min_demand(b) <= avail))
+                b->blocked &= ~((uint64_t)0x01 << r->dev);
+    }
+    else {
+        LL_FOREACH(buckets, b)
+            b->blocked = 0;
+    }
     pthread_cond_broadcast(&fffs_cond);
+    pthread_mutex_unlock(&fffs_plock);
+
     return 0;
 }
 
 static int fffs_init(void *args) {
     Dprintf("Initializing FFFS (First-Feseable First-Served) scheduler");
 
-    plist = NULL;
+    buckets = NULL;
+    fffs_heap = NULL;
+    fffs_nbuckets = 0;
+    fffs_seq = 0;
+    plen = 0;
+
+    if (slab_init(&fffs_pool, sizeof(fffs_req_t))) {
+        eprintf("Error initializing FFFS scheduler request pool");
+        goto err;
+    }
 
     if (pthread_mutex_init(&fffs_plock, NULL)) {
         eprintf("Error initializing FFFS scheduler plock");
@@ -142,7 +316,15 @@ err:
 }
 
 static int fffs_finit(void) {
+    fffs_bucket_t *b, *tmp;
+
     Dprintf("Finalizing FFFS scheduler");
+    LL_FOREACH_SAFE(buckets, b, tmp) {
+        LL_DELETE(buckets, b);
+        free(b);
+    }
+    free(fffs_heap);
+    slab_fini(&fffs_pool);
 
     return 0;
 }
@@ -5,6 +5,7 @@
 #include <minos.h>
 #include <minos_internal.h>
 #include <minos_sched_internal.h>
+#include <slab.h>
 #include <utlist.h>
 
 typedef struct fifo_request_struct {
@@ -15,11 +16,13 @@ typedef struct fifo_request_struct {
 static fifo_req_t *plist;
 static pthread_mutex_t fifo_plock;
 static pthread_cond_t fifo_cond;
+static uint64_t fifo_gen; /* bumped when the head changes or resources are released */
+static struct slab_pool fifo_pool;
 
 struct sched_class fifo_class; /* forward declaration */
 
 static sched_req_t *fifo_alloc_request(void) {
-    fifo_req_t *f = malloc(sizeof(fifo_req_t));
+    fifo_req_t *f = slab_alloc(&fifo_pool);
 
     if (!f)
         return NULL;
@@ -36,7 +39,13 @@ static void fifo_release_request(sched_req_t *r) {
      */
     fifo_req_t *f = container_of(r, fifo_req_t, req);
 
-    free(f);
+    slab_free(&fifo_pool, f);
+}
+
+/* fifo_plock must be held */
+static inline void fifo_kick(void) {
+    fifo_gen++;
+    pthread_cond_broadcast(&fifo_cond);
 }
 
 /*
@@ -68,8 +77,11 @@ static int fifo_dequeue(sched_req_t *r) {
 
     Dprintf("Removing request (%d,%" PRIu64 ")", r->key.pid, r->key.rid);
     pthread_mutex_lock(&fifo_plock);
-    if (plist)
+    if (plist) {
+        if (plist == el)
+            fifo_kick();
         LL_DELETE(plist, el);
+    }
     pthread_mutex_unlock(&fifo_plock);
 
     return 0;
@@ -88,31 +100,29 @@ static int fifo_qlength(void) {
 
 static sched_req_t *fifo_next(void) {
     fifo_req_t *r;
-    int dev = -1;
-
-    /* fetch list head */
-    pthread_mutex_lock(&fifo_plock);
-    r = plist;
-    pthread_mutex_unlock(&fifo_plock);
-
-    if (!r)
-        return NULL;
 
+    /*
+     * Fetch the list head again after looking at it, another scheduling
+     * thread may have placed it on one of its devices in the meantime.
+     */
     pthread_mutex_lock(&fifo_plock);
-    while ((dev = fifo_class.respol->find_resource(&r->req)) < 0) {
-        if (dev == MCL_SCHED_BLOCK)
-            pthread_cond_wait(&fifo_cond, &fifo_plock);
-        else
-            sched_yield();
+    while ((r = plist)) {
+        if (sched_find_head(&r->req, &fifo_plock, &fifo_cond, &fifo_gen) >= 0 && r == plist) {
+            LL_DELETE(plist, r);
+            /* The new head may fit on the devices of another thread */
+            fifo_kick();
+            break;
+        }
     }
-    LL_DELETE(plist, r);
     pthread_mutex_unlock(&fifo_plock);
 
-    return &r->req;
+    return r ? &r->req : NULL;
 }
 
 static int fifo_complete(sched_req_t *r) {
-    pthread_cond_broadcast(&fifo_cond);
+    pthread_mutex_lock(&fifo_plock);
+    fifo_kick();
+    pthread_mutex_unlock(&fifo_plock);
     return 0;
 }
 
@@ -120,6 +130,12 @@ static int fifo_init(void *args) {
     Dprintf("Initializing FIFO scheduler");
 
     plist = NULL;
+    fifo_gen = 0;
+
+    if (slab_init(&fifo_pool, sizeof(fifo_req_t))) {
+        eprintf("Error initializing FIFO scheduler request pool");
+        goto err;
+    }
 
     if (pthread_mutex_init(&fifo_plock, NULL)) {
         eprintf("Error initializing FIFO scheduler plock");
@@ -139,6 +155,7 @@ err:
 
 static int fifo_finit(void) {
     Dprintf("Finalizing FIFO scheduler");
+    slab_fini(&fifo_pool);
 
     return 0;
 }
@@ -0,0 +1,383 @@
+#include <pthread.h>
+#include <stdio.h>
+
+#include <atomics.h>
+#include <minos.h>
+#include <minos_internal.h>
+#include <minos_sched_internal.h>
+#include <slab.h>
+#include <utlist.h>
+
+/*
+ * HEFT - Critical path first scheduler
+ *
+ * Every request has an upward rank: its own cost plus the highest rank of
+ * the requests waiting for it, i.e. the length of the longest path from it
+ * to the end of the task graph known so far. Ready requests are kept in a
+ * binary max-heap ordered by rank, ties broken by arrival order, so the
+ * requests on the critical path are placed first. Placement is left to the
+ * resource policy; if the head does not fit the class waits for a completion,
+ * like FIFO does.
+ *
+ * Requests arrive in topological order, so a new request has no successors
+ * and its rank is its cost. When it is recorded as a successor of a request
+ * that is not done yet, the rank of that request and, transitively, of its
+ * own predecessors is raised; ranks never decrease. Propagation stops at
+ * requests already placed, whose predecessors are placed as well. The cost of
+ * a request is the number of PEs it uses.
+ *
+ * Edges are kept, in both directions, until either end is released.
+ */
+
+#define HEFT_HEAP_SIZE 1024 /* initial heap capacity, doubled when full */
+
+typedef struct heft_request_struct heft_req_t;
+
+typedef struct heft_edge_struct {
+    heft_req_t *pred;
+    heft_req_t *succ;
+    struct heft_edge_struct *pnext; /* successors of pred */
+    struct heft_edge_struct *pprev;
+    struct heft_edge_struct *snext; /* predecessors of succ */
+    struct heft_edge_struct *sprev;
+} heft_edge_t;
+
+struct heft_request_struct {
+    sched_req_t req;
+    uint64_t rank; /* 0 until known */
+    uint64_t seq;
+    int64_t pos; /* index in the heap, -1 if not queued */
+    int placed;  /* picked by a scheduling thread */
+    int raising; /* on the heft_raise() worklist */
+    heft_req_t *wnext;
+    heft_edge_t *preds;
+    heft_edge_t *succs;
+};
+
+static heft_req_t **heap;
+static uint64_t hsize;
+static uint64_t hcap;
+static uint64_t hseq;
+static pthread_mutex_t heft_plock;
+static pthread_cond_t heft_cond;
+static uint64_t heft_gen; /* bumped when the head changes or resources are released */
+static struct slab_pool heft_pool;
+static struct slab_pool heft_edge_pool;
+
+struct sched_class heft_class; /* forward declaration */
+
+static inline uint64_t heft_cost(sched_req_t *r) {
+    return r->pes ? r->pes : 1;
+}
+
+static inline int heft_before(heft_req_t *a, heft_req_t *b) {
+    return a->rank > b->rank || (a->rank == b->rank && a->seq < b->seq);
+}
+
+static inline void heft_set(uint64_t i, heft_req_t *el) {
+    heap[i] = el;
+    el->pos = i;
+}
+
+static void heft_sift_up(uint64_t i) {
+    heft_req_t *el = heap[i];
+
+    while (i > 0 && heft_before(el, heap[(i - 1) / 2])) {
+        heft_set(i, heap[(i - 1) / 2]);
+        i = (i - 1) / 2;
+    }
+    heft_set(i, el);
+}
+
+static void heft_sift_down(uint64_t i) {
+    heft_req_t *el = heap[i];
+    uint64_t c;
+
+    while ((c = 2 * i + 1) < hsize) {
+        if (c + 1 < hsize && heft_before(heap[c + 1], heap[c]))
+            c++;
+        if (!heft_before(heap[c], el))
+            break;
+        heft_set(i, heap[c]);
+        i = c;
+    }
+    heft_set(i, el);
+}
+
+/* heft_plock must be held */
+static inline void heft_kick(void) {
+    heft_gen++;
+    pthread_cond_broadcast(&heft_cond);
+}
+
+/* heft_plock must be held */
+static void heft_remove(heft_req_t *el) {
+    uint64_t i = el->pos;
+
+    if (i == 0)
+        heft_kick();
+    el->pos = -1;
+    if (i == --hsize)
+        return;
+
+    heft_set(i, heap[hsize]);
+    if (i > 0 && heft_before(heap[i], heap[(i - 1) / 2]))
+        heft_sift_up(i);
+    else
+        heft_sift_down(i);
+}
+
+/* heft_plock must be held */
+static inline void heft_rank_init(heft_req_t *el) {
+    if (!el->rank)
+        el->rank = heft_cost(&el->req);
+}
+
+/* heft_plock must be held */
+static inline void heft_set_rank(heft_req_t *el, uint64_t rank) {
+    el->rank = rank;
+    if (el->pos >= 0)
+        heft_sift_up(el->pos);
+}
+
+/*
+ * Raise the rank of el and of its predecessors, heft_plock must be held.
+ * Requests whose rank changed wait on a worklist to pass it on, a request
+ * raised again while on the list is walked once with its latest rank.
+ */
+static void heft_raise(heft_req_t *el, uint64_t rank) {
+    heft_req_t *head = hsize ? heap[0] : NULL;
+    heft_req_t *work, *p;
+    heft_edge_t *e;
+
+    if (el->placed || rank <= el->rank)
+        return;
+
+    heft_set_rank(el, rank);
+    el->wnext = NULL;
+    el->raising = 1;
+    work = el;
+
+    while ((el = work)) {
+        work = el->wnext;
+        el->raising = 0;
+
+        DL_FOREACH2(el->preds, e, snext) {
+            p = e->pred;
+            rank = heft_cost(&p->req) + el->rank;
+            if (p->placed || rank <= p->rank)
+                continue;
+
+            heft_set_rank(p, rank);
+            if (!p->raising) {
+                p->raising = 1;
+                p->wnext = work;
+                work = p;
+            }
+        }
+    }
+
+    /* A new head may fit where the previous one blocked */
+    if (hsize && heap[0] != head)
+        heft_kick();
+}
+
+static sched_req_t *heft_alloc_request(void) {
+    heft_req_t *h = slab_alloc(&heft_pool);
+
+    if (!h)
+        return NULL;
+
+    h->rank = 0;
+    h->pos = -1;
+    h->placed = 0;
+    h->raising = 0;
+    h->preds = NULL;
+    h->succs = NULL;
+
+    return &h->req;
+}
+
+static void heft_release_request(sched_req_t *r) {
+    heft_req_t *h = container_of(r, heft_req_t, req);
+    heft_edge_t *e, *tmp;
+
+    pthread_mutex_lock(&heft_plock);
+    DL_FOREACH_SAFE2(h->succs, e, tmp, pnext) {
+        DL_DELETE2(e->succ->preds, e, sprev, snext);
+        slab_free(&heft_edge_pool, e);
+    }
+    DL_FOREACH_SAFE2(h->preds, e, tmp, snext) {
+        DL_DELETE2(e->pred->succs, e, pprev, pnext);
+        slab_free(&heft_edge_pool, e);
+    }
+    pthread_mutex_unlock(&heft_plock);
+
+    slab_free(&heft_pool, h);
+}
+
+static int heft_depend(sched_req_t *r, sched_req_t *dep) {
+    heft_req_t *s = container_of(r, heft_req_t, req);
+    heft_req_t *p = container_of(dep, heft_req_t, req);
+    heft_edge_t *e = slab_alloc(&heft_edge_pool);
+
+    if (!e)
+        return -1;
+
+    pthread_mutex_lock(&heft_plock);
+    heft_rank_init(s);
+    heft_rank_init(p);
+    e->pred = p;
+    e->succ = s;
+    DL_APPEND2(p->succs, e, pprev, pnext);
+    DL_APPEND2(s->preds, e, sprev, snext);
+    heft_raise(p, heft_cost(dep) + s->rank);
+    pthread_mutex_unlock(&heft_plock);
+
+    return 0;
+}
+
+static int heft_enqueue(sched_req_t *r) {
+    heft_req_t *el = container_of(r, heft_req_t, req);
+    heft_req_t **h;
+
+    pthread_mutex_lock(&heft_plock);
+    if (hsize == hcap) {
+        h = realloc(heap, 2 * hcap * sizeof(heft_req_t *));
+        if (!h) {
+            pthread_mutex_unlock(&heft_plock);
+            eprintf("Error growing HEFT queue, dropping request (%d,%" PRIu64 ")", r->key.pid, r->key.rid);
+            return -1;
+        }
+        heap = h;
+        hcap *= 2;
+    }
+
+    heft_rank_init(el);
+    Dprintf("Adding request (%d,%" PRIu64 ") with rank %" PRIu64 "", r->key.pid, r->key.rid, el->rank);
+    el->seq = hseq++;
+    heap[hsize] = el;
+    heft_sift_up(hsize++);
+
+    /* A new head may fit where the previous one blocked */
+    if (el->pos == 0)
+        heft_kick();
+    pthread_mutex_unlock(&heft_plock);
+
+    return 0;
+}
+
+static int heft_dequeue(sched_req_t *r) {
+    heft_req_t *el = container_of(r, heft_req_t, req);
+
+    Dprintf("Removing request (%d,%" PRIu64 ")", r->key.pid, r->key.rid);
+    pthread_mutex_lock(&heft_plock);
+    if (el->pos >= 0)
+        heft_remove(el);
+    pthread_mutex_unlock(&heft_plock);
+
+    return 0;
+}
+
+static int heft_qlength(void) {
+    return ld_acq(&hsize);
+}
+
+static sched_req_t *heft_next(void) {
+    heft_req_t *r = NULL;
+
+    pthread_mutex_lock(&heft_plock);
+    while (hsize) {
+        r = heap[0];
+
+        if (sched_find_head(&r->req, &heft_plock, &heft_cond, &heft_gen) >= 0 && r->pos == 0) {
+            r->placed = 1;
+            heft_remove(r);
+            break;
+        }
+        r = NULL;
+    }
+    pthread_mutex_unlock(&heft_plock);
+
+    return r ? &r->req : NULL;
+}
+
+static int heft_complete(sched_req_t *r) {
+    pthread_mutex_lock(&heft_plock);
+    heft_kick();
+    pthread_mutex_unlock(&heft_plock);
+    return 0;
+}
+
+static int heft_init(void *args) {
+    Dprintf("Initializing HEFT (critical path first) scheduler");
+
+    hsize = 0;
+    hseq = 0;
+    heft_gen = 0;
+    hcap = HEFT_HEAP_SIZE;
+
+    heap = malloc(hcap * sizeof(heft_req_t *));
+    if (!heap) {
+        eprintf("Error allocating HEFT scheduler queue");
+        goto err;
+    }
+
+    if (slab_init(&heft_pool, sizeof(heft_req_t))) {
+        eprintf("Error initializing HEFT scheduler request pool");
+        goto err_heap;
+    }
+
+    if (slab_init(&heft_edge_pool, sizeof(heft_edge_t))) {
+        eprintf("Error initializing HEFT scheduler edge pool");
+        goto err_pool;
+    }
+
+    if (pthread_mutex_init(&heft_plock, NULL)) {
+        eprintf("Error initializing HEFT scheduler plock");
+        goto err_edge_pool;
+    }
+
+    if (pthread_cond_init(&heft_cond, NULL)) {
+        eprintf("Error initializing HEFT scheduler condition variable");
+        goto err_edge_pool;
+    }
+
+    return 0;
+
+err_edge_pool:
+    slab_fini(&heft_edge_pool);
+err_pool:
+    slab_fini(&heft_pool);
+err_heap:
+    free(heap);
+err:
+    return -1;
+}
+
+static int heft_finit(void) {
+    Dprintf("Finalizing HEFT scheduler");
+    slab_fini(&heft_edge_pool);
+    slab_fini(&heft_pool);
+    free(heap);
+
+    return 0;
+}
+
+extern const struct sched_resource_policy ff_policy;
+extern const struct sched_eviction_policy lru_eviction_policy;
+
+struct sched_class heft_class = {
+    .respol = &ff_policy,
+    .evictionpol = &lru_eviction_policy,
+    .init = heft_init,
+    .finit = heft_finit,
+    .alloc_request = heft_alloc_request,
+    .release_request = heft_release_request,
+    .enqueue = heft_enqueue,
+    .dequeue = heft_dequeue,
+    .pick_next = heft_next,
+    .queue_len = heft_qlength,
+    .complete = heft_complete,
+    .depend = heft_depend,
+};
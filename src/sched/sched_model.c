@@ -0,0 +1,120 @@
+#include <pthread.h>
+#include <stdlib.h>
+
+#include <minos.h>
+#include <minos_internal.h>
+#include <minos_sched_internal.h>
+
+/*
+ * Runtime model
+ *
+ * Execution times reported by clients in DONE messages are averaged per
+ * kernel (task id), device class and problem size, the power of two of the
+ * total number of work items. Each average is an exponentially weighted
+ * moving average that gives weight 2^-SCHED_MODEL_ALPHA_SHIFT to the newest
+ * sample, so the model follows changes in the behaviour of a kernel without
+ * keeping any history.
+ *
+ * Entries live in a fixed open-addressing table. When the probe window of a
+ * key is full, the entry with the fewest samples is replaced, so the table
+ * never grows and rarely used kernels make room for common ones.
+ */
+
+#define SCHED_MODEL_SIZE 4096 /* entries, power of two */
+#define SCHED_MODEL_PROBE 8
+#define SCHED_MODEL_ALPHA_SHIFT 2
+
+struct sched_model_entry {
+    uint64_t key; /* 0 if free */
+    uint64_t ewma;
+    uint64_t nsamples;
+};
+
+extern mcl_info_t *mcl_info;
+
+static struct sched_model_entry *model;
+static pthread_mutex_t model_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline uint64_t sched_model_key(sched_req_t *r, int dev) {
+    uint64_t items = 1;
+
+    for (int i = 0; i < MCL_DEV_DIMS; i++)
+        if (r->dpes[i])
+            items *= r->dpes[i];
+
+    /* Bit 63 set so a valid key is never 0 */
+    return ((uint64_t)0x01 << 63) | ((uint64_t)r->task_id << 24) |
+           ((mcl_res[dev].class & 0xffff) << 8) | (64 - __builtin_clzll(items));
+}
+
+static inline uint64_t sched_model_slot(uint64_t key) {
+    return (key * 0x9e3779b97f4a7c15ULL) >> (64 - __builtin_ctzll(SCHED_MODEL_SIZE));
+}
+
+int sched_model_init(void) {
+    model = calloc(SCHED_MODEL_SIZE, sizeof(struct sched_model_entry));
+    if (!model)
+        return -1;
+
+    return 0;
+}
+
+void sched_model_fini(void) {
+    free(model);
+    model = NULL;
+}
+
+void sched_model_update(sched_req_t *r, uint64_t ns) {
+    struct sched_model_entry *e, *victim = NULL;
+    uint64_t key, slot;
+
+    if (!model || !r->task_id || r->dev >= mcl_info->ndevs)
+        return;
+
+    key = sched_model_key(r, r->dev);
+    slot = sched_model_slot(key);
+
+    pthread_mutex_lock(&model_lock);
+    for (int i = 0; i < SCHED_MODEL_PROBE; i++) {
+        e = &model[(slot + i) & (SCHED_MODEL_SIZE - 1)];
+        if (e->key == key) {
+            e->ewma = e->ewma - (e->ewma >> SCHED_MODEL_ALPHA_SHIFT) + (ns >> SCHED_MODEL_ALPHA_SHIFT);
+            e->nsamples++;
+            goto out;
+        }
+        if (!victim || e->nsamples < victim->nsamples)
+            victim = e;
+    }
+
+    victim->key = key;
+    victim->ewma = ns;
+    victim->nsamples = 1;
+
+out:
+    pthread_mutex_unlock(&model_lock);
+    Dprintf("Request (%d,%" PRIu64 ") task 0x%" PRIx32 " ran %" PRIu64 " ns on resource %" PRIu64 "",
+            r->key.pid, r->key.rid, r->task_id, ns, r->dev);
+}
+
+uint64_t sched_model_estimate(sched_req_t *r, int dev) {
+    struct sched_model_entry *e;
+    uint64_t key, slot, ns = 0;
+
+    if (!model || !r->task_id)
+        return 0;
+
+    key = sched_model_key(r, dev);
+    slot = sched_model_slot(key);
+
+    pthread_mutex_lock(&model_lock);
+    for (int i = 0; i < SCHED_MODEL_PROBE; i++) {
+        e = &model[(slot + i) & (SCHED_MODEL_SIZE - 1)];
+        if (e->key == key) {
+            ns = e->ewma;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&model_lock);
+
+    return ns;
+}
@@ -0,0 +1,198 @@
+#include <pthread.h>
+#include <stdio.h>
+
+#include <atomics.h>
+#include <minos.h>
+#include <minos_internal.h>
+#include <minos_sched_internal.h>
+#include <slab.h>
+#include <utlist.h>
+
+/*
+ * PRIO - Strict priority scheduler
+ *
+ * One FIFO queue per priority level. Queues are doubly-linked, so appending
+ * and removing are O(1), and a bitmap of the non-empty levels gives the
+ * highest one with a single instruction. The head of the highest non-empty
+ * level is the next request to place: if it does not fit, the class waits for
+ * a completion like FIFO does, so lower priority requests never overtake it.
+ */
+
+#define PRIO_LEVELS (MCL_TASK_PRIO_MAX + 1)
+
+typedef struct prio_request_struct {
+    sched_req_t req;
+    struct prio_request_struct *next;
+    struct prio_request_struct *prev;
+    int queued;
+} prio_req_t;
+
+static prio_req_t *plist[PRIO_LEVELS];
+static uint32_t plevels; /* bit i set if plist[i] is not empty */
+static int plen;
+static pthread_mutex_t prio_plock;
+static pthread_cond_t prio_cond;
+static uint64_t prio_gen; /* bumped when the head changes or resources are released */
+static struct slab_pool prio_pool;
+
+struct sched_class prio_class; /* forward declaration */
+
+static sched_req_t *prio_alloc_request(void) {
+    prio_req_t *p = slab_alloc(&prio_pool);
+
+    if (!p)
+        return NULL;
+
+    p->next = NULL;
+    p->prev = NULL;
+    p->queued = 0;
+
+    return &p->req;
+}
+
+static void prio_release_request(sched_req_t *r) {
+    prio_req_t *p = container_of(r, prio_req_t, req);
+
+    slab_free(&prio_pool, p);
+}
+
+static inline unsigned int prio_level(sched_req_t *r) {
+    return r->prio < PRIO_LEVELS ? r->prio : PRIO_LEVELS - 1;
+}
+
+/* prio_plock must be held */
+static inline void prio_kick(void) {
+    prio_gen++;
+    pthread_cond_broadcast(&prio_cond);
+}
+
+/* prio_plock must be held */
+static inline prio_req_t *prio_head(void) {
+    return plevels ? plist[31 - __builtin_clz(plevels)] : NULL;
+}
+
+/* prio_plock must be held */
+static inline void prio_remove(prio_req_t *el) {
+    if (el == prio_head())
+        prio_kick();
+
+    unsigned int l = prio_level(&el->req);
+
+    DL_DELETE(plist[l], el);
+    if (!plist[l])
+        plevels &= ~(1u << l);
+    el->queued = 0;
+    adec(&plen);
+}
+
+/*
+ * Add a new element at the end of the queue of its priority level
+ */
+static int prio_enqueue(sched_req_t *r) {
+    prio_req_t *el = container_of(r, prio_req_t, req);
+    unsigned int l = prio_level(r);
+
+    Dprintf("Adding request (%d,%" PRIu64 ") with priority %u", r->key.pid, r->key.rid, l);
+    pthread_mutex_lock(&prio_plock);
+    DL_APPEND(plist[l], el);
+    el->queued = 1;
+    ainc(&plen);
+    /* A new highest level may fit where the previous head blocked */
+    if (plevels < (1u << l))
+        prio_kick();
+    plevels |= 1u << l;
+    pthread_mutex_unlock(&prio_plock);
+
+    return 0;
+}
+
+static int prio_dequeue(sched_req_t *r) {
+    prio_req_t *el = container_of(r, prio_req_t, req);
+
+    Dprintf("Removing request (%d,%" PRIu64 ")", r->key.pid, r->key.rid);
+    pthread_mutex_lock(&prio_plock);
+    if (el->queued)
+        prio_remove(el);
+    pthread_mutex_unlock(&prio_plock);
+
+    return 0;
+}
+
+static int prio_qlength(void) {
+    return ld_acq(&plen);
+}
+
+static sched_req_t *prio_next(void) {
+    prio_req_t *r;
+
+    pthread_mutex_lock(&prio_plock);
+    while ((r = prio_head())) {
+        if (sched_find_head(&r->req, &prio_plock, &prio_cond, &prio_gen) >= 0 && r == prio_head()) {
+            prio_remove(r);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&prio_plock);
+
+    return r ? &r->req : NULL;
+}
+
+static int prio_complete(sched_req_t *r) {
+    pthread_mutex_lock(&prio_plock);
+    prio_kick();
+    pthread_mutex_unlock(&prio_plock);
+    return 0;
+}
+
+static int prio_init(void *args) {
+    Dprintf("Initializing PRIO scheduler (%d levels)", PRIO_LEVELS);
+
+    memset(plist, 0, sizeof(plist));
+    plevels = 0;
+    plen = 0;
+    prio_gen = 0;
+
+    if (slab_init(&prio_pool, sizeof(prio_req_t))) {
+        eprintf("Error initializing PRIO scheduler request pool");
+        goto err;
+    }
+
+    if (pthread_mutex_init(&prio_plock, NULL)) {
+        eprintf("Error initializing PRIO scheduler plock");
+        goto err;
+    }
+
+    if (pthread_cond_init(&prio_cond, NULL)) {
+        eprintf("Error initializing PRIO scheduler condition variable");
+        goto err;
+    }
+
+    return 0;
+
+err:
+    return -1;
+}
+
+static int prio_finit(void) {
+    Dprintf("Finalizing PRIO scheduler");
+    slab_fini(&prio_pool);
+
+    return 0;
+}
+
+extern const struct sched_resource_policy ff_policy;
+extern const struct sched_eviction_policy lru_eviction_policy;
+
+struct sched_class prio_class = {
+    .respol = &ff_policy,
+    .evictionpol = &lru_eviction_policy,
+    .init = prio_init,
+    .finit = prio_finit,
+    .alloc_request = prio_alloc_request,
+    .release_request = prio_release_request,
+    .enqueue = prio_enqueue,
+    .dequeue = prio_dequeue,
+    .pick_next = prio_next,
+    .queue_len = prio_qlength,
+    .complete = prio_complete,
+};
@@ -8,6 +8,7 @@
 
 pthread_rwlock_t rdata_lock;
 sched_rdata *rdata_hash;
+pthread_rwlock_t sched_rdata_mlock = PTHREAD_RWLOCK_INITIALIZER;
 
 #ifdef _DEBUG
 static inline int rdata_print(void) {
@@ -143,8 +144,8 @@ int sched_rdata_add_device(sched_rdata *el, int dev) {
     Dprintf("\t Adding device %d for <%d,%" PRIu64 "> in hash table...",
             dev, el->pid, el->mem_id);
 
-    int cur_devs = el->devs;
-    el->devs |= (0x01 << dev);
+    uint64_t cur_devs = el->devs;
+    __atomic_store_n(&el->devs, cur_devs | ((uint64_t)0x01 << dev), __ATOMIC_RELEASE);
     if ((cur_devs >> dev) & 0x01) {
         return 1;
     }
@@ -153,8 +154,8 @@ int sched_rdata_add_device(sched_rdata *el, int dev) {
 }
 
 int sched_rdata_rm_device(sched_rdata *el, int dev) {
-    int cur_devs = el->devs;
-    el->devs &= ~(0x01 << dev);
+    uint64_t cur_devs = el->devs;
+    __atomic_store_n(&el->devs, cur_devs & ~((uint64_t)0x01 << dev), __ATOMIC_RELEASE);
     if (((cur_devs >> dev) & 0x01)) {
         el->ndevs -= 1;
         int64_t cur_idx = el->subbuffers.head;
@@ -172,5 +173,20 @@ int sched_rdata_rm_device(sched_rdata *el, int dev) {
 }
 
 int sched_rdata_on_device(sched_rdata *el, int dev) {
-    return ((el->devs >> dev) & 0x01);
-}
\ No newline at end of file
+    return ((ld_acq(&el->devs) >> dev) & 0x01);
+}
+/* Bytes of region that are valid on dev, for buffers split across devices */
+uint64_t sched_rdata_region_on_device(sched_rdata *el, mcl_partition_t *region, int dev) {
+    mcl_partition_t sentinel = {0, 0, region->offset + region->size - 1, -1, -1};
+    int64_t cur_idx = list_search_prev(&el->subbuffers, &sentinel);
+    mcl_partition_t *cur = list_get(&el->subbuffers, cur_idx);
+    uint64_t memory = 0;
+    while (cur && cur->offset + cur->size > region->offset) {
+        if (cur->dev == dev) {
+            memory += region->offset + region->size - cur->offset < cur->size ? region->offset + region->size - cur->offset : cur->size;
+        }
+        cur_idx = cur->prev;
+        cur = list_get(&el->subbuffers, cur_idx);
+    }
+    return memory;
+}
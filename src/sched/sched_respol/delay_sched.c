@@ -3,7 +3,7 @@
 
 static mcl_resource_t *res;
 static int nresources;
-static int next_dev;
+static __thread int next_dev; /* per scheduling thread */
 static int max_attempts;
 
 static void delay_init_resources(mcl_resource_t *r, int n) {
@@ -33,7 +33,7 @@ static int delay_find_resource(sched_req_t *r) {
     int num_fit = 0;
     uint64_t devs = 0;
     uint64_t mem_max = 0;
-    uint64_t *res_mem = malloc(sizeof(uint64_t) * nresources);
+    uint64_t res_mem[CL_MAX_DEVICES];
     memset(res_mem, 0, sizeof(uint64_t) * nresources);
 
     if (!(r->flags & MCL_FLAG_NO_RES)) {
@@ -41,7 +41,7 @@ static int delay_find_resource(sched_req_t *r) {
         for (int j = 0; j < r->nresident; j++) {
             el = r->resdata[j];
             for (int k = 0; k < nresources; k++) {
-                if (((el->devs >> k) & 0x1)) {
+                if (sched_rdata_on_device(el, k)) {
                     res_mem[k] += r->resdata[j]->size;
                     if (res_mem[k] > mem_max)
                         mem_max = res_mem[k];
@@ -51,31 +51,17 @@ static int delay_find_resource(sched_req_t *r) {
 
         for (int j = 0; j < nresources; j++) {
             if (res_mem[j] == mem_max)
-                devs |= (0x01 << j);
+                devs |= ((uint64_t)0x01 << j);
         }
     }
 
     do {
-        uint64_t mult = 1;
-        switch (res[i].dev->type) {
-        case MCL_TASK_GPU:
-            mult = MCL_DEV_MUL_GPU;
-            break;
-        case MCL_TASK_CPU:
-            mult = MCL_DEV_MUL_CPU;
-            break;
-        case MCL_TASK_FPGA:
-            mult = MCL_DEV_MUL_FPGA;
-            break;
-        case MCL_TASK_DF:
-            mult = MCL_DEV_MUL_DF;
-            break;
-        }
+        uint64_t mult = res[i].dev->pes_mul;
 
         uint64_t needed_mem = r->mem - res_mem[i];
         Dprintf("\tNeeded on resource %d: %" PRIu64 " MEM", i, needed_mem);
 
-        if ((res[i].dev->type & r->type) && ((res[i].mem_avail >= needed_mem) || (res[i].dev->type & MCL_TASK_FPGA)) && res[i].pes_used <= res[i].dev->pes * mult) {
+        if ((res[i].dev->type & r->type) && sched_owns_device(i) && ((res[i].mem_avail >= needed_mem) || (res[i].dev->type & MCL_TASK_FPGA)) && res[i].pes_used <= res[i].dev->pes * mult) {
             if (has_mem_on_other_dev(devs, i) && r->num_attempts < max_attempts) {
                 num_fit += 1;
                 r->num_attempts += 1;
@@ -88,7 +74,6 @@ static int delay_find_resource(sched_req_t *r) {
 
                 r->dev = i;
                 next_dev = (i + 1) % nresources;
-                free(res_mem);
                 return i;
             }
         }
@@ -96,7 +81,6 @@ static int delay_find_resource(sched_req_t *r) {
         cnt += 1;
     } while (cnt < nresources);
 
-    free(res_mem);
     if (num_fit)
         return MCL_SCHED_AGAIN;
 
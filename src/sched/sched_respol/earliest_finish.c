@@ -0,0 +1,94 @@
+#include <atomics.h>
+#include <minos_sched_internal.h>
+
+/*
+ * Earliest finish time: place a request on the device where it is expected to
+ * complete first among those it fits on. A device is busy for the estimated
+ * execution time of the requests running on it (its backlog), then the
+ * request runs for the time the runtime model estimates on that device.
+ *
+ * Requests the model knows nothing about count as 0 ns, so they go to the
+ * least busy device and the model learns how long they take there.
+ */
+
+static mcl_resource_t *res;
+static int nresources;
+static uint64_t backlog[CL_MAX_DEVICES];
+
+static void eft_init_resources(mcl_resource_t *r, int n) {
+    res = r;
+    nresources = n < CL_MAX_DEVICES ? n : CL_MAX_DEVICES;
+    for (int i = 0; i < nresources; i++)
+        backlog[i] = 0;
+}
+
+static uint64_t eft_mem_on_dev(sched_req_t *r, int dev) {
+    uint64_t mem = 0;
+    for (int i = 0; i < r->nresident; i++) {
+        if (sched_rdata_on_device(r->resdata[i], dev)) {
+            mem += r->resdata[i]->size;
+        }
+    }
+    return mem;
+}
+
+static int eft_find_resource(sched_req_t *r) {
+    int i, best = -1;
+    uint64_t est, finish, best_est = 0, best_finish = 0;
+
+    VDprintf("Locating resource for (%d,%" PRIu64 ") PES: %" PRIu64 " MEM: %" PRIu64 " TYPE: 0x%" PRIx64 "",
+             r->key.pid, r->key.rid, r->pes, r->mem, r->type);
+
+    for (i = 0; i < nresources; i++) {
+        if (!(res[i].dev->type & r->type) || !sched_owns_device(i))
+            continue;
+
+        uint64_t needed_mem = r->mem - eft_mem_on_dev(r, i);
+        if ((res[i].mem_avail < needed_mem && !(res[i].dev->type & MCL_TASK_FPGA)) || res[i].pes_used > res[i].dev->pes * res[i].dev->pes_mul)
+            continue;
+
+        est = sched_model_estimate(r, i);
+        finish = ld_acq(&backlog[i]) + est;
+        Dprintf("\tResource %d: backlog %" PRIu64 " ns, estimate %" PRIu64 " ns", i, finish - est, est);
+        if (best < 0 || finish < best_finish) {
+            best = i;
+            best_est = est;
+            best_finish = finish;
+        }
+    }
+
+    if (best < 0) {
+        r->num_attempts += 1;
+        Dprintf("No resource for task available: (%d,%" PRIu64 ") PES: %" PRIu64 " MEM: %" PRIu64 " TYPE: 0x%" PRIx64 "",
+                r->key.pid, r->key.rid, r->pes, r->mem, r->type);
+        return MCL_SCHED_BLOCK;
+    }
+
+    Dprintf("Found resource %d: expected to finish in %" PRIu64 " ns", best, best_finish);
+    r->dev = best;
+    r->est = best_est;
+
+    return best;
+}
+
+static int eft_assign_resource(sched_req_t *r) {
+    int ret = default_assign_resource(r);
+
+    add_fetch(&backlog[r->dev], r->est);
+
+    return ret;
+}
+
+static int eft_put_resource(sched_req_t *r) {
+    if (r->dev < nresources)
+        add_fetch(&backlog[r->dev], -r->est);
+
+    return default_put_resource(r);
+}
+
+const struct sched_resource_policy eft_policy = {
+    .init = eft_init_resources,
+    .find_resource = eft_find_resource,
+    .assign_resource = eft_assign_resource,
+    .put_resource = eft_put_resource,
+    .stats = default_stats};
@@ -20,7 +20,7 @@ static int ff_find_resource(sched_req_t *r) {
         int stop = 0;
         Dprintf("\t Res %d -> type 0x%" PRIx64 " pes %" PRIu64 " mem %" PRIu64 "", i, res[i].dev->type, res[i].dev->pes, res[i].dev->mem_size);
 
-        if (!(res[i].dev->type & r->type))
+        if (!(res[i].dev->type & r->type) || !sched_owns_device(i))
             continue;
 
         if (r->type == MCL_TASK_FPGA && res[i].dev->type == MCL_TASK_FPGA)
@@ -15,16 +15,15 @@ static mcl_resource_t *res;
 static int nresources;
 static double copy_factor;
 static int max_attempts;
-static policy_dev_t *device_list;
+/*
+ * Devices by least recent use. Each scheduling thread has its own list, built
+ * on its first call, so that threads never change the same list.
+ */
+static __thread policy_dev_t *device_list;
 
 static void hybrid_init_resources(mcl_resource_t *r, int n) {
     res = r;
     nresources = n;
-    for (int i = 0; i < nresources; i++) {
-        policy_dev_t *dev = malloc(sizeof(policy_dev_t));
-        dev->device = i;
-        DL_APPEND(device_list, dev);
-    }
 
     char *value;
     if ((value = getenv("MCL_SCHED_MAX_ATTEMPTS")) != NULL) {
@@ -45,19 +44,18 @@ static void hybrid_init_resources(mcl_resource_t *r, int n) {
     Dprintf("Initialized Hybrid scheduler with copy factor %f, and max attempts %d", copy_factor, max_attempts);
 }
 
-static int calculate_resident_memory(mcl_partition_t *region, uint64_t device, sched_rdata *rdata) {
-    mcl_partition_t sentinel = {0, 0, region->offset + region->size - 1, -1, -1};
-    int64_t cur_idx = list_search_prev(&rdata->subbuffers, &sentinel);
-    mcl_partition_t *cur = list_get(&rdata->subbuffers, cur_idx);
-    uint64_t memory = 0;
-    while (cur && cur->offset + cur->size > region->offset) {
-        if (cur->dev == device) {
-            memory += region->offset + region->size - cur->offset < cur->size ? region->offset + region->size - cur->offset : cur->size;
+static int hybrid_device_list(void) {
+    for (int i = 0; i < nresources; i++) {
+        policy_dev_t *dev = malloc(sizeof(policy_dev_t));
+        if (!dev) {
+            eprintf("Error allocating device list");
+            return -1;
         }
-        cur_idx = cur->prev;
-        cur = list_get(&rdata->subbuffers, cur_idx);
+        dev->device = i;
+        DL_APPEND(device_list, dev);
     }
-    return memory;
+
+    return 0;
 }
 
 static int has_mem_on_other_dev(uint64_t devs, int dev) {
@@ -72,20 +70,24 @@ static int hybrid_find_resource(sched_req_t *r) {
     uint64_t devs = 0;
     uint64_t mem_max = 0;
     uint64_t allocated_max = 0;
-    uint64_t *res_mem = malloc(sizeof(uint64_t) * nresources);
-    uint64_t *allocated_mem = malloc(sizeof(uint64_t) * nresources);
+    uint64_t res_mem[CL_MAX_DEVICES];
+    uint64_t allocated_mem[CL_MAX_DEVICES];
     memset(res_mem, 0, sizeof(uint64_t) * nresources);
     memset(allocated_mem, 0, sizeof(uint64_t) * nresources);
 
+    if (!device_list && hybrid_device_list())
+        return MCL_SCHED_BLOCK;
+
     if (!(r->flags & MCL_FLAG_NO_RES)) {
         sched_rdata *el;
+        pthread_rwlock_rdlock(&sched_rdata_mlock);
         for (int j = 0; j < r->nresident; j++) {
             el = r->resdata[j];
             uint64_t max_copies = copy_factor != 1 ? (int)(log((double)el->refs) / log(copy_factor)) : el->ndevs;
             for (int k = 0; k < nresources; k++) {
                 if ((max_copies < el->ndevs || el->flags & MSG_ARGFLAG_EXCLUSIVE) && ((el->devs >> k) & 0x1)) {
                     if (el->flags & MSG_ARGFLAG_EXCLUSIVE) {
-                        res_mem[k] += calculate_resident_memory(&r->regions[j], (uint64_t)k, r->resdata[j]);
+                        res_mem[k] += sched_rdata_region_on_device(r->resdata[j], &r->regions[j], k);
                     }
                     else {
                         res_mem[k] += r->resdata[j]->size;
@@ -101,10 +103,11 @@ static int hybrid_find_resource(sched_req_t *r) {
                     r->key.pid, r->key.rid, r->resdata[j]->mem_id, r->resdata[j]->refs, r->resdata[j]->ndevs,
                     max_copies + 1);
         }
+        pthread_rwlock_unlock(&sched_rdata_mlock);
 
         for (int j = 0; j < nresources; j++) {
             if (allocated_max != 0 && res_mem[j] == mem_max && allocated_mem[j] == allocated_max)
-                devs |= (0x01 << j);
+                devs |= ((uint64_t)0x01 << j);
         }
     }
 
@@ -112,23 +115,12 @@ static int hybrid_find_resource(sched_req_t *r) {
     policy_dev_t *el, *tmp;
     LL_FOREACH_SAFE(device_list, el, tmp) {
         i = el->device;
+        if (!sched_owns_device(i))
+            continue;
+
         uint64_t needed_mem = r->mem - allocated_mem[i];
         Dprintf("\tNeeded on resource %d: %" PRIu64 " MEM, %" PRIu64 " MEM available", i, needed_mem, res[i].mem_avail);
-        uint64_t mult = 1;
-        switch (res[i].dev->type) {
-        case MCL_TASK_GPU:
-            mult = MCL_DEV_MUL_GPU;
-            break;
-        case MCL_TASK_CPU:
-            mult = MCL_DEV_MUL_CPU;
-            break;
-        case MCL_TASK_FPGA:
-            mult = MCL_DEV_MUL_FPGA;
-            break;
-        case MCL_TASK_DF:
-            mult = MCL_DEV_MUL_DF;
-            break;
-        }
+        uint64_t mult = res[i].dev->pes_mul;
 
         if (!(res[i].dev->type & r->type) || (res[i].pes_used > res[i].dev->pes * mult)) {
             continue;
@@ -136,8 +128,6 @@ static int hybrid_find_resource(sched_req_t *r) {
 
         if (res[i].dev->type & MCL_TASK_FPGA) {
             r->dev = i;
-            free(res_mem);
-            free(allocated_mem);
             DL_DELETE(device_list, el);
             DL_APPEND(device_list, el);
             return i;
@@ -169,15 +159,11 @@ static int hybrid_find_resource(sched_req_t *r) {
                 res[i].dev->mem_size, r->num_attempts);
 
         r->dev = i;
-        free(res_mem);
-        free(allocated_mem);
         DL_DELETE(device_list, el);
         DL_APPEND(device_list, el);
         return i;
     }
 
-    free(res_mem);
-    free(allocated_mem);
     if (num_fit)
         return MCL_SCHED_AGAIN;
 
@@ -0,0 +1,145 @@
+#include <pthread.h>
+
+#include <minos_sched_internal.h>
+#include <utlist.h>
+
+/*
+ * Least work: place a request on the device with the least outstanding work
+ * per PE among those it fits on. The outstanding work of a device is the
+ * number of PEs used by the requests running on it; it is updated when a
+ * request is assigned and put, and the device list is kept sorted by it, so
+ * finding a device usually stops at the head of the list.
+ */
+
+typedef struct lws_dev_struct {
+    int device;
+    uint64_t load;
+    struct lws_dev_struct *next;
+    struct lws_dev_struct *prev;
+} lws_dev_t;
+
+static mcl_resource_t *res;
+static int nresources;
+static lws_dev_t devs[CL_MAX_DEVICES];
+static lws_dev_t *device_list; /* by increasing load per PE */
+static pthread_mutex_t lws_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline uint64_t lws_work(sched_req_t *r) {
+    return r->pes ? r->pes : 1;
+}
+
+static inline uint64_t lws_pes(lws_dev_t *d) {
+    return res[d->device].dev->pes ? res[d->device].dev->pes : 1;
+}
+
+static inline int lws_less(lws_dev_t *a, lws_dev_t *b) {
+    return a->load * lws_pes(b) < b->load * lws_pes(a);
+}
+
+/* Move d to its place after its load changed, lws_lock must be held */
+static void lws_reposition(lws_dev_t *d) {
+    lws_dev_t *p;
+
+    if (d != device_list && lws_less(d, d->prev)) {
+        p = d->prev;
+        DL_DELETE(device_list, d);
+        while (p != device_list && lws_less(d, p->prev))
+            p = p->prev;
+        DL_PREPEND_ELEM(device_list, p, d);
+    }
+    else if (d->next && lws_less(d->next, d)) {
+        p = d->next;
+        DL_DELETE(device_list, d);
+        while (p->next && lws_less(p->next, d))
+            p = p->next;
+        DL_APPEND_ELEM(device_list, p, d);
+    }
+}
+
+static void lws_init_resources(mcl_resource_t *r, int n) {
+    res = r;
+    nresources = n < CL_MAX_DEVICES ? n : CL_MAX_DEVICES;
+    device_list = NULL;
+    for (int i = 0; i < nresources; i++) {
+        devs[i].device = i;
+        devs[i].load = 0;
+        DL_APPEND(device_list, &devs[i]);
+    }
+}
+
+static uint64_t lws_mem_on_dev(sched_req_t *r, int dev) {
+    uint64_t mem = 0;
+    for (int i = 0; i < r->nresident; i++) {
+        if (sched_rdata_on_device(r->resdata[i], dev)) {
+            mem += r->resdata[i]->size;
+        }
+    }
+    return mem;
+}
+
+static int lws_find_resource(sched_req_t *r) {
+    lws_dev_t *el;
+    int i;
+
+    VDprintf("Locating resource for (%d,%" PRIu64 ") PES: %" PRIu64 " MEM: %" PRIu64 " TYPE: 0x%" PRIx64 "",
+             r->key.pid, r->key.rid, r->pes, r->mem, r->type);
+
+    pthread_mutex_lock(&lws_lock);
+    DL_FOREACH(device_list, el) {
+        i = el->device;
+        if (!(res[i].dev->type & r->type) || !sched_owns_device(i))
+            continue;
+
+        uint64_t needed_mem = r->mem - lws_mem_on_dev(r, i);
+        Dprintf("\tNeeded on resource %d: %" PRIu64 " MEM, load %" PRIu64 "", i, needed_mem, el->load);
+        if ((res[i].mem_avail >= needed_mem || res[i].dev->type & MCL_TASK_FPGA) && res[i].pes_used <= res[i].dev->pes * res[i].dev->pes_mul) {
+            Dprintf("Found resource %d: %" PRIu64 "/%" PRIu64 " PEs used %" PRIu64
+                    "/%" PRIu64 " MEM available",
+                    i, res[i].pes_used, res[i].dev->pes, res[i].mem_avail,
+                    res[i].dev->mem_size);
+
+            r->dev = i;
+            pthread_mutex_unlock(&lws_lock);
+
+            return i;
+        }
+    }
+    pthread_mutex_unlock(&lws_lock);
+
+    r->num_attempts += 1;
+    Dprintf("No resource for task available: (%d,%" PRIu64 ") PES: %" PRIu64 " MEM: %" PRIu64 " TYPE: 0x%" PRIx64 "",
+            r->key.pid, r->key.rid, r->pes, r->mem, r->type);
+
+    return MCL_SCHED_BLOCK;
+}
+
+static int lws_assign_resource(sched_req_t *r) {
+    int ret = default_assign_resource(r);
+
+    pthread_mutex_lock(&lws_lock);
+    devs[r->dev].load += lws_work(r);
+    lws_reposition(&devs[r->dev]);
+    pthread_mutex_unlock(&lws_lock);
+
+    return ret;
+}
+
+static int lws_put_resource(sched_req_t *r) {
+    uint64_t work = lws_work(r);
+
+    if (r->dev < nresources) {
+        pthread_mutex_lock(&lws_lock);
+        devs[r->dev].load = devs[r->dev].load > work ? devs[r->dev].load - work : 0;
+        lws_reposition(&devs[r->dev]);
+        pthread_mutex_unlock(&lws_lock);
+    }
+
+    return default_put_resource(r);
+}
+
+const struct sched_resource_policy lws_policy = {
+    .init = lws_init_resources,
+    .find_resource = lws_find_resource,
+    .assign_resource = lws_assign_resource,
+    .put_resource = lws_put_resource,
+    .stats = default_stats};
@@ -4,7 +4,7 @@
 static mcl_resource_t *res;
 static int nresources;
 
-static int next_dev;
+static __thread int next_dev; /* per scheduling thread */
 
 static void rr_init_resources(mcl_resource_t *r, int n) {
     res = r;
@@ -30,12 +30,12 @@ static int rr_find_resource(sched_req_t *r) {
 
     /* Scan num_res devices starting from next_dev, wrap around if necessary. */
     for (i = next_dev; cnt < nresources; cnt++, i = (i + 1) % nresources) {
-        if (!(res[i].dev->type & r->type))
+        if (!(res[i].dev->type & r->type) || !sched_owns_device(i))
             continue;
 
         uint64_t needed_mem = r->mem - rr_mem_on_dev(r, i);
         Dprintf("\tNeeded on resource %d: %" PRIu64 " MEM", i, needed_mem);
-        if ((res[i].mem_avail >= needed_mem || res[i].dev->type & MCL_TASK_FPGA) && res[i].pes_used <= res[i].dev->pes) {
+        if ((res[i].mem_avail >= needed_mem || res[i].dev->type & MCL_TASK_FPGA) && res[i].pes_used <= res[i].dev->pes * res[i].dev->pes_mul) {
             Dprintf("Found resource %d: %" PRIu64 "/%" PRIu64 " PEs used %" PRIu64
                     "/%" PRIu64 " MEM available",
                     i, res[i].pes_used, res[i].dev->pes, res[i].mem_avail,
@@ -0,0 +1,141 @@
+#include <atomics.h>
+#include <minos_sched_internal.h>
+
+/*
+ * Transfer-aware placement: place a request on the device where it is
+ * expected to finish first, counting the time to move its data there.
+ *
+ * For each device the request fits on, the cost is:
+ *  - the bytes of the request not valid on the device, at the host to device
+ *    bandwidth measured at startup;
+ *  - the bytes that must be evicted to make room for them, written back at
+ *    the device to host bandwidth;
+ *  - the estimated time of the work already placed on the device (its
+ *    backlog) plus the estimated execution time of the request.
+ *
+ * Devices whose bandwidth was not measured use XFER_BW_DFT. Ties go to the
+ * device with fewer kernels running.
+ */
+
+#define XFER_BW_DFT 8.0 /* bytes/ns */
+
+static mcl_resource_t *res;
+static int nresources;
+static uint64_t backlog[CL_MAX_DEVICES];
+
+static void xfer_init_resources(mcl_resource_t *r, int n) {
+    res = r;
+    nresources = n < CL_MAX_DEVICES ? n : CL_MAX_DEVICES;
+    for (int i = 0; i < nresources; i++)
+        backlog[i] = 0;
+}
+
+static inline double xfer_bw(double bw) {
+    return bw > 0.0 ? bw : XFER_BW_DFT;
+}
+
+static int xfer_find_resource(sched_req_t *r) {
+    uint64_t cost[CL_MAX_DEVICES], est[CL_MAX_DEVICES], needed[CL_MAX_DEVICES];
+    uint64_t resident, allocated, in, evict;
+    int cand[CL_MAX_DEVICES], ncand = 0;
+    int i, j, best;
+
+    VDprintf("Locating resource for (%d,%" PRIu64 ") PES: %" PRIu64 " MEM: %" PRIu64 " TYPE: 0x%" PRIx64 "",
+             r->key.pid, r->key.rid, r->pes, r->mem, r->type);
+
+    for (i = 0; i < nresources; i++) {
+        if (!(res[i].dev->type & r->type) || !sched_owns_device(i) ||
+            res[i].pes_used > res[i].dev->pes * res[i].dev->pes_mul)
+            continue;
+
+        resident = 0;
+        allocated = 0;
+        if (!(r->flags & MCL_FLAG_NO_RES)) {
+            pthread_rwlock_rdlock(&sched_rdata_mlock);
+            for (j = 0; j < r->nresident; j++) {
+                if (!sched_rdata_on_device(r->resdata[j], i))
+                    continue;
+                allocated += r->resdata[j]->size;
+                if (r->resdata[j]->flags & MSG_ARGFLAG_EXCLUSIVE)
+                    resident += sched_rdata_region_on_device(r->resdata[j], &r->regions[j], i);
+                else
+                    resident += r->resdata[j]->size;
+            }
+            pthread_rwlock_unlock(&sched_rdata_mlock);
+        }
+
+        in = r->mem > resident ? r->mem - resident : 0;
+        needed[i] = r->mem > allocated ? r->mem - allocated : 0;
+        evict = 0;
+        if (!(res[i].dev->type & MCL_TASK_FPGA)) {
+            if (needed[i] > (uint64_t)res[i].dev->mem_size)
+                continue;
+            if (needed[i] > res[i].mem_avail)
+                evict = needed[i] - res[i].mem_avail;
+        }
+
+        est[i] = (uint64_t)(in / xfer_bw(res[i].dev->bw_h2d) + evict / xfer_bw(res[i].dev->bw_d2h)) +
+                 sched_model_estimate(r, i);
+        cost[i] = ld_acq(&backlog[i]) + est[i];
+        Dprintf("\tResource %d: %" PRIu64 " bytes in, %" PRIu64 " bytes evicted, cost %" PRIu64 " ns",
+                i, in, evict, cost[i]);
+        cand[ncand++] = i;
+    }
+
+    while (ncand) {
+        best = 0;
+        for (j = 1; j < ncand; j++) {
+            i = cand[j];
+            if (cost[i] < cost[cand[best]] ||
+                (cost[i] == cost[cand[best]] && res[i].nkernels < res[cand[best]].nkernels))
+                best = j;
+        }
+        i = cand[best];
+
+        if (!(res[i].dev->type & MCL_TASK_FPGA)) {
+            while (res[i].mem_avail < needed[i]) {
+                if (scheduler_evict_mem(i) < 0)
+                    break;
+            }
+
+            if (res[i].mem_avail < needed[i]) {
+                cand[best] = cand[--ncand];
+                continue;
+            }
+        }
+
+        Dprintf("Found resource %d: expected to finish in %" PRIu64 " ns", i, cost[i]);
+        r->dev = i;
+        r->est = est[i];
+
+        return i;
+    }
+
+    r->num_attempts += 1;
+    Dprintf("No resource for task available: (%d,%" PRIu64 ") PES: %" PRIu64 " MEM: %" PRIu64 " TYPE: 0x%" PRIx64 "",
+            r->key.pid, r->key.rid, r->pes, r->mem, r->type);
+
+    return MCL_SCHED_BLOCK;
+}
+
+static int xfer_assign_resource(sched_req_t *r) {
+    int ret = default_assign_resource(r);
+
+    add_fetch(&backlog[r->dev], r->est);
+
+    return ret;
+}
+
+static int xfer_put_resource(sched_req_t *r) {
+    if (r->dev < nresources)
+        add_fetch(&backlog[r->dev], -r->est);
+
+    return default_put_resource(r);
+}
+
+const struct sched_resource_policy xfer_policy = {
+    .init = xfer_init_resources,
+    .find_resource = xfer_find_resource,
+    .assign_resource = xfer_assign_resource,
+    .put_resource = xfer_put_resource,
+    .stats = default_stats};
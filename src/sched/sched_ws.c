@@ -0,0 +1,367 @@
+#include <pthread.h>
+#include <stdio.h>
+
+#include <atomics.h>
+#include <minos.h>
+#include <minos_internal.h>
+#include <minos_sched_internal.h>
+#include <slab.h>
+#include <utlist.h>
+
+/*
+ * WS - Per-device run queues with work stealing
+ *
+ * A ready request is bound to a device when it is enqueued: among the devices
+ * of a matching type, the one that already holds most of its resident data,
+ * ties broken by the shortest queue. A scheduling thread only looks at the
+ * queues of the devices it owns, and only checks whether the head of each
+ * queue fits on that device, so picks on different devices do not contend.
+ *
+ * A device whose queue is empty steals from the longest queues, starting from
+ * their tail, the first request of a compatible type that fits on it.
+ *
+ * A request that no device can run is kept on a separate list instead, where
+ * it does not hold up the requests behind it and is never picked.
+ *
+ * Each queue has its own lock and no two queue locks are ever held together.
+ */
+
+#define WS_STEAL_SCAN 8 /* requests of a victim queue looked at per steal */
+
+typedef struct ws_request_struct {
+    sched_req_t req;
+    struct ws_request_struct *next;
+    struct ws_request_struct *prev;
+    int64_t q; /* queue the request is bound to, -1 if not queued */
+} ws_req_t;
+
+struct ws_queue {
+    pthread_mutex_t lock;
+    ws_req_t *head;
+    uint64_t len;
+    uint64_t nbound;
+    uint64_t nstolen;
+} __attribute__((aligned(64)));
+
+/* wsq[nqueues] holds the requests of a type no device has */
+static struct ws_queue wsq[CL_MAX_DEVICES + 1];
+static uint64_t nqueues;
+static int wlen;
+static uint64_t ws_gen; /* bumped on enqueue and completion */
+static pthread_mutex_t ws_lock;
+static pthread_cond_t ws_cond;
+static struct slab_pool ws_pool;
+
+extern mcl_info_t *mcl_info;
+
+struct sched_class ws_class; /* forward declaration */
+
+static sched_req_t *ws_alloc_request(void) {
+    ws_req_t *w = slab_alloc(&ws_pool);
+
+    if (!w)
+        return NULL;
+
+    w->q = -1;
+
+    return &w->req;
+}
+
+static void ws_release_request(sched_req_t *r) {
+    ws_req_t *w = container_of(r, ws_req_t, req);
+
+    slab_free(&ws_pool, w);
+}
+
+/* Wake up the threads waiting for a queue to change */
+static void ws_kick(void) {
+    pthread_mutex_lock(&ws_lock);
+    ws_gen++;
+    pthread_cond_broadcast(&ws_cond);
+    pthread_mutex_unlock(&ws_lock);
+}
+
+/* wsq[q].lock must be held */
+static inline void ws_remove(uint64_t q, ws_req_t *el) {
+    DL_DELETE(wsq[q].head, el);
+    wsq[q].len--;
+    el->q = -1;
+    if (q < nqueues)
+        adec(&wlen);
+}
+
+/*
+ * Check whether r fits on device dev only, whatever devices the calling
+ * thread owns.
+ */
+static inline int ws_fits(sched_req_t *r, uint64_t dev) {
+    uint64_t devs = sched_devs;
+    int ret;
+
+    sched_devs = (uint64_t)0x01 << dev;
+    ret = ws_class.respol->find_resource(r);
+    sched_devs = devs;
+
+    return ret;
+}
+
+static uint64_t ws_bind(sched_req_t *r) {
+    uint64_t best = nqueues, best_aff = 0, best_len = 0;
+    uint64_t aff, len;
+
+    for (uint64_t d = 0; d < nqueues; d++) {
+        if (!(mcl_res[d].dev->type & r->type))
+            continue;
+
+        aff = 0;
+        for (uint64_t i = 0; i < r->nresident; i++)
+            if ((ld_acq(&r->resdata[i]->devs) >> d) & 0x01)
+                aff += r->resdata[i]->size;
+
+        len = ld_acq(&wsq[d].len);
+        if (best == nqueues || aff > best_aff || (aff == best_aff && len < best_len)) {
+            best = d;
+            best_aff = aff;
+            best_len = len;
+        }
+    }
+
+    return best;
+}
+
+static int ws_enqueue(sched_req_t *r) {
+    ws_req_t *el = container_of(r, ws_req_t, req);
+    uint64_t d = ws_bind(r);
+
+    if (d == nqueues)
+        eprintf("No device can run request (%d,%" PRIu64 ") of type 0x%" PRIx64 ", not scheduling it",
+                r->key.pid, r->key.rid, r->type);
+    else
+        Dprintf("Adding request (%d,%" PRIu64 ") to queue of device %" PRIu64 "", r->key.pid, r->key.rid, d);
+
+    pthread_mutex_lock(&wsq[d].lock);
+    DL_APPEND(wsq[d].head, el);
+    wsq[d].len++;
+    wsq[d].nbound++;
+    el->q = d;
+    if (d < nqueues)
+        ainc(&wlen);
+    pthread_mutex_unlock(&wsq[d].lock);
+
+    if (d < nqueues)
+        ws_kick();
+
+    return 0;
+}
+
+static int ws_dequeue(sched_req_t *r) {
+    ws_req_t *el = container_of(r, ws_req_t, req);
+    int64_t q = ld_acq(&el->q);
+
+    Dprintf("Removing request (%d,%" PRIu64 ")", r->key.pid, r->key.rid);
+    if (q < 0)
+        return 0;
+
+    pthread_mutex_lock(&wsq[q].lock);
+    if (el->q == q)
+        ws_remove(q, el);
+    pthread_mutex_unlock(&wsq[q].lock);
+
+    return 0;
+}
+
+static int ws_qlength(void) {
+    return ld_acq(&wlen);
+}
+
+static ws_req_t *ws_pick(uint64_t d, int *again) {
+    ws_req_t *r;
+    int dev;
+
+    pthread_mutex_lock(&wsq[d].lock);
+    if ((r = wsq[d].head)) {
+        if ((dev = ws_fits(&r->req, d)) >= 0)
+            ws_remove(d, r);
+        else {
+            *again |= dev == MCL_SCHED_AGAIN;
+            r = NULL;
+        }
+    }
+    pthread_mutex_unlock(&wsq[d].lock);
+
+    return r;
+}
+
+static ws_req_t *ws_steal_from(uint64_t v, uint64_t d, int *again) {
+    ws_req_t *r, *found = NULL;
+    int n = 0, dev;
+
+    pthread_mutex_lock(&wsq[v].lock);
+    /* The tail is the head's prev, walk backwards from it */
+    for (r = wsq[v].head ? wsq[v].head->prev : NULL; r && n < WS_STEAL_SCAN; r = r == wsq[v].head ? NULL : r->prev) {
+        if (!(mcl_res[d].dev->type & r->req.type))
+            continue;
+
+        n++;
+        if ((dev = ws_fits(&r->req, d)) >= 0) {
+            ws_remove(v, r);
+            found = r;
+            break;
+        }
+        *again |= dev == MCL_SCHED_AGAIN;
+    }
+    if (found)
+        wsq[d].nstolen++;
+    pthread_mutex_unlock(&wsq[v].lock);
+
+    return found;
+}
+
+/*
+ * Called when the queue of device d is empty: try the other queues by
+ * decreasing length.
+ */
+static ws_req_t *ws_steal(uint64_t d, int *again) {
+    uint64_t tried = (uint64_t)0x01 << d;
+    uint64_t v, len, vlen;
+    ws_req_t *r;
+
+    while (1) {
+        v = nqueues;
+        vlen = 0;
+        for (uint64_t i = 0; i < nqueues; i++) {
+            if ((tried >> i) & 0x01)
+                continue;
+            if ((len = ld_acq(&wsq[i].len)) > vlen) {
+                v = i;
+                vlen = len;
+            }
+        }
+        if (v == nqueues)
+            return NULL;
+
+        tried |= (uint64_t)0x01 << v;
+        if ((r = ws_steal_from(v, d, again))) {
+            Dprintf("Device %" PRIu64 " stole request (%d,%" PRIu64 ") from device %" PRIu64 "",
+                    d, r->req.key.pid, r->req.key.rid, v);
+            return r;
+        }
+    }
+}
+
+static sched_req_t *ws_next(void) {
+    ws_req_t *r;
+    uint64_t gen;
+    int again;
+
+    while (ld_acq(&wlen)) {
+        gen = ld_acq(&ws_gen);
+        again = 0;
+
+        for (uint64_t d = 0; d < nqueues; d++) {
+            if (!sched_owns_device(d))
+                continue;
+            if ((r = ws_pick(d, &again)))
+                return &r->req;
+            if (!ld_acq(&wsq[d].len) && (r = ws_steal(d, &again)))
+                return &r->req;
+        }
+
+        if (again) {
+            sched_yield();
+            continue;
+        }
+
+        pthread_mutex_lock(&ws_lock);
+        while (gen == ws_gen)
+            sched_wait(&ws_cond, &ws_lock);
+        pthread_mutex_unlock(&ws_lock);
+    }
+
+    return NULL;
+}
+
+static int ws_complete(sched_req_t *r) {
+    ws_kick();
+    return 0;
+}
+
+static int ws_stats(void) {
+    for (uint64_t d = 0; d < nqueues; d++)
+        iprintf("WS: device %" PRIu64 " %" PRIu64 " requests bound, %" PRIu64 " stolen, %" PRIu64 " queued",
+                d, ld_acq(&wsq[d].nbound), ld_acq(&wsq[d].nstolen), ld_acq(&wsq[d].len));
+    iprintf("WS: %" PRIu64 " requests no device can run", ld_acq(&wsq[nqueues].len));
+
+    return 0;
+}
+
+static int ws_init(void *args) {
+    uint64_t d;
+
+    nqueues = mcl_info->ndevs < CL_MAX_DEVICES ? mcl_info->ndevs : CL_MAX_DEVICES;
+    Dprintf("Initializing WS (per-device queues, work stealing) scheduler, %" PRIu64 " queues", nqueues);
+
+    wlen = 0;
+    ws_gen = 0;
+
+    if (slab_init(&ws_pool, sizeof(ws_req_t))) {
+        eprintf("Error initializing WS scheduler request pool");
+        goto err;
+    }
+
+    for (d = 0; d <= nqueues; d++) {
+        wsq[d].head = NULL;
+        wsq[d].len = wsq[d].nbound = wsq[d].nstolen = 0;
+        if (pthread_mutex_init(&wsq[d].lock, NULL)) {
+            eprintf("Error initializing WS scheduler queue lock");
+            goto err_queues;
+        }
+    }
+
+    if (pthread_mutex_init(&ws_lock, NULL)) {
+        eprintf("Error initializing WS scheduler plock");
+        goto err_queues;
+    }
+
+    if (pthread_cond_init(&ws_cond, NULL)) {
+        eprintf("Error initializing WS scheduler condition variable");
+        goto err_queues;
+    }
+
+    return 0;
+
+err_queues:
+    while (d--)
+        pthread_mutex_destroy(&wsq[d].lock);
+    slab_fini(&ws_pool);
+err:
+    return -1;
+}
+
+static int ws_finit(void) {
+    Dprintf("Finalizing WS scheduler");
+    ws_stats();
+    for (uint64_t d = 0; d <= nqueues; d++)
+        pthread_mutex_destroy(&wsq[d].lock);
+    slab_fini(&ws_pool);
+
+    return 0;
+}
+
+extern const struct sched_resource_policy ff_policy;
+extern const struct sched_eviction_policy lru_eviction_policy;
+
+struct sched_class ws_class = {
+    .respol = &ff_policy,
+    .evictionpol = &lru_eviction_policy,
+    .init = ws_init,
+    .finit = ws_finit,
+    .alloc_request = ws_alloc_request,
+    .release_request = ws_release_request,
+    .enqueue = ws_enqueue,
+    .dequeue = ws_dequeue,
+    .pick_next = ws_next,
+    .queue_len = ws_qlength,
+    .complete = ws_complete,
+    .stats = ws_stats,
+};
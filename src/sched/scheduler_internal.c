@@ -18,11 +18,14 @@
 #include <minos_sched.h>
 #include <minos_sched_internal.h>
 #include <ptrhash.h>
+#include <slab.h>
 #include <stats.h>
 #include <tracer.h>
 #include <utlist.h>
 
-#define SCHED_REQ_TABLE_SIZE_SHIFT 20
+#define SCHED_REQ_SHARDS_SHIFT 6
+#define SCHED_REQ_SHARDS (1u << SCHED_REQ_SHARDS_SHIFT)
+#define SCHED_REQ_SHARD_SIZE_SHIFT 10
 
 mcl_sched_t mcl_sched_desc;
 mcl_info_t *mcl_info = NULL;
@@ -37,6 +40,16 @@ int sock_fd, shm_fd;
 struct sockaddr_un saddr;
 static pthread_t rcv_tid;
 
+/*
+ * Scheduling threads. Thread k owns the devices d with d % sched_nthreads == k
+ * and is the only one that places requests on them, so the check done by
+ * find_resource() and the update done by assign_resource() on a device never
+ * race with another scheduling thread. Each thread has its own wake up event.
+ */
+static uint64_t sched_nthreads = 1;
+static msg_event_t *sched_evs = NULL;
+__thread uint64_t sched_devs = ~((uint64_t)0);
+
 static uint64_t num_threads = 0;
 
 struct sched_class *sched_curr = &fifo_class;
@@ -44,13 +57,38 @@ extern const struct sched_resource_policy ff_policy;
 extern const struct sched_resource_policy rr_policy;
 extern const struct sched_resource_policy delay_policy;
 extern const struct sched_resource_policy hybrid_policy;
+extern const struct sched_resource_policy lws_policy;
+extern const struct sched_resource_policy eft_policy;
+extern const struct sched_resource_policy xfer_policy;
 
 extern const struct sched_eviction_policy lru_eviction_policy;
 
-/* The following lock protects sched_req_table */
-static pthread_mutex_t sched_req_lock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t sched_req_has_slots = PTHREAD_COND_INITIALIZER;
-static struct ph_table *sched_req_table;
+/*
+ * Tracked requests are spread over shards by identifier, each one a ptrhash
+ * table with its own lock. A shard is rehashed into a larger table (or into
+ * one of the same size to drop tombstones) when 3/4 of its buckets are used,
+ * so the table grows online and only stalls the requests of that shard.
+ */
+struct sched_req_shard {
+    pthread_mutex_t lock;
+    struct ph_table *table;
+} __attribute__((aligned(64)));
+
+static struct sched_req_shard sched_req_table[SCHED_REQ_SHARDS];
+
+/*
+ * Per-request objects come from slab pools, so steady-state scheduling does
+ * not go through the heap. The argument arrays of a request are allocated
+ * together and sized for the largest EXE message.
+ */
+struct sched_req_args {
+    sched_rdata *resdata[MCL_RES_ARGS_MAX];
+    mcl_partition_t regions[MCL_RES_ARGS_MAX];
+};
+
+static struct slab_pool sched_args_pool;
+static struct slab_pool sched_dep_pool;
+static struct slab_pool sched_process_pool;
 
 static const char *socket_name = NULL;
 static const char *shared_mem_name = NULL;
@@ -59,10 +97,20 @@ static const char *shared_mem_name = NULL;
 void resource_list(mcl_resource_t *res, uint64_t n);
 #endif
 
-static inline int srv_msg_send(struct mcl_msg_struct *msg, struct sockaddr_un *dst) {
+static inline int srv_msg_send(struct mcl_msg_struct *msg, struct mcl_client_struct *dst) {
     int ret;
 
-    while (((ret = msg_send(msg, sock_fd, dst)) > 0)) {
+    if (dst->ring) {
+        while (((ret = msg_ring_send(msg, dst->ring)) > 0))
+            sched_yield();
+
+        if (!ret)
+            ret = msg_ring_doorbell(dst->ring, sock_fd, &dst->addr);
+
+        return ret;
+    }
+
+    while (((ret = msg_send(msg, sock_fd, &dst->addr)) > 0)) {
         Dprintf("Tried to send message, but recieved error: %d", ret);
         sched_yield();
     }
@@ -70,21 +118,214 @@ static inline int srv_msg_send(struct mcl_msg_struct *msg, struct sockaddr_un *d
     return ret;
 }
 
-static inline int srv_msg_recv(struct mcl_msg_struct *msg) {
-    struct sockaddr_un src;
-    int ret;
+static inline int srv_msg_flush(struct mcl_msg_struct *msgs, struct sockaddr_un *addr, int n) {
+    int sent, ret;
 
-    ret = msg_recv(msg, sock_fd, &src);
+    for (sent = 0; sent < n; sent += ret) {
+        ret = msg_send_batch(msgs + sent, n - sent, sock_fd, addr + sent);
+        if (ret < 0)
+            return -1;
+        if (ret == 0)
+            sched_yield();
+    }
 
-    if (ret)
-        return ret;
+    return 0;
+}
+
+/*
+ * Send msgs[i] to dst[i]. Messages for clients using the socket are batched
+ * in a single system call, messages for clients using rings are pushed directly.
+ */
+static inline int srv_msg_send_batch(struct mcl_msg_struct *msgs, struct mcl_client_struct **dst, int n) {
+    struct mcl_msg_struct out[MCL_MSG_BATCH];
+    struct sockaddr_un addr[MCL_MSG_BATCH];
+    int i, nout = 0;
+
+    for (i = 0; i < n; i++) {
+        if (dst[i]->ring) {
+            if (srv_msg_send(&msgs[i], dst[i]))
+                return -1;
+            continue;
+        }
+
+        out[nout] = msgs[i];
+        addr[nout] = dst[i]->addr;
+        if (++nout == MCL_MSG_BATCH) {
+            if (srv_msg_flush(out, addr, nout))
+                return -1;
+            nout = 0;
+        }
+    }
+
+    return nout ? srv_msg_flush(out, addr, nout) : 0;
+}
 
-    if (!(msg->pid = (uint64_t)cli_get_pid(src.sun_path))) {
-        eprintf("Error extracting source PID");
+/* Ring client the next srv_msg_recv_batch() starts from, NULL for the first one */
+static struct mcl_client_struct *srv_ring_next = NULL;
+
+/*
+ * Drain up to n messages: first from the socket, then from the rings of the
+ * clients that registered with the shared memory transport. The rings are
+ * polled round robin, starting after the client that filled the last batch,
+ * so a busy client does not starve the others.
+ * Return the number of messages received or -1 on error.
+ */
+static inline int srv_msg_recv_batch(struct mcl_msg_struct *msgs, int n) {
+    struct sockaddr_un src[MCL_MSG_BATCH];
+    struct mcl_client_struct *el, *start;
+    int i, count, ret = 0;
+
+    count = msg_recv_batch(msgs, n, sock_fd, src);
+    if (count < 0)
         return -1;
+
+    for (i = 0; i < count; i++) {
+        if (!(msgs[i].pid = (uint64_t)cli_get_pid(src[i].sun_path))) {
+            eprintf("Error extracting source PID");
+            msgs[i--] = msgs[--count];
+        }
+    }
+
+    start = srv_ring_next ? srv_ring_next : mcl_clist;
+    for (el = start; el && count < n;) {
+        if (el->ring) {
+            while (count < n && !(ret = msg_ring_recv(&msgs[count], el->ring)))
+                msgs[count++].pid = el->pid;
+
+            if (ret < 0)
+                eprintf("Error receiving message from client %d", el->pid);
+        }
+
+        el = el->next ? el->next : mcl_clist;
+        if (el == start)
+            break;
+    }
+
+    /* After a full round start from the next client anyway */
+    if (el == start && start && count < n)
+        el = start->next ? start->next : mcl_clist;
+    srv_ring_next = el;
+
+    return count;
+}
+
+/*
+ * Called by the receiver before going to sleep, so that ring clients ring the
+ * doorbell on the socket. Return 1 if there is something left in the rings.
+ */
+static inline int srv_rings_park(void) {
+    struct mcl_client_struct *el;
+    int pending = 0;
+
+    DL_FOREACH(mcl_clist, el) {
+        if (el->ring) {
+            msg_ring_park(el->ring);
+            pending |= msg_ring_pending(el->ring);
+        }
+    }
+
+    return pending;
+}
+
+static inline void srv_rings_unpark(void) {
+    struct mcl_client_struct *el;
+
+    DL_FOREACH(mcl_clist, el) {
+        if (el->ring)
+            msg_ring_unpark(el->ring);
+    }
+}
+
+/*
+ * Clients are added and removed by the receiver thread, which can use them
+ * freely. Scheduling threads look them up with sched_client_get(), which
+ * takes a reference, and give it back with sched_client_put() once they are
+ * done sending: a client that ended is freed, with its rings, when the last
+ * reference goes away.
+ */
+static pthread_rwlock_t sched_clist_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static inline struct mcl_client_struct *sched_client_get(pid_t pid) {
+    struct mcl_client_struct *cli;
+
+    pthread_rwlock_rdlock(&sched_clist_lock);
+    if ((cli = cli_search(&mcl_clist, pid)))
+        ainc(&cli->refs);
+    pthread_rwlock_unlock(&sched_clist_lock);
+
+    return cli;
+}
+
+static inline void sched_client_put(struct mcl_client_struct *cli) {
+    if (adec(&cli->refs) != 1)
+        return;
+
+    if (cli->ring) {
+        msg_ring_close(cli->ring);
+        free(cli->ring);
+    }
+    free(cli);
+}
+
+/*
+ * srv_msg_send_batch() to clients taken with sched_client_get(), the
+ * references are given back.
+ */
+static inline int srv_msg_send_put(struct mcl_msg_struct *msgs, struct mcl_client_struct **dst, int n) {
+    int ret = srv_msg_send_batch(msgs, dst, n);
+
+    for (int i = 0; i < n; i++)
+        sched_client_put(dst[i]);
+
+    return ret;
+}
+
+void sched_wakeup(void) {
+    for (uint64_t i = 0; i < sched_nthreads; i++)
+        msg_event_notify(&sched_evs[i]);
+}
+
+static void sched_rdata_destroy(sched_rdata *el) {
+    process_t *p, *tmp;
+
+    DL_FOREACH_SAFE(el->processes, p, tmp) {
+        DL_DELETE(el->processes, p);
+        slab_free(&sched_process_pool, p);
     }
+    free(el->enodes);
+    free(el);
+}
+
+void sched_request_free_args(sched_req_t *r) {
+    /* resdata is the first field of struct sched_req_args */
+    slab_free(&sched_args_pool, r->resdata);
+    r->resdata = NULL;
+    r->regions = NULL;
+}
+
+static int sched_pools_init(void) {
+    if (slab_init(&sched_args_pool, sizeof(struct sched_req_args)))
+        return -1;
+
+    if (slab_init(&sched_dep_pool, sizeof(dep_list)))
+        goto err_args;
+
+    if (slab_init(&sched_process_pool, sizeof(process_t)))
+        goto err_dep;
 
     return 0;
+
+err_dep:
+    slab_fini(&sched_dep_pool);
+err_args:
+    slab_fini(&sched_args_pool);
+    return -1;
+}
+
+static void sched_pools_fini(void) {
+    slab_fini(&sched_process_pool);
+    slab_fini(&sched_dep_pool);
+    slab_fini(&sched_args_pool);
 }
 
 int default_assign_resource(sched_req_t *r) {
@@ -97,6 +338,7 @@ int default_assign_resource(sched_req_t *r) {
     res = mcl_res + r->dev;
 
     uint64_t res_mem = 0;
+    pthread_rwlock_wrlock(&sched_rdata_mlock);
     for (int i = 0; i < r->nresident; i++) {
         if (sched_rdata_add_device(r->resdata[i], r->dev))
             res_mem += r->resdata[i]->size;
@@ -137,6 +379,7 @@ int default_assign_resource(sched_req_t *r) {
             Dprintf("\t\t Allocated exclusive memory to the correct device, devs: 0x%016" PRIx64 "", r->resdata[i]->devs);
         }
     }
+    pthread_rwlock_unlock(&sched_rdata_mlock);
 
     int64_t needed_mem = r->mem - res_mem;
     Dprintf("Needed Mem: %" PRId64 ", Task Mem: %" PRIu64 ", Resident Mem: %" PRIu64 ", Num Res: %" PRIu64 ", Avail Mem: %" PRIu64 "", needed_mem, r->mem, res_mem, r->nresident, res->mem_avail);
@@ -185,10 +428,8 @@ int default_put_resource(sched_req_t *r) {
         uint64_t refs = adec(&(r->resdata[i]->refs)) - 1;
         eviction_policy_released(&r->resdata[i]->enodes[r->dev]);
         mem_freed -= r->resdata[i]->size;
-        if (!(r->resdata[i]->valid) && refs == 0) {
-            free(r->resdata[i]->enodes);
-            free(r->resdata[i]);
-        }
+        if (!(r->resdata[i]->valid) && refs == 0)
+            sched_rdata_destroy(r->resdata[i]);
     }
     Dprintf("Task Mem: %" PRIu64 ", Mem Freed: %" PRIu64 ", Num Resident: %" PRIu64 "", r->mem, mem_freed, r->nresident);
 
@@ -240,7 +481,9 @@ int scheduler_evict_mem(int dev) {
     sched_rdata *mem = enode_to_free->mem_data;
 
     dev = enode_to_free->dev;
+    pthread_rwlock_wrlock(&sched_rdata_mlock);
     sched_rdata_rm_device(mem, dev);
+    pthread_rwlock_unlock(&sched_rdata_mlock);
     Dprintf("Evicting memory %" PRIu64 " from device %d, size: %" PRIu64 "", mem->mem_id, dev, mem->size);
 
     mcl_resource_t *res = mcl_res + dev;
@@ -256,151 +499,493 @@ int scheduler_evict_mem(int dev) {
     msg_init(&msg);
     msg.cmd = MSG_CMD_FREE;
     msg.nres = 1;
-    msg.resdata = malloc(sizeof(msg_arg_t));
-    msg.resdata->mem_id = mem->mem_id;
-    msg.resdata->mem_size = mem->size;
+    msg.resdata[0].mem_id = mem->mem_id;
+    msg.resdata[0].mem_size = mem->size;
     msg.res = dev;
 
-    int error = 0;
+    struct mcl_msg_struct msgs[MCL_MSG_BATCH];
+    struct mcl_client_struct *dsts[MCL_MSG_BATCH];
+    int error = 0, n = 0;
     process_t *el;
     DL_FOREACH(mem->processes, el) {
-        dst = cli_search(&mcl_clist, el->pid);
-        if (srv_msg_send(&msg, &(dst->addr))) {
-            eprintf("Error sending FREE to client %d", el->pid);
-            error = -1;
+        if (!(dst = sched_client_get(el->pid)))
+            continue;
+
+        msgs[n] = msg;
+        dsts[n++] = dst;
+        if (n < MCL_MSG_BATCH && el->next)
+            continue;
+
+        error = srv_msg_send_put(msgs, dsts, n);
+        if (error) {
+            eprintf("Error sending FREE to %d clients", n);
+            n = 0;
             break;
         }
+        n = 0;
+    }
+
+    if (n && srv_msg_send_put(msgs, dsts, n)) {
+        eprintf("Error sending FREE to %d clients", n);
+        error = -1;
     }
 
-    msg_free(&msg);
     return error;
     ;
 }
 
-static inline int sched_run(sched_req_t *r) {
-    struct mcl_msg_struct ack;
+/*
+ * Number of requests a client may have outstanding: an even share of what the
+ * receive buffer holds, bounded by the ring size for clients that use rings.
+ */
+static inline uint64_t sched_credits(mcl_ring_t *ring) {
+    uint64_t nclients = __atomic_load_n(&mcl_sched_desc.nclients, __ATOMIC_RELAXED);
+    uint64_t credits = mcl_sched_desc.credits / (nclients ? nclients : 1);
+
+    if (ring && credits > MCL_RING_SLOTS)
+        credits = MCL_RING_SLOTS;
+
+    return credits < MCL_CREDITS_MIN ? MCL_CREDITS_MIN : credits;
+}
+
+/*
+ * The ACKs of the requests placed by a scheduling thread are gathered during
+ * a scheduling round and sent together, one message per client: an ACKS
+ * message with (rid, device) pairs, or a plain ACK if the client has a single
+ * request in the round. A round ends when MCL_ACKS_MAX requests are pending,
+ * when the scheduling class has nothing to place, or when it is about to wait
+ * for a completion (sched_wait).
+ */
+struct sched_ack {
+    pid_t pid;
+    uint64_t rid;
+    uint64_t dev;
+};
+
+static __thread struct sched_ack sched_acks[MCL_ACKS_MAX];
+static __thread int sched_nacks;
+
+static int sched_acks_flush(void) {
+    struct mcl_msg_struct msgs[MCL_ACKS_MAX];
+    struct mcl_client_struct *dsts[MCL_ACKS_MAX];
     struct mcl_client_struct *dst;
+    uint8_t sent[MCL_ACKS_MAX];
+    int i, j, n = 0, ret = 0;
 
-    dst = cli_search(&mcl_clist, r->key.pid);
-    if (!dst) {
-        eprintf("Client %d not registered.", r->key.pid);
-        goto err;
+    memset(sent, 0, sizeof(sent));
+    for (i = 0; i < sched_nacks; i++) {
+        if (sent[i])
+            continue;
+
+        dst = sched_client_get(sched_acks[i].pid);
+        if (!dst) {
+            eprintf("Client %d not registered.", sched_acks[i].pid);
+            ret = -1;
+            continue;
+        }
+
+        msg_init(&msgs[n]);
+        msgs[n].pid = sched_acks[i].pid;
+        msgs[n].credits = sched_credits(dst->ring);
+        for (j = i; j < sched_nacks; j++) {
+            if (sent[j] || sched_acks[j].pid != sched_acks[i].pid)
+                continue;
+            msgs[n].acks[msgs[n].nacks].rid = sched_acks[j].rid;
+            msgs[n].acks[msgs[n].nacks].res = sched_acks[j].dev;
+            msgs[n].nacks++;
+            sent[j] = 1;
+        }
+
+        if (msgs[n].nacks == 1) {
+            msgs[n].cmd = MSG_CMD_ACK;
+            msgs[n].rid = msgs[n].acks[0].rid;
+            msgs[n].res = msgs[n].acks[0].res;
+            msgs[n].nacks = 0;
+        }
+        else
+            msgs[n].cmd = MSG_CMD_ACKS;
+        dsts[n++] = dst;
     }
+    sched_nacks = 0;
 
-    msg_init(&ack);
-    ack.cmd = MSG_CMD_ACK;
-    ack.rid = r->key.rid;
-    ack.pid = r->key.pid;
-    ack.res = r->dev;
+    if (n && srv_msg_send_put(msgs, dsts, n)) {
+        eprintf("Error sending ACKs to %d clients", n);
+        ret = -1;
+    }
 
-    if (srv_msg_send(&ack, &(dst->addr))) {
-        eprintf("Error sending ACK to client %d", ack.pid);
-        msg_free(&ack);
-        goto err;
+    return ret;
+}
+
+static inline int sched_run(sched_req_t *r) {
+    sched_acks[sched_nacks].pid = r->key.pid;
+    sched_acks[sched_nacks].rid = r->key.rid;
+    sched_acks[sched_nacks].dev = r->dev;
+
+    if (++sched_nacks == MCL_ACKS_MAX)
+        return sched_acks_flush();
+
+    return 0;
+}
+
+/*
+ * Scheduling classes wait for completions here. Pending ACKs are sent first,
+ * the requests they place may be the ones that have to complete, so in that
+ * case the caller is woken up right away and checks again.
+ */
+void sched_wait(pthread_cond_t *cond, pthread_mutex_t *lock) {
+    if (sched_nacks) {
+        pthread_mutex_unlock(lock);
+        sched_acks_flush();
+        pthread_mutex_lock(lock);
+        return;
+    }
+
+    pthread_cond_wait(cond, lock);
+}
+
+/*
+ * Run the resource policy on r, the head of a class queue, with the queue
+ * lock (held on entry and on return) released, so that a thread evicting data
+ * for its devices does not hold up the threads of the other devices. Only one
+ * thread looks at a request at a time, the others wait on cond for it.
+ *
+ * The class bumps *gen and broadcasts cond, with lock held, whenever the head
+ * changes or resources are released. A thread that found no room waits for
+ * that. Return the device found, or a negative value if the caller has to
+ * look at the head again. The caller must check that r is still the head
+ * before taking it.
+ */
+int sched_find_head(sched_req_t *r, pthread_mutex_t *lock, pthread_cond_t *cond, uint64_t *gen) {
+    uint64_t seen = *gen;
+    int dev;
+
+    if (r->picking) {
+        sched_wait(cond, lock);
+        return MCL_SCHED_AGAIN;
+    }
+
+    r->picking = 1;
+    pthread_mutex_unlock(lock);
+    dev = sched_curr->respol->find_resource(r);
+    pthread_mutex_lock(lock);
+    r->picking = 0;
+    /* Let the threads waiting for r look at it */
+    pthread_cond_broadcast(cond);
+
+    if (dev == MCL_SCHED_BLOCK) {
+        while (*gen == seen)
+            sched_wait(cond, lock);
+    }
+    else if (dev == MCL_SCHED_AGAIN) {
+        pthread_mutex_unlock(lock);
+        sched_yield();
+        pthread_mutex_lock(lock);
+    }
+
+    return dev;
+}
+
+static inline struct sched_req_shard *sched_request_shard(const void *key) {
+    const uint64_t *id = key;
+
+    return &sched_req_table[(id[1] ^ (id[0] * 0x9e3779b97f4a7c15ULL)) & (SCHED_REQ_SHARDS - 1)];
+}
+
+static int sched_request_table_init(void) {
+    int i;
+
+    for (i = 0; i < SCHED_REQ_SHARDS; i++) {
+        pthread_mutex_init(&sched_req_table[i].lock, NULL);
+        sched_req_table[i].table = ph_init(1u << SCHED_REQ_SHARD_SIZE_SHIFT);
+        if (!sched_req_table[i].table)
+            goto err;
     }
 
-    msg_free(&ack);
     return 0;
 
 err:
+    while (i--)
+        free(sched_req_table[i].table);
     return -1;
 }
 
+static void sched_request_table_fini(void) {
+    for (int i = 0; i < SCHED_REQ_SHARDS; i++) {
+        free(sched_req_table[i].table);
+        sched_req_table[i].table = NULL;
+        pthread_mutex_destroy(&sched_req_table[i].lock);
+    }
+}
+
 static inline int sched_request_track(sched_req_t *r) {
+    struct sched_req_shard *shard = sched_request_shard(&r->key);
+    struct ph_table *t;
+    size_t size;
     int ret;
-    pthread_mutex_lock(&sched_req_lock);
-    while ((ret = ph_add(sched_req_table, r, key)) < 0) {
-        /* table full */
-        eprintf("Table full, unable to insert req.\n");
-        pthread_cond_wait(&sched_req_has_slots, &sched_req_lock);
-    }
 
-    /* here request can be either inserted or refused because duplicate */
-    pthread_mutex_unlock(&sched_req_lock);
+    pthread_mutex_lock(&shard->lock);
+    size = shard->table->mask + 1;
+    if (ph_used(shard->table) >= size - (size >> 2)) {
+        if (ph_count(shard->table) >= size >> 1)
+            size <<= 1;
+        if ((t = ph_resize(shard->table, size, sched_req_t, key)))
+            shard->table = t;
+        else
+            eprintf("Unable to resize request table shard to %zu entries.", size);
+    }
+    ret = ph_add(shard->table, r, key);
+    pthread_mutex_unlock(&shard->lock);
 
     return ret;
 }
 
 static inline sched_req_t *sched_request_get(const void *key) {
+    struct sched_req_shard *shard = sched_request_shard(key);
     sched_req_t *r;
 
-    pthread_mutex_lock(&sched_req_lock);
-    ph_get(sched_req_table, key, key, r);
-    if (r) {
-        /* signal waiters */
-        pthread_cond_signal(&sched_req_has_slots);
-    }
-    pthread_mutex_unlock(&sched_req_lock);
+    pthread_mutex_lock(&shard->lock);
+    ph_get(shard->table, key, key, r);
+    pthread_mutex_unlock(&shard->lock);
 
     return r;
 }
 
 static inline sched_req_t *sched_request_untrack(const void *key) {
+    struct sched_req_shard *shard = sched_request_shard(key);
     sched_req_t *r;
 
-    pthread_mutex_lock(&sched_req_lock);
-    ph_remove(sched_req_table, key, key, r);
-    if (r) {
-        /* signal waiters */
-        pthread_cond_signal(&sched_req_has_slots);
-    }
-    pthread_mutex_unlock(&sched_req_lock);
+    pthread_mutex_lock(&shard->lock);
+    ph_remove(shard->table, key, key, r);
+    pthread_mutex_unlock(&shard->lock);
 
     return r;
 }
 
-static inline int am_exe(mcl_msg msg) {
+/*
+ * Add the dependencies carried by msg to r, r->dependent_lock must be held.
+ */
+static inline void sched_request_add_deps(sched_req_t *r, mcl_msg *msg) {
+    for (int i = 0; i < msg->ndependencies; i++) {
+        struct identifier id;
+        sched_req_t *dep;
+
+        id.pid = msg->pid;
+        id.rid = msg->dependencies[i];
+        dep = sched_request_get(&id);
+        if (!dep)
+            continue;
+
+        pthread_mutex_lock(&dep->dependent_lock);
+        if (dep->status != SCHED_REQ_DONE) {
+            dep_list *this = slab_alloc(&sched_dep_pool);
+            if (!this) {
+                eprintf("Error allocating dependency of (%d,%" PRIu64 ") on %" PRIu64 "",
+                        r->key.pid, r->key.rid, id.rid);
+                pthread_mutex_unlock(&dep->dependent_lock);
+                continue;
+            }
+            this->r = r;
+            LL_APPEND(dep->dependents, this);
+            if (sched_depend(r, dep))
+                Dprintf("Scheduling class did not record dependency of (%d,%" PRIu64 ") on %" PRIu64 "",
+                        r->key.pid, r->key.rid, id.rid);
+            if (dep->status <= SCHED_REQ_SCHED_READY)
+                r->dependencies_waiting += 1;
+            else if (dep->status == SCHED_REQ_EXEC_READY)
+                r->dependencies_execing += 1;
+        }
+        pthread_mutex_unlock(&dep->dependent_lock);
+    }
+}
+
+/*
+ * Enqueue r if none of its dependencies is waiting, r->dependent_lock must be held.
+ */
+static inline void sched_request_release(sched_req_t *r) {
+    if (r->dependencies_waiting == 0 && r->dependencies_execing == 0) {
+        r->status = SCHED_REQ_EXEC_READY;
+        sched_enqueue(r);
+    }
+    else if (r->dependencies_waiting == 0) {
+        r->status = SCHED_REQ_SCHED_READY;
+        sched_enqueue(r);
+    }
+    else
+        r->status = SCHED_REQ_WAIT;
+}
+
+/*
+ * Admission control. A client may have at most max_reqs requests and max_mem
+ * bytes of request memory accepted and not completed, the limits are granted
+ * to the client when it registers so that it holds its requests back instead
+ * of sending them. A request over a limit is refused with a BUSY reply and the
+ * client sends it again later. A client with nothing outstanding is always
+ * admitted, so a request larger than max_mem can still run.
+ *
+ * Once a request is refused, the requests of the client are accepted again
+ * only in the order they were refused: later requests may depend on a refused
+ * one, and a dependency the scheduler does not know is taken as completed.
+ * Every request that arrives while refused ones are pending is refused too,
+ * except the first of them. The client sends refused requests again in the
+ * order it submitted them.
+ *
+ * The counters are only updated by the receiver thread.
+ */
+static inline int sched_admit(struct mcl_client_struct *cli, uint64_t mem) {
+    if (mcl_sched_desc.max_reqs && cli->nreqs >= mcl_sched_desc.max_reqs)
+        return -1;
+    if (mcl_sched_desc.max_mem && cli->nreqs && cli->mem + mem > mcl_sched_desc.max_mem)
+        return -1;
+
+    cli->nreqs++;
+    cli->mem += mem;
+
+    return 0;
+}
+
+static inline void sched_admit_release(pid_t pid, uint64_t mem) {
+    struct mcl_client_struct *cli = cli_search(&mcl_clist, pid);
+
+    if (!cli || !cli->nreqs)
+        return;
+
+    cli->nreqs--;
+    cli->mem = cli->mem > mem ? cli->mem - mem : 0;
+}
+
+static inline mcl_refused_t *sched_refused(struct mcl_client_struct *cli, uint64_t rid) {
+    mcl_refused_t *el;
+
+    LL_SEARCH_SCALAR(cli->refused, el, rid, rid);
+
+    return el;
+}
+
+static inline int sched_busy(struct mcl_client_struct *cli, mcl_msg *msg) {
+    struct mcl_msg_struct reply;
+    mcl_refused_t *el;
+
+    if (!sched_refused(cli, msg->rid)) {
+        if ((el = malloc(sizeof(mcl_refused_t)))) {
+            el->rid = msg->rid;
+            LL_APPEND(cli->refused, el);
+        }
+        else
+            eprintf("Error recording refused request (%d,%" PRIu64 ")", msg->pid, msg->rid);
+    }
+
+    Dprintf("Refusing request (%d,%" PRIu64 "): %" PRIu64 " requests and %" PRIu64 " bytes outstanding",
+            msg->pid, msg->rid, cli->nreqs, cli->mem);
+
+    msg_init(&reply);
+    reply.cmd = MSG_CMD_BUSY;
+    reply.rid = msg->rid;
+    reply.pid = msg->pid;
+    reply.credits = sched_credits(cli->ring);
+
+    if (srv_msg_send(&reply, cli)) {
+        eprintf("Error sending BUSY to client %d", msg->pid);
+        return -1;
+    }
+
+    return 0;
+}
+
+static inline int am_exe(mcl_msg *msg) {
+    struct mcl_client_struct *cli;
     sched_req_t *r = NULL;
+    uint64_t mem = msg->mem * MCL_PAGE_SIZE;
+    int ret;
+
+    cli = cli_search(&mcl_clist, msg->pid);
+    if (!cli) {
+        eprintf("Request (%d,%" PRIu64 ") from unregistered client", msg->pid, msg->rid);
+        goto err;
+    }
+
+    if ((cli->refused && cli->refused->rid != msg->rid) || sched_admit(cli, mem))
+        return sched_busy(cli, msg);
 
     r = sched_alloc_request();
     if (!r) {
         eprintf("Error creating new request for (%d,%" PRIu64 ") ",
-                msg.pid, msg.rid);
-        goto err;
+                msg->pid, msg->rid);
+        goto err_admit;
     }
 
-    r->key.pid = msg.pid;
-    r->pes = msg.pes;
-    r->mem = msg.mem * MCL_PAGE_SIZE;
-    r->key.rid = msg.rid;
-    r->flags = msg.flags << MCL_TASK_FLAG_SHIFT;
-    r->type = msg.type;
+    r->key.pid = msg->pid;
+    r->pes = msg->pes;
+    r->mem = mem;
+    r->key.rid = msg->rid;
+    r->flags = (msg->flags << MCL_TASK_FLAG_SHIFT) & MCL_TASK_FLAG_MASK;
+    r->prio = (msg->flags & MSG_FLAG_PRIO_MASK) >> MSG_FLAG_PRIO_SHIFT;
+    r->deadline = msg->deadline;
+    r->type = msg->type;
     r->status = 0x0;
     r->num_attempts = 0;
+    r->picking = 0;
 
     for (int i = 0; i < MCL_DEV_DIMS; i++) {
-        r->dpes[i] = msg.pesdata.pes[i];
-        r->lpes[i] = msg.pesdata.lpes[i];
+        r->dpes[i] = msg->pesdata.pes[i];
+        r->lpes[i] = msg->pesdata.lpes[i];
     }
 
-    r->nresident = msg.nres;
-    r->task_id = msg.taskid;
+    r->nresident = msg->nres;
+    r->task_id = msg->taskid;
     r->policy_data = NULL;
-    r->resdata = (sched_rdata **)malloc(sizeof(sched_rdata *) * msg.nres);
-    if (!r->resdata) {
-        eprintf("Error allocating memory for new request (%d,%" PRIu64 ") ",
-                msg.pid, msg.rid);
+    r->resdata = NULL;
+    r->regions = NULL;
+
+    /*
+     * Track the request before dependencies and resident data refer to it, a
+     * request that cannot be tracked is released without undoing anything.
+     * Requests are only looked up by the receiver thread, nobody finds it
+     * before am_exe returns.
+     */
+    ret = sched_request_track(r);
+    if (ret > 0) {
+        eprintf("schedule: duplicate request, discard => (%d, %" PRIu64 ")\n",
+                msg->pid, msg->rid);
+        sched_release_request(r);
+        sched_admit_release(msg->pid, mem);
+        return -1;
+    }
+    else if (ret < 0) {
+        eprintf("schedule: request table full, refuse => (%d, %" PRIu64 ")\n",
+                msg->pid, msg->rid);
+        sched_release_request(r);
+        sched_admit_release(msg->pid, mem);
+        return sched_busy(cli, msg);
     }
 
-    r->regions = (mcl_partition_t *)malloc(sizeof(mcl_partition_t) * msg.nres);
-    if (!r->regions) {
-        eprintf("Error allocating memory for new request (%d,%" PRIu64 ") ",
-                msg.pid, msg.rid);
+    if (msg->nres) {
+        struct sched_req_args *args = slab_alloc(&sched_args_pool);
+
+        if (!args) {
+            eprintf("Error allocating memory for new request (%d,%" PRIu64 ") ",
+                    msg->pid, msg->rid);
+            sched_request_untrack(&r->key);
+            sched_release_request(r);
+            goto err_admit;
+        }
+        r->resdata = args->resdata;
+        r->regions = args->regions;
     }
 
-    Dprintf("Number of resident arguments: %" PRIu64 ".", msg.nres);
-    for (uint64_t i = 0; i < msg.nres; i++) {
+    Dprintf("Number of resident arguments: %" PRIu64 ".", msg->nres);
+    for (uint64_t i = 0; i < msg->nres; i++) {
         sched_rdata *el;
-        pid_t pid = msg.resdata[i].flags & MSG_ARGFLAG_SHARED ? msg.resdata[i].pid : r->key.pid;
-        if (!(el = sched_rdata_get(msg.resdata[i].mem_id, pid))) {
+        pid_t pid = msg->resdata[i].flags & MSG_ARGFLAG_SHARED ? msg->resdata[i].pid : r->key.pid;
+        uint64_t unit = msg->resdata[i].flags & MSG_ARGFLAG_WIDE ? 1 : MCL_MEM_PAGE_SIZE;
+        if (!(el = sched_rdata_get(msg->resdata[i].mem_id, pid))) {
             Dprintf("Could not find resident memory in scheduler.");
             el = malloc(sizeof(sched_rdata));
             el->key[0] = 0;
             el->key[1] = 0;
-            el->mem_id = msg.resdata[i].mem_id;
+            el->mem_id = msg->resdata[i].mem_id;
             el->pid = pid;
-            el->size = (size_t)(msg.resdata[i].overall_size * MCL_MEM_PAGE_SIZE);
-            el->flags = msg.resdata[i].flags;
+            el->size = (size_t)(msg->resdata[i].overall_size * unit);
+            el->flags = msg->resdata[i].flags & ~MSG_ARGFLAG_WIDE;
             el->devs = 0;
             el->valid = 1;
             el->refs = 0;
@@ -422,24 +1007,25 @@ static inline int am_exe(mcl_msg msg) {
 
         ainc(&el->refs);
 
-        if (msg.resdata[i].flags & MSG_ARGFLAG_SHARED) {
-            process_t *process = malloc(sizeof(process_t));
-            process->pid = r->key.pid;
+        if (msg->resdata[i].flags & MSG_ARGFLAG_SHARED) {
+            process_t process = {.pid = r->key.pid};
             process_t *out = NULL;
-            DL_SEARCH(el->processes, out, process, process_cmp);
-            if (!out)
-                DL_APPEND(el->processes, process);
+            DL_SEARCH(el->processes, out, &process, process_cmp);
+            if (!out && (out = slab_alloc(&sched_process_pool))) {
+                out->pid = r->key.pid;
+                DL_APPEND(el->processes, out);
+            }
         }
 
         r->resdata[i] = el;
-        r->regions[i].size = (size_t)(msg.resdata[i].mem_size * MCL_MEM_PAGE_SIZE);
-        r->regions[i].offset = (off_t)(msg.resdata[i].mem_offset * MCL_MEM_PAGE_SIZE);
+        r->regions[i].size = (size_t)(msg->resdata[i].mem_size * unit);
+        r->regions[i].offset = (off_t)(msg->resdata[i].mem_offset * unit);
 
         Dprintf("For request (%d, %" PRIu64 ") arg %" PRIu64 ", found MEMID: %" PRIu64 ", REFs: %" PRIu64 ", NDEVS: %" PRIu64 " DEV: 0x%016" PRIx64 " SIZE: %" PRIu64 " OFFSET: %" PRIu64 "",
                 r->key.pid, r->key.rid, i, r->resdata[i]->mem_id, r->resdata[i]->refs, r->resdata[i]->ndevs, r->resdata[i]->devs, r->regions[i].size, r->regions[i].offset);
     }
 
-    Dprintf("Executing EXEC AM (RID=%" PRIu64 " PES=%" PRIu64 " (%" PRIu64 ") MEM=%" PRIu64 " (%" PRIu64 ") )...", r->key.rid, r->pes, msg.pes, r->mem, msg.mem);
+    Dprintf("Executing EXEC AM (RID=%" PRIu64 " PES=%" PRIu64 " (%" PRIu64 ") MEM=%" PRIu64 " (%" PRIu64 ") )...", r->key.rid, r->pes, msg->pes, r->mem, msg->mem);
 
     pthread_mutex_init(&r->dependent_lock, NULL);
     pthread_mutex_lock(&r->dependent_lock);
@@ -447,64 +1033,85 @@ static inline int am_exe(mcl_msg msg) {
     r->dependents = NULL;
     r->dependencies_execing = 0;
     r->dependencies_waiting = 0;
-    int exec_count = 0;
-    int wait_count = 0;
-    for (int i = 0; i < msg.ndependencies; i++) {
-        struct identifier id;
-        id.pid = msg.pid;
-        id.rid = msg.dependencies[i];
-        dep_list *dep = malloc(sizeof(dep_list));
-        dep->r = sched_request_get(&id);
-        if (!dep->r) {
-            free(dep);
-            continue;
-        }
+    sched_request_add_deps(r, msg);
 
-        pthread_mutex_lock(&dep->r->dependent_lock);
-        if (dep->r->status == SCHED_REQ_DONE)
-            free(dep);
-        else {
-            dep_list *this = malloc(sizeof(dep_list));
-            this->r = r;
-            LL_APPEND(dep->r->dependents, this);
-            if (dep->r->status <= SCHED_REQ_SCHED_READY) {
-                wait_count += 1;
-                r->dependencies_waiting += 1;
-            }
-            else if (dep->r->status == SCHED_REQ_EXEC_READY) {
-                exec_count += 1;
-                r->dependencies_execing += 1;
+    /*
+     * The remaining dependencies come in MSG_CMD_DEPS messages, hold the
+     * request as if it was waiting for one more dependency until the last one.
+     */
+    if (msg->flags & MSG_FLAG_MORE)
+        r->dependencies_waiting += 1;
+
+    sched_request_release(r);
+    pthread_mutex_unlock(&r->dependent_lock);
+
+    /* The first refused request is back, the next one may come */
+    if (cli->refused) {
+        mcl_refused_t *el = cli->refused;
+
+        LL_DELETE(cli->refused, el);
+        free(el);
+    }
+
+    return 0;
+
+err_admit:
+    sched_admit_release(msg->pid, mem);
+    sched_busy(cli, msg);
+err:
+    return -1;
+}
+
+/*
+ * A DEPS message with MSG_FLAG_ABORT means that the client could not send the
+ * rest of the dependencies and has failed the request. It is released with
+ * the dependencies it has, and the client answers MSG_CMD_ERR when it is
+ * scheduled, which frees it like any other failed request.
+ */
+static inline int am_deps(mcl_msg *msg) {
+    uint64_t key[2] = {msg->pid, msg->rid};
+    mcl_refused_t *el;
+    sched_req_t *r;
+
+    r = sched_request_get(key);
+    if (!r) {
+        struct mcl_client_struct *cli = cli_search(&mcl_clist, msg->pid);
+
+        /* The request was refused, the client sends its dependencies again with it */
+        if (cli && (el = sched_refused(cli, msg->rid))) {
+            Dprintf("Dependencies for refused request (%d,%" PRIu64 ")", msg->pid, msg->rid);
+            /* ...unless it gave up on it, then it never comes back */
+            if (msg->flags & MSG_FLAG_ABORT) {
+                LL_DELETE(cli->refused, el);
+                free(el);
             }
+            return 0;
         }
-        pthread_mutex_unlock(&dep->r->dependent_lock);
+        eprintf("Dependencies for unknown request (%d,%" PRIu64 ")", msg->pid, msg->rid);
+        return -1;
     }
 
-    int ret = sched_request_track(r);
+    Dprintf("Adding %" PRIu32 " dependencies to request (%d,%" PRIu64 ")",
+            msg->ndependencies, msg->pid, msg->rid);
 
-    if (ret > 0) {
-        eprintf("schedule: duplicate request, discard => (%d, %" PRIu64 ")\n",
-                msg.pid, msg.rid);
-        sched_release_request(r);
+    pthread_mutex_lock(&r->dependent_lock);
+    if (r->status != SCHED_REQ_WAIT) {
+        pthread_mutex_unlock(&r->dependent_lock);
+        eprintf("Request (%d,%" PRIu64 ") is not waiting for dependencies", msg->pid, msg->rid);
         return -1;
     }
 
-    if (wait_count == 0 && exec_count == 0) {
-        r->status = SCHED_REQ_EXEC_READY;
-        sched_enqueue(r);
-    }
-    else if (wait_count == 0) {
-        r->status = SCHED_REQ_SCHED_READY;
-        sched_enqueue(r);
-    }
+    if (msg->flags & MSG_FLAG_ABORT)
+        Dprintf("Request (%d,%" PRIu64 ") aborted by the client", msg->pid, msg->rid);
     else
-        r->status = SCHED_REQ_WAIT;
-
+        sched_request_add_deps(r, msg);
+    if (!(msg->flags & MSG_FLAG_MORE)) {
+        r->dependencies_waiting -= 1;
+        sched_request_release(r);
+    }
     pthread_mutex_unlock(&r->dependent_lock);
 
     return 0;
-
-err:
-    return -1;
 }
 
 static inline int update_dependencies(sched_req_t *r) {
@@ -536,20 +1143,24 @@ static inline int update_dependencies(sched_req_t *r) {
         else {
             pthread_mutex_unlock(&dep->dependent_lock);
         }
+        LL_DELETE(r->dependents, el);
+        slab_free(&sched_dep_pool, el);
     }
 
     return 0;
 }
 
-static inline int am_null(mcl_msg msg) {
+static inline int am_null(mcl_msg *msg) {
     Dprintf("Executing NULL AM...");
 
     return 0;
 }
 
-static inline int am_reg(mcl_msg msg) {
+static inline int am_reg(mcl_msg *msg) {
     struct mcl_client_struct *el;
     struct mcl_msg_struct ack;
+    mcl_ring_t *ring = NULL;
+    int ret;
 
     Dprintf("Executing REG AM...");
 
@@ -559,7 +1170,7 @@ static inline int am_reg(mcl_msg msg) {
         goto err;
     }
 
-    el->pid = msg.pid;
+    el->pid = msg->pid;
     el->flags = 0x0;
     el->status = CLI_ACTIVE;
     el->addr.sun_family = PF_UNIX;
@@ -571,44 +1182,114 @@ static inline int am_reg(mcl_msg msg) {
              client_format, (long)el->pid);
 
     el->start_cpu = num_threads;
-    el->num_threads = msg.threads;
-    num_threads += msg.threads;
-
-    if (cli_add(&mcl_clist, el)) {
+    el->num_threads = msg->threads;
+    num_threads += msg->threads;
+    el->weight = msg->weight ? msg->weight : MCL_WEIGHT_DFT;
+    if (el->weight > MCL_WEIGHT_MAX) {
+        iprintf("Client %d weight %" PRIu64 " clamped to %d", el->pid, el->weight, MCL_WEIGHT_MAX);
+        el->weight = MCL_WEIGHT_MAX;
+    }
+    el->ring = NULL;
+    el->nreqs = 0;
+    el->mem = 0;
+    el->refused = NULL;
+    el->refs = 1;
+
+    pthread_rwlock_wrlock(&sched_clist_lock);
+    ret = cli_add(&mcl_clist, el);
+    pthread_rwlock_unlock(&sched_clist_lock);
+    if (ret) {
         eprintf("Error adding new client.");
         goto err_el;
     }
 
+    if (sched_attach(el->pid, el->weight))
+        eprintf("Scheduler class unable to track client %d", el->pid);
+
     msg_init(&ack);
     ack.cmd = MSG_CMD_ACK;
-    ack.rid = msg.rid;
-    ack.pid = msg.pid;
+    ack.rid = msg->rid;
+    ack.pid = msg->pid;
     ack.res = el->start_cpu;
 
-    if (srv_msg_send(&ack, &(el->addr))) {
+    /* Resident argument sizes and offsets in bytes, see am_exe */
+    if (msg->flags & MSG_REGFLAG_WIDE)
+        ack.flags |= MSG_REGFLAG_WIDE;
+
+    /*
+     * The registration ACK always goes through the socket, the client switches
+     * to the rings only if the ACK confirms that we attached them.
+     */
+    if (msg->flags & MSG_REGFLAG_RING) {
+        ring = (mcl_ring_t *)malloc(sizeof(mcl_ring_t));
+        if (ring && !msg_ring_open(ring, el->pid)) {
+            ack.flags |= MSG_REGFLAG_RING;
+            Dprintf("Client %d attached through shared memory rings", el->pid);
+        }
+        else {
+            eprintf("Unable to attach rings of client %d, using socket", el->pid);
+            free(ring);
+            ring = NULL;
+        }
+    }
+
+    ack.credits = sched_credits(ring);
+    ack.max_reqs = mcl_sched_desc.max_reqs;
+    if (mcl_sched_desc.max_mem) {
+        ack.max_mem = (uint64_t)(mcl_sched_desc.max_mem / MCL_PAGE_SIZE);
+        ack.max_mem = ack.max_mem ? ack.max_mem : 1;
+    }
+
+    if (srv_msg_send(&ack, el)) {
         eprintf("Error sending ACK to client %d", ack.pid);
         goto err_send;
     }
-    msg_free(&ack);
+    el->ring = ring;
 
     return 0;
 
 err_send:
-    msg_free(&ack);
+    sched_detach(el->pid);
+    if (ring) {
+        msg_ring_close(ring);
+        free(ring);
+    }
+    pthread_rwlock_wrlock(&sched_clist_lock);
+    cli_remove(&mcl_clist, el->pid);
+    pthread_rwlock_unlock(&sched_clist_lock);
+    sched_client_put(el);
+    return -1;
+
 err_el:
     free(el);
 err:
     return -1;
 }
 
-static inline int am_end(mcl_msg msg) {
+static inline int am_end(mcl_msg *msg) {
     Dprintf("Executing END AM...");
 
 #ifdef _STATS
     sched_stats();
 #endif
 
-    cli_remove(&mcl_clist, msg.pid);
+    /* Scheduling threads may still be sending to the client, see sched_client_get */
+    pthread_rwlock_wrlock(&sched_clist_lock);
+    struct mcl_client_struct *cli = cli_remove(&mcl_clist, msg->pid);
+    pthread_rwlock_unlock(&sched_clist_lock);
+    if (cli == srv_ring_next)
+        srv_ring_next = NULL;
+    if (cli) {
+        mcl_refused_t *el, *tmp;
+
+        LL_FOREACH_SAFE(cli->refused, el, tmp) {
+            LL_DELETE(cli->refused, el);
+            free(el);
+        }
+        sched_client_put(cli);
+    }
+
+    sched_detach(msg->pid);
 
 #if defined _DEBUG || defined _TRACE
     uint64_t mem_now;
@@ -619,7 +1300,7 @@ static inline int am_end(mcl_msg msg) {
         eprintf("Error allocating memory.");
         return -1;
     }
-    sched_rdata_rm_pid(msg.pid, mem_freed, mcl_info->ndevs);
+    sched_rdata_rm_pid(msg->pid, mem_freed, mcl_info->ndevs);
 
     for (int i = 0; i < mcl_info->ndevs; i++, res++) {
 #if defined _DEBUG || defined _TRACE
@@ -638,26 +1319,31 @@ static inline int am_end(mcl_msg msg) {
     return 0;
 }
 
-static inline int am_done(mcl_msg msg) {
+static inline int am_done(mcl_msg *msg) {
     sched_req_t *r = NULL;
     /* FIXME: this could be endian dependent */
-    uint64_t key[2] = {msg.pid, msg.rid};
+    uint64_t key[2] = {msg->pid, msg->rid};
 
 #ifdef _DEBUG
-    if (msg.cmd == MSG_CMD_DONE)
-        Dprintf("Request (%d,%" PRIu64 ") completed successfully", msg.pid, msg.rid);
+    if (msg->cmd == MSG_CMD_DONE)
+        Dprintf("Request (%d,%" PRIu64 ") completed successfully", msg->pid, msg->rid);
     else
-        Dprintf("Request (%d,%" PRIu64 ") completed with errors", msg.pid, msg.rid);
+        Dprintf("Request (%d,%" PRIu64 ") completed with errors", msg->pid, msg->rid);
 #endif
 
     r = sched_request_untrack(key);
 
     if (!r) {
         eprintf("Error post-processing request (%d,%" PRIu64 ")",
-                msg.pid, msg.rid);
+                msg->pid, msg->rid);
         return -1;
     }
 
+    sched_admit_release(r->key.pid, r->mem);
+
+    if (msg->cmd == MSG_CMD_DONE && msg->runtime)
+        sched_model_update(r, msg->runtime);
+
     if (sched_put_resource(r) < 0)
         eprintf("  Unable to put resource for (%d, %" PRIu64 ")",
                 r->key.pid, r->key.rid);
@@ -671,7 +1357,7 @@ static inline int am_done(mcl_msg msg) {
     return 0;
 }
 
-int am_free(struct mcl_msg_struct msg) {
+int am_free(struct mcl_msg_struct *msg) {
     /* This is not ideal because in all other cases round robin deals with device memory*/
     mcl_resource_t *res;
     sched_rdata *el;
@@ -682,17 +1368,21 @@ int am_free(struct mcl_msg_struct msg) {
     uint64_t mem_now;
 #endif
 
-    Dprintf("Number of resources to free: %" PRIu64 "", msg.nres);
+    Dprintf("Number of resources to free: %" PRIu64 "", msg->nres);
 
-    for (i = 0; i < msg.nres; i++) {
-        el = sched_rdata_rm(msg.resdata[i].mem_id, msg.pid);
+    for (i = 0; i < msg->nres; i++) {
+        el = sched_rdata_rm(msg->resdata[i].mem_id, msg->pid);
         if (!el) {
             Dprintf("Could not find memory to free <%d, %" PRIu64 ">",
-                    msg.pid, msg.resdata[i].mem_id);
+                    msg->pid, msg->resdata[i].mem_id);
             continue;
         }
         res = mcl_res;
+        pthread_rwlock_wrlock(&sched_rdata_mlock);
         devs = el->devs;
+        el->devs = 0;
+        el->ndevs = 0;
+        pthread_rwlock_unlock(&sched_rdata_mlock);
         cur_dev = 0;
 
         while (devs) {
@@ -712,14 +1402,10 @@ int am_free(struct mcl_msg_struct msg) {
             res += 1;
             cur_dev += 1;
         }
-        el->devs = 0;
-        el->ndevs = 0;
         el->valid = 0;
 
-        if (ld_acq(&el->refs) == 0) {
-            free(el->enodes);
-            free(el);
-        }
+        if (ld_acq(&el->refs) == 0)
+            sched_rdata_destroy(el);
     }
 
     /* FIXME: Need a way to notify waiting scheduler...
@@ -729,8 +1415,8 @@ int am_free(struct mcl_msg_struct msg) {
     return 0;
 }
 
-int exec_am(struct mcl_msg_struct msg) {
-    switch (msg.cmd) {
+int exec_am(struct mcl_msg_struct *msg) {
+    switch (msg->cmd) {
     case MSG_CMD_NULL:
         if (am_null(msg))
             goto err;
@@ -759,53 +1445,130 @@ int exec_am(struct mcl_msg_struct msg) {
         if (am_done(msg))
             goto err;
         break;
+    case MSG_CMD_DEPS:
+        if (am_deps(msg))
+            goto err;
+        break;
+    case MSG_CMD_NEX:
+        /* Doorbell of a client using the shared memory rings */
+        break;
     default:
-        eprintf("Unrecognied AM 0x%" PRIx64 ".", msg.cmd);
+        eprintf("Unrecognied AM 0x%" PRIx64 ".", msg->cmd);
         return -1;
     }
 
     return 0;
 
 err:
-    eprintf("Error executing AM 0x%" PRIx64, msg.cmd);
+    eprintf("Error executing AM 0x%" PRIx64, msg->cmd);
     return -1;
 }
 
 void *receiver(void *data) {
-    struct mcl_msg_struct msg;
+    struct mcl_msg_struct msgs[MCL_MSG_BATCH];
+    int batch = msg_batch_size();
+    msg_poller_t poller;
+    uint64_t idle = 0;
+    int i, n;
 
     Dprintf("Schedule Receiver thread started.");
 
+    if (msg_poller_init(&poller, sock_fd, 0)) {
+        eprintf("Error setting up receiver poller.");
+        pthread_exit(0);
+    }
+
     while (!sched_done) {
-        if (srv_msg_recv(&msg) == 1) {
-            sched_yield();
+        n = srv_msg_recv_batch(msgs, batch);
+        if (n <= 0) {
+            if (msg_poll_idle(&idle)) {
+                if (!srv_rings_park() && !sched_done)
+                    msg_poller_wait(&poller);
+                srv_rings_unpark();
+            }
             continue;
         }
+        idle = 0;
 
-        if (exec_am(msg))
-            eprintf("Error executing AM");
+        for (i = 0; i < n; i++) {
+            if (exec_am(&msgs[i]))
+                eprintf("Error executing AM");
 
-        msg_free(&msg);
+        }
     }
 
+    msg_poller_fini(&poller);
     Dprintf("Schedule Receiver thread terminating...");
     pthread_exit(0);
 }
 
-int schedule(void) {
+static void *sched_thread(void *data) {
+    uint64_t id = (uint64_t)data;
+    msg_event_t *ev = &sched_evs[id];
     sched_req_t *r;
+    uint64_t idle = 0;
+
+    sched_devs = 0;
+    for (uint64_t i = id; i < mcl_info->ndevs && i < CL_MAX_DEVICES; i += sched_nthreads)
+        sched_devs |= ((uint64_t)0x01 << i);
+
+    Dprintf("Scheduling thread %" PRIu64 " owns devices 0x%016" PRIx64 "", id, sched_devs);
+
     while (!sched_done) {
         if ((r = sched_pick_next())) {
             Dprintf("Scheduling request %" PRIu64 " on resource %" PRIu64 "", r->key.rid, r->dev);
 
             sched_assign_resource(r);
             sched_run(r);
+            idle = 0;
+            continue;
+        }
+
+        if (sched_nacks)
+            sched_acks_flush();
+
+        if (msg_poll_idle(&idle)) {
+            msg_event_park(ev);
+            if (!sched_queue_len() && !sched_done)
+                msg_event_wait(ev);
+            else
+                msg_event_unpark(ev);
         }
-        else
-            sched_yield();
     }
 
-    return 0;
+    return NULL;
+}
+
+int schedule(void) {
+    pthread_t *tids = NULL;
+    uint64_t i, n = 1;
+    int ret = 0;
+
+    if (sched_nthreads > 1) {
+        tids = malloc(sizeof(pthread_t) * sched_nthreads);
+        if (!tids) {
+            eprintf("Error allocating scheduling threads.");
+            return -1;
+        }
+
+        for (; n < sched_nthreads; n++)
+            if (pthread_create(&tids[n], NULL, sched_thread, (void *)n)) {
+                eprintf("Error starting scheduling thread %" PRIu64 ".", n);
+                sched_done = 1;
+                sched_wakeup();
+                ret = -1;
+                break;
+            }
+    }
+
+    if (!ret)
+        sched_thread((void *)0);
+
+    for (i = 1; i < n; i++)
+        pthread_join(tids[i], NULL);
+    free(tids);
+
+    return ret;
 }
 
 int __setup(void) {
@@ -876,6 +1639,11 @@ int __setup(void) {
         goto err_res;
     }
 
+    if (sched_calibrate(mcl_res, mcl_info->ndevs)) {
+        eprintf("Error calibrating resources.");
+        goto err_res;
+    }
+
     mcl_sched_desc.nclients = 0;
 #ifdef _STATS
     mcl_sched_desc.nreqs = 0;
@@ -891,6 +1659,12 @@ int __setup(void) {
     Dprintf("Init DelaySched resource scheduling at %p.", &delay_policy);
     hybrid_policy.init(mcl_res, mcl_info->ndevs);
     Dprintf("Init HybridSched resource scheduling at %p.", &hybrid_policy);
+    lws_policy.init(mcl_res, mcl_info->ndevs);
+    Dprintf("Init Least-Work resource scheduling at %p.", &lws_policy);
+    eft_policy.init(mcl_res, mcl_info->ndevs);
+    Dprintf("Init Earliest-Finish-Time resource scheduling at %p.", &eft_policy);
+    xfer_policy.init(mcl_res, mcl_info->ndevs);
+    Dprintf("Init Transfer-Aware resource scheduling at %p.", &xfer_policy);
 
     Dprintf("MCL descriptor at %p size = 0x%lx.", mcl_info, sizeof(struct mcl_desc_struct));
 
@@ -929,6 +1703,24 @@ int __setup(void) {
         goto err_res;
     }
 
+    /* The kernel may not give us the buffer we asked for */
+    uint64_t rcvbuf = 0;
+    socklen_t rcvlen = sizeof(uint64_t);
+    if (getsockopt(sock_fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, &rcvlen) || !rcvbuf)
+        rcvbuf = mcl_info->rcvbuf;
+    mcl_sched_desc.credits = rcvbuf / MCL_MAX_MSG_SIZE;
+    Dprintf("Scheduler grants up to %" PRIu64 " outstanding requests", mcl_sched_desc.credits);
+
+    char *value;
+    mcl_sched_desc.max_reqs = MCL_CLIENT_MAX_REQS;
+    if ((value = getenv("MCL_SCHED_MAX_REQS")) != NULL)
+        mcl_sched_desc.max_reqs = strtoull(value, NULL, 10);
+    mcl_sched_desc.max_mem = 0;
+    if ((value = getenv("MCL_SCHED_MAX_MEM")) != NULL)
+        mcl_sched_desc.max_mem = strtoull(value, NULL, 10);
+    Dprintf("Clients may have up to %" PRIu64 " requests and %" PRIu64 " bytes outstanding (0 = unlimited)",
+            mcl_sched_desc.max_reqs, mcl_sched_desc.max_mem);
+
 #if _DEBUG
     uint64_t r = 0, s = 0;
     socklen_t len = sizeof(uint64_t);
@@ -966,6 +1758,25 @@ int __setup(void) {
         goto err_socket;
     }
 
+    if (sched_nthreads > mcl_info->ndevs)
+        sched_nthreads = mcl_info->ndevs ? mcl_info->ndevs : 1;
+
+    sched_evs = malloc(sizeof(msg_event_t) * sched_nthreads);
+    if (!sched_evs) {
+        eprintf("Error allocating scheduler wake up events.");
+        goto err_socket;
+    }
+
+    for (uint64_t i = 0; i < sched_nthreads; i++)
+        if (msg_event_init(&sched_evs[i])) {
+            eprintf("Error initializing scheduler wake up event.");
+            while (i--)
+                msg_event_fini(&sched_evs[i]);
+            free(sched_evs);
+            goto err_socket;
+        }
+    Dprintf("Using %" PRIu64 " scheduling threads", sched_nthreads);
+
     close(shm_fd);
 
     return 0;
@@ -974,6 +1785,7 @@ err_socket:
     close(sock_fd);
     unlink(socket_name);
 err_res:
+    msg_finit();
     free(mcl_res);
 err_mmap:
     munmap(mcl_info, MCL_SHM_SIZE);
@@ -991,6 +1803,11 @@ int __shutdown(void) {
     unlink(socket_name);
     Dprintf("Communicaiton socket removed.");
 
+    for (uint64_t i = 0; i < sched_nthreads; i++)
+        msg_event_fini(&sched_evs[i]);
+    free(sched_evs);
+    msg_finit();
+
     free(mcl_res);
 #if 0
 	//FIXME: clean up resource...
@@ -1020,6 +1837,7 @@ static void hdl(int sig) {
     while (sched_queue_len())
         ;
     sched_done = 1;
+    msg_poll_wakeup();
 }
 
 static int sched_set_class(const char *sc) {
@@ -1027,6 +1845,16 @@ static int sched_set_class(const char *sc) {
         sched_curr = &fifo_class;
     else if (!strcmp(sc, "fffs"))
         sched_curr = &fffs_class;
+    else if (!strcmp(sc, "prio"))
+        sched_curr = &prio_class;
+    else if (!strcmp(sc, "edf"))
+        sched_curr = &edf_class;
+    else if (!strcmp(sc, "fair"))
+        sched_curr = &fair_class;
+    else if (!strcmp(sc, "ws"))
+        sched_curr = &ws_class;
+    else if (!strcmp(sc, "heft"))
+        sched_curr = &heft_class;
     else
         return -1;
 
@@ -1044,6 +1872,12 @@ static int sched_set_resource_policy(const char *policy) {
         sched_curr->respol = &delay_policy;
     else if (!strcmp(policy, "hybrid"))
         sched_curr->respol = &hybrid_policy;
+    else if (!strcmp(policy, "lws"))
+        sched_curr->respol = &lws_policy;
+    else if (!strcmp(policy, "eft"))
+        sched_curr->respol = &eft_policy;
+    else if (!strcmp(policy, "xfer"))
+        sched_curr->respol = &xfer_policy;
     else
         return -1;
 
@@ -1063,9 +1897,10 @@ static int sched_set_eviction_policy(const char *policy) {
 
 static void print_help(const char *prog) {
     fprintf(stderr, "Usage: %s [options]\n"
-                    "\t-s, --sched-class {fifo|fffs}  Select scheduler class (def = 'fifo')\n"
-                    "\t-p, --res-policy {ff|rr|delay|hybrid|lws}  Select resource policy (def = class dependant)\n"
+                    "\t-s, --sched-class {fifo|fffs|prio|edf|fair|ws|heft}  Select scheduler class (def = 'fifo')\n"
+                    "\t-p, -r, --res-policy {ff|rr|delay|hybrid|lws|eft|xfer}  Select resource policy (def = class dependant)\n"
                     "\t-e, --evict_policy {lru}  Select eviction policy (def = lru)\n"
+                    "\t-t, --sched-threads N     Number of scheduling threads (def = 1)\n"
                     "\t-h, --help                     Show this help\n",
             prog);
 
@@ -1078,6 +1913,8 @@ static void parse_arguments(int argc, char *argv[]) {
         {"sched-class", required_argument, NULL, 's'},
         {"res-policy", required_argument, NULL, 'p'},
         {"evict-policy", required_argument, NULL, 'e'},
+        {"sched-threads", required_argument, NULL, 't'},
+        {NULL, 0, NULL, 0},
     };
 
     const char *policy = NULL;
@@ -1086,7 +1923,7 @@ static void parse_arguments(int argc, char *argv[]) {
     int opt;
 
     do {
-        opt = getopt_long(argc, argv, "s:p:e:h", long_args, NULL);
+        opt = getopt_long(argc, argv, "s:p:r:e:t:h", long_args, NULL);
 
         switch (opt) {
         case 's':
@@ -1098,12 +1935,21 @@ static void parse_arguments(int argc, char *argv[]) {
             else
                 Dprintf("Set scheduler class: '%s'\n", optarg);
             break;
-        case 'p':
+        case 'p': /* fall through */
+        case 'r':
             policy = optarg;
             break;
         case 'e':
             evict_policy = optarg;
             break;
+        case 't':
+            if (atoi(optarg) < 1) {
+                fprintf(stderr, "parse_arguments: invalid number of scheduling threads '%s'.\n",
+                        optarg);
+                print_help(argv[0]);
+            }
+            sched_nthreads = atoi(optarg);
+            break;
         case 'h': /* fall through */
         case '?':
             print_help(argv[0]);
@@ -1162,24 +2008,32 @@ int mcl_initiate_scheduler(int argc, char *argv[]) {
         goto err_setup;
     }
 
-    sched_req_table = ph_init(1u << SCHED_REQ_TABLE_SIZE_SHIFT);
+    if (sched_pools_init()) {
+        eprintf("Error setting up scheduler memory pools.");
+        goto err_sched;
+    }
 
-    if (!sched_req_table) {
+    if (sched_request_table_init()) {
         eprintf("Error setting up scheduler request table.");
-        goto err_setup;
+        goto err_pools;
     }
 
-    Dprintf("Request table initialized: mask=%08lx count=%lu",
-            sched_req_table->mask, ph_count(sched_req_table));
+    Dprintf("Request table initialized: %u shards of %u entries",
+            SCHED_REQ_SHARDS, 1u << SCHED_REQ_SHARD_SIZE_SHIFT);
+
+    if (sched_model_init()) {
+        eprintf("Error setting up scheduler runtime model.");
+        goto err_table;
+    }
 
     if (pthread_create(&rcv_tid, NULL, receiver, NULL)) {
         eprintf("Error starting scheduling receiver thread.");
-        goto err_sched;
+        goto err_model;
     }
 
     if (schedule()) {
         eprintf("Error executing scheduling algorithm!");
-        goto err_sched;
+        goto err_model;
     }
 
     Dprintf("Minos scheduler shutting down.");
@@ -1187,6 +2041,10 @@ int mcl_initiate_scheduler(int argc, char *argv[]) {
     pthread_join(rcv_tid, NULL);
     Dprintf("Receiver thread terminated.");
 
+    sched_model_fini();
+    sched_request_table_fini();
+    sched_pools_fini();
+
     if (sched_finit()) {
         Dprintf("Error finilizing FIFO scheduler");
         goto err_setup;
@@ -1199,6 +2057,12 @@ int mcl_initiate_scheduler(int argc, char *argv[]) {
 
     return 0;
 
+err_model:
+    sched_model_fini();
+err_table:
+    sched_request_table_fini();
+err_pools:
+    sched_pools_fini();
 err_sched:
     sched_finit();
 err_setup:
@@ -101,6 +101,12 @@ int main(int argc, char** argv)
 	else
 		failed();
 
+	printf("%-40s", "Checking invalid priority ...");
+	if(mcl_task_set_priority(hdl, MCL_TASK_PRIO_MAX + 1) == -MCL_ERR_INVARG)
+		detected();
+	else
+		failed();
+
 	mcl_hdl_free(hdl);
 	
 	printf("%-40s", "Checking PE[0] = 0 ...");
@@ -159,6 +165,16 @@ int main(int argc, char** argv)
 		printf("Error setting task output. Aboring.\n");
 		goto err_hdl;
 	}		
+
+	if(mcl_task_set_priority(hdl, MCL_TASK_PRIO_MAX)){
+		printf("Error setting task priority. Aborting.\n");
+		goto err_hdl;
+	}
+
+	if(mcl_task_set_deadline(hdl, 10000000)){
+		printf("Error setting task deadline. Aborting.\n");
+		goto err_hdl;
+	}
 	
 	if(mcl_exec(hdl, pes, NULL, MCL_TASK_ANY)){
 		printf("Error executing task! Aborting.\n");
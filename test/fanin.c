@@ -0,0 +1,180 @@
+#include <fcntl.h>
+#include <getopt.h>
+#include <math.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "utils.h"
+#include <minos.h>
+
+/* More than fit in a single EXE message */
+#define FANIN 300
+
+int test_mcl(uint64_t *X, uint64_t *Y, uint64_t *V, size_t N) {
+    struct timespec start, end;
+    mcl_handle **hdl = NULL;
+    uint64_t pes[MCL_DEV_DIMS] = {N, 1, 1};
+    const size_t msize = N * sizeof(uint64_t);
+    unsigned int i;
+    unsigned int errs = 0;
+    double rtime;
+    int ret;
+    char src_path[1024];
+
+    strcpy(src_path, XSTR(_MCL_TEST_PATH));
+    strcat(src_path, "/integrate.cl");
+
+    hdl = (mcl_handle **)malloc(sizeof(mcl_handle *) * (FANIN + 1));
+    if (!hdl) {
+        printf("Error allocating memmory. Aborting.\n");
+        goto err;
+    }
+
+    mcl_prg_load(src_path, "", MCL_PRG_SRC);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    /*
+     * Task i < FANIN computes X_i += V, the last one Y += X_(FANIN - 1): Y is
+     * only right if the last dependency, which travels in the last DEPS
+     * message, ran before it.
+     */
+    for (i = 0; i <= FANIN; i++) {
+        uint64_t *out = i < FANIN ? &X[i * N] : Y;
+        uint64_t *in = i < FANIN ? V : &X[(FANIN - 1) * N];
+
+        hdl[i] = mcl_task_create();
+        if (!hdl[i]) {
+            printf("Error creating MCL task. Aborting.\n");
+            goto err_hdl;
+        }
+        if (mcl_task_set_kernel(hdl[i], "VADD", 2)) {
+            printf("Error setting %s kernel. Aborting.\n", "VADD");
+            goto err_hdl;
+        }
+        if (mcl_task_set_arg(hdl[i], 0, (void *)out, msize, MCL_ARG_BUFFER | MCL_ARG_INPUT | MCL_ARG_OUTPUT)) {
+            printf("Error setting up task input A. Aborting.\n");
+            goto err_hdl;
+        }
+        if (mcl_task_set_arg(hdl[i], 1, (void *)in, msize, MCL_ARG_BUFFER | MCL_ARG_INPUT)) {
+            printf("Error setting up task input B. Aborting.\n");
+            goto err_hdl;
+        }
+
+        if (i < FANIN)
+            ret = mcl_exec(hdl[i], pes, NULL, flags);
+        else
+            ret = mcl_exec_with_dependencies(hdl[i], pes, NULL, flags, FANIN, hdl);
+
+        if (ret) {
+            printf("Error submitting task (%d)! Aborting.\n", ret);
+            goto err_hdl;
+        }
+    }
+
+    if (mcl_wait_all()) {
+        printf("Error waiting for requests to complete!\n");
+        goto err_hdl;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    for (i = 0; i <= FANIN; i++)
+        if (hdl[i]->ret == MCL_RET_ERROR) {
+            printf("Error executing task %u!\n", i);
+            errs++;
+        }
+    if (errs)
+        printf("Detected %u errors!\n", errs);
+    else {
+        rtime = ((FPTYPE)tdiff(end, start)) / BILLION;
+        printf("Done.\n  Test time : %f seconds\n", rtime);
+        printf("  Throughput: %f tasks/s\n", ((FPTYPE)(FANIN + 1)) / rtime);
+    }
+
+    for (i = 0; i <= FANIN; i++)
+        mcl_hdl_free(hdl[i]);
+    free(hdl);
+
+    return errs;
+
+err_hdl:
+    free(hdl);
+err:
+    return -1;
+}
+
+int main(int argc, char **argv) {
+    uint64_t *X, *Y, *V;
+    int i, ret = 0;
+
+    mcl_banner("Wide Fan-in Dependency Test");
+
+    parse_global_opts(argc, argv);
+
+    switch (type) {
+    case 0: {
+        flags = MCL_TASK_CPU;
+        break;
+    }
+    case 1: {
+        flags = MCL_TASK_GPU;
+        break;
+    }
+    case 2: {
+        flags = MCL_TASK_ANY;
+        break;
+    }
+    default: {
+        printf("Unrecognized resource type (%" PRIu64 "). Aborting.\n", type);
+        return -1;
+    }
+    }
+
+    mcl_init(workers, 0x0);
+
+    X = (uint64_t *)malloc(FANIN * size * sizeof(uint64_t));
+    Y = (uint64_t *)malloc(size * sizeof(uint64_t));
+    V = (uint64_t *)malloc(size * sizeof(uint64_t));
+
+    if (!X || !Y || !V) {
+        printf("Error allocating vectors. Aborting.");
+        ret = -1;
+        goto err;
+    }
+
+    memset(X, 0, FANIN * size * sizeof(uint64_t));
+    for (i = 0; i < size; ++i) {
+        Y[i] = 0;
+        V[i] = 1;
+    }
+
+    ret = test_mcl(X, Y, V, size);
+    if (ret) {
+        printf("Error performing computation (%d). Aborting.\n", ret);
+        ret = -1;
+    }
+
+    for (i = 0; i < FANIN * size && !ret; i++) {
+        if (X[i] != 1) {
+            ret = -1;
+            printf("Error verifying the results.\n");
+        }
+    }
+
+    for (i = 0; i < size && !ret; i++) {
+        if (Y[i] != 1) {
+            ret = -1;
+            printf("Error verifying the results.\n");
+        }
+    }
+
+    mcl_finit();
+    mcl_verify(ret);
+
+err:
+    free(X);
+    free(Y);
+    free(V);
+
+    return ret;
+}